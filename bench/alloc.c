@@ -0,0 +1,129 @@
+// Allocators behind reallocate(), against plain malloc.
+//
+// Times compiling (and freeing) a large program with its arrays in the program's
+// arena and then in malloc, and churns a working set of small runtime-sized
+// objects through a Pool and through malloc.
+//
+//     cc -O2 -Isrc -o alloc bench/alloc.c $(ls src/*.c | grep -v main.c) -lm
+//
+//     ./alloc
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "compiler.h"
+#include "memory.h"
+#include "program.h"
+
+#define TERMS 200000
+#define ROUNDS 10
+
+#define LIVE_OBJECTS 4096
+#define CHURN 20000000
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Compiles the source ROUNDS times with the program's arrays in allocator, or in
+// the program's own arena when allocator is NULL, and returns the best time.
+static double timeCompile(const char *src, size_t length, Allocator *allocator)
+{
+    double best = 0;
+
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        double start = now();
+
+        Program program;
+        initProgram(&program);
+        if (allocator != NULL)
+            program.allocator = allocator;
+
+        if (!compile(src, length, &program))
+            exit(1);
+
+        freeProgram(&program);
+
+        double elapsed = now() - start;
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    return best;
+}
+
+// Frees and reallocates random members of a working set of objects between 16 and
+// 256 bytes, the way strings and other small objects come and go at runtime.
+static double timeChurn(Allocator *allocator)
+{
+    static void *objects[LIVE_OBJECTS];
+    static size_t sizes[LIVE_OBJECTS];
+    uint32_t random = 12345;
+
+    Allocator *previous = useAllocator(allocator);
+    double start = now();
+
+    for (int i = 0; i < LIVE_OBJECTS; ++i)
+    {
+        sizes[i] = 16 + i % 241;
+        objects[i] = reallocate(NULL, 0, sizes[i]);
+    }
+
+    for (int i = 0; i < CHURN; ++i)
+    {
+        random = random * 1664525u + 1013904223u;
+        int victim = (random >> 8) % LIVE_OBJECTS;
+
+        reallocate(objects[victim], sizes[victim], 0);
+        sizes[victim] = 16 + (random >> 20) % 241;
+        objects[victim] = reallocate(NULL, 0, sizes[victim]);
+        memset(objects[victim], 0, 16);
+    }
+
+    for (int i = 0; i < LIVE_OBJECTS; ++i)
+        reallocate(objects[i], sizes[i], 0);
+
+    double elapsed = now() - start;
+    useAllocator(previous);
+
+    return elapsed;
+}
+
+int main()
+{
+    // One long expression over distinct literals, so the code, line table and
+    // constant pool all grow. Multiplying true keeps the terms from being folded;
+    // the program is only compiled, never run.
+    char *src = malloc((size_t)TERMS * 32);
+    size_t length = (size_t)sprintf(src, "0");
+    for (int i = 1; i <= TERMS; ++i)
+        length += (size_t)sprintf(src + length, " %s (true * %d.25)\n", i % 2 ? "+" : "-", i);
+
+    double arena = timeCompile(src, length, NULL);
+    double malloced = timeCompile(src, length, &mallocAllocator);
+
+    printf("compile %d terms (%.1f MiB of source)\n", TERMS, length / 1048576.0);
+    printf("  program arena        %.2f ms\n", arena * 1000);
+    printf("  malloc               %.2f ms\n", malloced * 1000);
+
+    Pool pool;
+    initPool(&pool);
+    double pooled = timeChurn(&pool.allocator);
+    freePool(&pool);
+
+    double churned = timeChurn(&mallocAllocator);
+
+    printf("churn %d objects of 16-256 bytes\n", LIVE_OBJECTS);
+    printf("  pool                 %.1f M allocations/s\n", CHURN / pooled / 1e6);
+    printf("  malloc               %.1f M allocations/s\n", CHURN / churned / 1e6);
+
+    free(src);
+
+    return 0;
+}
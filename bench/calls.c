@@ -0,0 +1,130 @@
+// Calls-per-second benchmark for OP_CALL, OP_TAIL_CALL, OP_RETURN and closures.
+//
+// Compiles a few small programs that do little but call functions and times them
+// through interpretProgram(). Every call is counted, the loops around them are not
+// subtracted, so the rates are a floor.
+//
+//     cc -O2 -Isrc -o calls bench/calls.c $(ls src/*.c | grep -v main.c) -lm
+//
+//     ./calls
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "compiler.h"
+#include "cvm.h"
+#include "program.h"
+
+#define RUNS 10
+
+typedef struct
+{
+    const char *name;
+    const char *src;
+    long calls;
+} Case;
+
+static const Case cases[] = {
+    // A call to a function that returns its argument, from a loop.
+    {"loop", "fun id(x) x end\n"
+             "scoped i = 0\n"
+             "while i < 1000000 do\n"
+             "    id(i)\n"
+             "    i = i + 1\n"
+             "end\n",
+     1000000},
+    // Recursion that nests, fib(n) makes 2 * fib(n + 1) - 1 calls.
+    {"recursive", "fun fib(n)\n"
+                  "    if n < 2 then return n end\n"
+                  "    return fib(n - 1) + fib(n - 2)\n"
+                  "end\n"
+                  "fib(25)\n",
+     2 * 121393 - 1},
+    // Recursion in tail position, which runs in a single frame.
+    {"tail", "fun down(n)\n"
+             "    if n == 0 then return 0 end\n"
+             "    return down(n - 1)\n"
+             "end\n"
+             "down(1000000)\n",
+     1000001},
+    // A callback that captures a variable of the caller's, copied into it once.
+    {"callback", "fun each(n, f)\n"
+                 "    scoped i = 0\n"
+                 "    while i < n do\n"
+                 "        f(i)\n"
+                 "        i = i + 1\n"
+                 "    end\n"
+                 "end\n"
+                 "scoped k = 2\n"
+                 "each(1000000, fun (x) x * k end)\n",
+     1000001},
+    // A closure made by every other call, and called right away.
+    {"closure", "fun adder(k) fun (x) x + k end end\n"
+                "scoped i = 0\n"
+                "while i < 1000000 do\n"
+                "    adder(i)(i)\n"
+                "    i = i + 1\n"
+                "end\n",
+     2000000},
+    // A callback that assigns a variable of the caller's, which it shares.
+    {"shared", "fun each(n, f)\n"
+               "    scoped i = 0\n"
+               "    while i < n do\n"
+               "        f(i)\n"
+               "        i = i + 1\n"
+               "    end\n"
+               "end\n"
+               "scoped total = 0\n"
+               "each(1000000, fun (x) total = total + x end)\n",
+     1000001},
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main()
+{
+    initCVM(&mallocAllocator);
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        Program program;
+        initProgram(&program);
+
+        if (!compile(cases[i].src, strlen(cases[i].src), &program))
+        {
+            fprintf(stderr, "%s: benchmark program failed to compile\n", cases[i].name);
+            return 1;
+        }
+
+        double best = 0;
+        for (int run = 0; run < RUNS; ++run)
+        {
+            double start = now();
+            if (interpretProgram(&program) != INTERPRET_OK)
+            {
+                fprintf(stderr, "%s: benchmark program failed\n", cases[i].name);
+                return 1;
+            }
+            double elapsed = now() - start;
+
+            if (best == 0 || elapsed < best)
+                best = elapsed;
+        }
+
+        fprintf(stderr, "%-10s %ld calls, best of %d: %.3f ms, %.1f M calls/s\n", cases[i].name, cases[i].calls, RUNS,
+                best * 1e3, cases[i].calls / best / 1e6);
+
+        freeProgram(&program);
+    }
+
+    freeCVM();
+
+    return 0;
+}
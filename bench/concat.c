@@ -0,0 +1,112 @@
+// Building a long string by appending to it, the way s = s @ i would in a loop.
+//
+// Appends numbers and short strings N times through concatenate(), then flattens
+// the result once, and does the same with a copy per append, as concatenation
+// without ropes would (copying and hashing everything built so far). The time per
+// append stays flat for ropes and grows with N for copies.
+//
+//     cc -O2 -Isrc -o concat bench/concat.c $(ls src/*.c | grep -v main.c) -lm
+//
+//     ./concat
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "cvm.h"
+#include "object.h"
+#include "value.h"
+
+#define MIN_APPENDS 2000
+#define MAX_APPENDS 128000
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static Value piece(int i, Value separator)
+{
+    return i % 2 ? NUMBER_VAL(i) : separator;
+}
+
+static double timeRopes(int appends, ObjString **result)
+{
+    Value separator = OBJ_VAL(copyString(", ", 2));
+    double start = now();
+
+    Value string = OBJ_VAL(copyString("", 0));
+    for (int i = 0; i < appends; ++i)
+        string = concatenate(string, piece(i, separator));
+
+    *result = AS_STRING(flattenValue(string));
+
+    return now() - start;
+}
+
+static double timeCopies(int appends, ObjString **result)
+{
+    Value separator = OBJ_VAL(copyString(", ", 2));
+    double start = now();
+
+    char *chars = malloc(1);
+    int length = 0;
+    uint32_t hash = 0;
+
+    for (int i = 0; i < appends; ++i)
+    {
+        char buffer[NUMBER_MAX_LENGTH];
+        Value value = piece(i, separator);
+        const char *pieceChars = IS_NUMBER(value) ? buffer : AS_CSTRING(value);
+        int pieceLength = IS_NUMBER(value) ? formatNumber(AS_NUMBER(value), buffer) : AS_STRING(value)->length;
+
+        char *copy = malloc(length + pieceLength);
+        memcpy(copy, chars, length);
+        memcpy(copy + length, pieceChars, pieceLength);
+        free(chars);
+
+        chars = copy;
+        length += pieceLength;
+        hash ^= hashString(chars, length); // Interning every intermediate string hashes it.
+    }
+
+    double elapsed = now() - start;
+
+    *result = copyString(chars, length);
+    free(chars);
+
+    if (hash == 0)
+        printf("(hash 0)\n");
+
+    return elapsed;
+}
+
+int main()
+{
+    printf("%10s %12s %14s %14s\n", "appends", "length", "rope ns/op", "copy ns/op");
+
+    for (int appends = MIN_APPENDS; appends <= MAX_APPENDS; appends *= 2)
+    {
+        initCVM(&mallocAllocator);
+
+        ObjString *roped;
+        ObjString *copied;
+        double ropes = timeRopes(appends, &roped);
+        double copies = timeCopies(appends, &copied);
+
+        if (roped != copied)
+        {
+            fprintf(stderr, "Results differ.\n");
+            return 1;
+        }
+
+        printf("%10d %12d %14.1f %14.1f\n", appends, roped->length, ropes / appends * 1e9, copies / appends * 1e9);
+
+        freeCVM();
+    }
+
+    return 0;
+}
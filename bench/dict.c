@@ -0,0 +1,301 @@
+// Dictionary lookups and inserts, against a naive chained hash.
+//
+// Inserts N keys into a new dictionary, then looks each one up and looks up as
+// many keys that aren't there, and does the same with a table of buckets holding
+// linked lists of nodes, one malloc() per key, that doubles when it is full. Keys
+// are interned strings, numbers that go to the hash part, and 0, 1, 2..., which go
+// to the array part of a dictionary. Both tables take the same key hash, and the
+// lookups go in a shuffled order, not the one the chained nodes were allocated in.
+//
+//     cc -O2 -Isrc -o dict bench/dict.c $(ls src/*.c | grep -v main.c) -lm
+//
+//     ./dict
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "cvm.h"
+#include "dict.h"
+#include "object.h"
+#include "value.h"
+
+#define KEYS 200000
+#define RUNS 5
+
+// The order keys are looked up in.
+static int order[KEYS];
+
+typedef struct Node
+{
+    Value key;
+    Value value;
+    struct Node *next;
+} Node;
+
+typedef struct
+{
+    Node **buckets;
+    int bucketCount;
+    int count;
+} Chained;
+
+typedef struct
+{
+    double insert;
+    double hit;
+    double miss;
+} Times;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t hashOf(Value key)
+{
+    uint64_t bits;
+
+    if (IS_STRING(key))
+        bits = AS_STRING(key)->hash;
+    else
+    {
+        double number = AS_NUMBER(key);
+        memcpy(&bits, &number, sizeof(bits));
+    }
+
+    bits ^= bits >> 32;
+    bits *= 0x9e3779b97f4a7c15u;
+    return (uint32_t)(bits >> 32);
+}
+
+static void chainedInit(Chained *table)
+{
+    table->bucketCount = 16;
+    table->buckets = calloc(table->bucketCount, sizeof(Node *));
+    table->count = 0;
+}
+
+static void chainedFree(Chained *table)
+{
+    for (int i = 0; i < table->bucketCount; ++i)
+    {
+        Node *node = table->buckets[i];
+        while (node != NULL)
+        {
+            Node *next = node->next;
+            free(node);
+            node = next;
+        }
+    }
+
+    free(table->buckets);
+}
+
+static Node **chainedFind(Chained *table, Value key)
+{
+    Node **link = &table->buckets[hashOf(key) & (table->bucketCount - 1)];
+
+    while (*link != NULL && !areValuesIdentical((*link)->key, key))
+        link = &(*link)->next;
+
+    return link;
+}
+
+static void chainedSet(Chained *table, Value key, Value value)
+{
+    Node **link = chainedFind(table, key);
+
+    if (*link != NULL)
+    {
+        (*link)->value = value;
+        return;
+    }
+
+    Node *node = malloc(sizeof(Node));
+    node->key = key;
+    node->value = value;
+    node->next = NULL;
+    *link = node;
+
+    if (++table->count <= table->bucketCount)
+        return;
+
+    // Relink every node into twice the buckets.
+    int bucketCount = table->bucketCount * 2;
+    Node **buckets = calloc(bucketCount, sizeof(Node *));
+
+    for (int i = 0; i < table->bucketCount; ++i)
+    {
+        Node *node = table->buckets[i];
+        while (node != NULL)
+        {
+            Node *next = node->next;
+            Node **bucket = &buckets[hashOf(node->key) & (bucketCount - 1)];
+            node->next = *bucket;
+            *bucket = node;
+            node = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucketCount = bucketCount;
+}
+
+static Value chainedGet(Chained *table, Value key)
+{
+    Node *node = *chainedFind(table, key);
+    return node != NULL ? node->value : NONE_VAL;
+}
+
+// Adds every lookup's value up, so none of them can be left out.
+static double sum(Value value)
+{
+    return IS_NUMBER(value) ? AS_NUMBER(value) : 0;
+}
+
+static Times timeDict(Value *keys, Value *missing)
+{
+    Times best = {0, 0, 0};
+    double total = 0;
+
+    for (int run = 0; run < RUNS; ++run)
+    {
+        double start = now();
+        ObjDict *dict = newDict(0, 0);
+        for (int i = 0; i < KEYS; ++i)
+            dictSet(dict, keys[i], NUMBER_VAL(i));
+        double insert = now() - start;
+
+        start = now();
+        for (int i = 0; i < KEYS; ++i)
+            total += sum(dictGet(dict, keys[order[i]]));
+        double hit = now() - start;
+
+        start = now();
+        for (int i = 0; i < KEYS; ++i)
+            total += sum(dictGet(dict, missing[order[i]]));
+        double miss = now() - start;
+
+        if (run == 0 || insert < best.insert)
+            best.insert = insert;
+        if (run == 0 || hit < best.hit)
+            best.hit = hit;
+        if (run == 0 || miss < best.miss)
+            best.miss = miss;
+    }
+
+    if (total != (double)KEYS * (KEYS - 1) / 2 * RUNS)
+        fprintf(stderr, "dictionary lookups went wrong\n");
+
+    return best;
+}
+
+static Times timeChained(Value *keys, Value *missing)
+{
+    Times best = {0, 0, 0};
+    double total = 0;
+
+    for (int run = 0; run < RUNS; ++run)
+    {
+        Chained table;
+
+        double start = now();
+        chainedInit(&table);
+        for (int i = 0; i < KEYS; ++i)
+            chainedSet(&table, keys[i], NUMBER_VAL(i));
+        double insert = now() - start;
+
+        start = now();
+        for (int i = 0; i < KEYS; ++i)
+            total += sum(chainedGet(&table, keys[order[i]]));
+        double hit = now() - start;
+
+        start = now();
+        for (int i = 0; i < KEYS; ++i)
+            total += sum(chainedGet(&table, missing[order[i]]));
+        double miss = now() - start;
+
+        chainedFree(&table);
+
+        if (run == 0 || insert < best.insert)
+            best.insert = insert;
+        if (run == 0 || hit < best.hit)
+            best.hit = hit;
+        if (run == 0 || miss < best.miss)
+            best.miss = miss;
+    }
+
+    if (total != (double)KEYS * (KEYS - 1) / 2 * RUNS)
+        fprintf(stderr, "chained lookups went wrong\n");
+
+    return best;
+}
+
+static void report(const char *name, Times times)
+{
+    fprintf(stderr, "%-18s insert %7.1f  hit %7.1f  miss %7.1f  M keys/s\n", name, KEYS / times.insert / 1e6,
+            KEYS / times.hit / 1e6, KEYS / times.miss / 1e6);
+}
+
+static void compare(const char *name, Value *keys, Value *missing)
+{
+    char label[32];
+
+    snprintf(label, sizeof(label), "%s swiss", name);
+    report(label, timeDict(keys, missing));
+    snprintf(label, sizeof(label), "%s chained", name);
+    report(label, timeChained(keys, missing));
+}
+
+int main()
+{
+    initCVM(&mallocAllocator);
+
+    for (int i = 0; i < KEYS; ++i)
+        order[i] = i;
+    srand(1);
+    for (int i = KEYS - 1; i > 0; --i)
+    {
+        int j = rand() % (i + 1);
+        int swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+
+    Value *keys = malloc(KEYS * sizeof(Value));
+    Value *missing = malloc(KEYS * sizeof(Value));
+
+    for (int i = 0; i < KEYS; ++i)
+    {
+        char buffer[32];
+        keys[i] = OBJ_VAL(copyString(buffer, snprintf(buffer, sizeof(buffer), "key%d", i)));
+        missing[i] = OBJ_VAL(copyString(buffer, snprintf(buffer, sizeof(buffer), "none%d", i)));
+    }
+    compare("strings", keys, missing);
+
+    // Spread over a range that no array part reaches.
+    for (int i = 0; i < KEYS; ++i)
+    {
+        keys[i] = NUMBER_VAL(i * 7919.5);
+        missing[i] = NUMBER_VAL(-i - 1.0);
+    }
+    compare("numbers", keys, missing);
+
+    for (int i = 0; i < KEYS; ++i)
+    {
+        keys[i] = NUMBER_VAL(i);
+        missing[i] = NUMBER_VAL(KEYS + i);
+    }
+    compare("sequential", keys, missing);
+
+    free(keys);
+    free(missing);
+    freeCVM();
+
+    return 0;
+}
@@ -0,0 +1,106 @@
+// Opcodes-per-second benchmark for the run() loop.
+//
+// Builds a long straight-line Program of arithmetic opcodes by hand (so the
+// constant limit of the compiler doesn't get in the way) and executes it
+// repeatedly through interpretProgram().
+//
+//     cc -O2 -Isrc -o dispatch bench/dispatch.c $(ls src/*.c | grep -v main.c) -lm
+//     cc -O2 -Isrc -DNO_COMPUTED_GOTO -o dispatch-switch bench/dispatch.c $(ls src/*.c | grep -v main.c) -lm
+//
+//     ./dispatch-switch > /dev/null && ./dispatch > /dev/null
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "common.h"
+#include "cvm.h"
+#include "program.h"
+
+#define BLOCKS 200000
+#define RUNS 50
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, const char *argv[])
+{
+    int blocks = argc > 1 ? atoi(argv[1]) : BLOCKS;
+
+    Program program;
+    initProgram(&program);
+
+    uint8_t one = (uint8_t)addConst(&program, NUMBER_VAL(1));
+    uint8_t two = (uint8_t)addConst(&program, NUMBER_VAL(2));
+
+    writeProgram(&program, OP_CONST, 1);
+    writeProgram(&program, one, 1);
+    long opcodes = 1;
+
+    // Each unit is followed by its inverse so acc stays unchanged and the stack stays at depth
+    // two. Units are picked at random so the branch predictor can't learn the handler sequence.
+    uint8_t units[][3] = {{OP_CONST, two, OP_ADD},
+                          {OP_CONST, two, OP_SUBTRACT},
+                          {OP_CONST, two, OP_MULTIPLY},
+                          {OP_CONST, two, OP_DIVIDE},
+                          {OP_NEGATE}};
+    int unitLength[] = {3, 3, 3, 3, 1};
+    int inverse[] = {1, 0, 3, 2, 4};
+
+    srand(1);
+    for (int i = 0; i < blocks; ++i)
+    {
+        int unit = rand() % 5;
+        for (int k = 0; k < 2; ++k, unit = inverse[unit])
+        {
+            for (int j = 0; j < unitLength[unit]; ++j)
+                writeProgram(&program, units[unit][j], 1);
+            opcodes += unit == 4 ? 1 : 2;
+        }
+    }
+
+    // Finish on the comparison and logic opcodes.
+    uint8_t tail[] = {OP_CONST, one, OP_LESS, OP_NOT, OP_TRUE, OP_EQUAL, OP_NONE, OP_EQUAL, OP_FALSE, OP_EQUAL};
+    for (size_t j = 0; j < sizeof(tail); ++j)
+        writeProgram(&program, tail[j], 1);
+    opcodes += 9;
+
+    // The top level returns acc, which is dropped.
+    writeProgram(&program, OP_RETURN, 1);
+    opcodes += 1;
+    program.maxStackDepth = 2;
+
+    initCVM(&mallocAllocator);
+
+    double best = 0;
+    for (int run = 0; run < RUNS; ++run)
+    {
+        double start = now();
+        if (interpretProgram(&program) != INTERPRET_OK)
+        {
+            fprintf(stderr, "benchmark program failed\n");
+            return 1;
+        }
+        double elapsed = now() - start;
+
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+#ifdef COMPUTED_GOTO
+    const char *dispatch = "computed goto";
+#else
+    const char *dispatch = "switch";
+#endif
+
+    fprintf(stderr, "%-14s %ld opcodes, best of %d: %.3f ms, %.1f M opcodes/s\n",
+            dispatch, opcodes, RUNS, best * 1e3, opcodes / best / 1e6);
+
+    freeProgram(&program);
+    freeCVM();
+
+    return 0;
+}
@@ -0,0 +1,104 @@
+// Lexer throughput over large in-memory sources.
+//
+// Builds two sources of a few tens of MB in memory and times scanToken() over each:
+// hand-written looking code with short tokens, and generated code with long
+// identifiers, literals, strings and comments.
+//
+//     cc -O2 -Isrc -o lexer bench/lexer.c $(ls src/*.c | grep -v main.c) -lm
+//     cc -O2 -Isrc -mavx2 -o lexer-avx2 bench/lexer.c $(ls src/*.c | grep -v main.c) -lm
+//     cc -O2 -Isrc -DNO_SIMD_LEXER -o lexer-scalar bench/lexer.c $(ls src/*.c | grep -v main.c) -lm
+//
+//     ./lexer && ./lexer-avx2 && ./lexer-scalar
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "common.h"
+#include "lexer.h"
+
+#define SOURCE_LINES 400000
+#define ROUNDS 10
+
+static const char *shortRuns[] = {
+    "  total = total + 12.5 * scale\n",
+    "  -- next row\n",
+    "  if (i < 100 and !done) print 'row'\n",
+    "    r = (a - b) / (c + 0.1)\n",
+    "\n",
+    "  var x = 1; var y = 22; var z = 333\n",
+};
+
+static const char *longRuns[] = {
+    "                accumulated_total_for_generated_region_00417 = accumulated_total_for_generated_region_00417 + 1234567.891011\n",
+    "                -- generated from table regional_sales_by_quarter_2019, column 17; do not edit this file by hand\n",
+    "                print 'Quarterly regional summary: all figures are in thousands, rounded to the nearest unit'\n",
+    "                normalized_value_of_measurement_00417 = raw_value_of_measurement_00417 / 1000000000.000001\n",
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void lexSource(const char *name, const char **lines, int numOfLines)
+{
+    size_t length = 0;
+    for (int i = 0; i < SOURCE_LINES; ++i)
+        length += strlen(lines[i % numOfLines]);
+
+    char *source = malloc(length + 1);
+    char *end = source;
+    for (int i = 0; i < SOURCE_LINES; ++i)
+    {
+        size_t lineLength = strlen(lines[i % numOfLines]);
+        memcpy(end, lines[i % numOfLines], lineLength);
+        end += lineLength;
+    }
+    *end = '\0';
+
+    double best = 0;
+    long tokens = 0;
+    int lastLine = 0;
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        double start = now();
+        initLexer(source, end);
+        tokens = 0;
+
+        Token token;
+        do
+        {
+            token = scanToken();
+            ++tokens;
+        } while (token.type != TOKEN_EOF);
+
+        double elapsed = now() - start;
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+        lastLine = token.line;
+    }
+
+    printf("  %-12s %6.1f MiB %9d lines %9ld tokens %7.1f M tokens/s %6.0f MiB/s\n", name, length / 1048576.0,
+           lastLine - 1, tokens, tokens / best / 1e6, length / best / 1048576.0);
+
+    free(source);
+}
+
+int main()
+{
+#if defined(SIMD_LEXER) && defined(__AVX2__)
+    printf("avx2 lexer\n");
+#elif defined(SIMD_LEXER)
+    printf("sse2 lexer\n");
+#else
+    printf("scalar lexer\n");
+#endif
+
+    lexSource("short runs", shortRuns, sizeof(shortRuns) / sizeof(shortRuns[0]));
+    lexSource("long runs", longRuns, sizeof(longRuns) / sizeof(longRuns[0]));
+
+    return 0;
+}
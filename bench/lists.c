@@ -0,0 +1,167 @@
+// Reductions over lists of numbers, unboxed against boxed.
+//
+// Times sumNumbers(), minNumbers(), dotNumbers() and scaleNumbers() over a double[]
+// of N numbers, the array part of a list that holds nothing else, and the same
+// loops over a Value[], checking every value is a number the way they would have
+// to over a list that had held something else. A small list stays in cache, a
+// large one shows memory bandwidth, where an unboxed number takes half the room
+// unless values are NaN-boxed already.
+//
+//     cc -O2 -Isrc -o lists bench/lists.c $(ls src/*.c | grep -v main.c) -lm
+//     cc -O2 -Isrc -mavx -o lists-avx bench/lists.c $(ls src/*.c | grep -v main.c) -lm
+//     cc -O2 -Isrc -DNO_SIMD_LIST -o lists-scalar bench/lists.c $(ls src/*.c | grep -v main.c) -lm
+//
+//     ./lists && ./lists-avx && ./lists-scalar
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "common.h"
+#include "numeric.h"
+#include "value.h"
+
+#define SMALL 4096
+#define LARGE (1 << 22)
+// Numbers gone through per measurement, whatever the size of the list.
+#define WORK (1 << 26)
+#define RUNS 5
+
+typedef enum
+{
+    SUM,
+    MIN,
+    DOT,
+    SCALE,
+} Kernel;
+
+static const char *kernelNames[] = {"sum", "min", "dot", "scale"};
+
+// Keeps the results alive.
+static double sink;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void runUnboxed(Kernel kernel, double *numbers, double *result, int count)
+{
+    switch (kernel)
+    {
+    case SUM:
+        sink += sumNumbers(numbers, count);
+        break;
+    case MIN:
+        sink += minNumbers(numbers, count);
+        break;
+    case DOT:
+        sink += dotNumbers(numbers, numbers, count);
+        break;
+    case SCALE:
+        scaleNumbers(result, numbers, count, 1.5);
+        sink += result[count - 1];
+        break;
+    }
+}
+
+static void runBoxed(Kernel kernel, Value *values, Value *result, int count)
+{
+    double total = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (!IS_NUMBER(values[i]))
+            abort();
+
+        double number = AS_NUMBER(values[i]);
+
+        switch (kernel)
+        {
+        case SUM:
+            total += number;
+            break;
+        case MIN:
+            total = i == 0 || number < total ? number : total;
+            break;
+        case DOT:
+            total += number * number;
+            break;
+        case SCALE:
+            result[i] = NUMBER_VAL(number * 1.5);
+            break;
+        }
+    }
+
+    sink += kernel == SCALE ? AS_NUMBER(result[count - 1]) : total;
+}
+
+// Best time over RUNS of going through WORK numbers, count at a time.
+static double timeKernel(Kernel kernel, bool isBoxed, void *numbers, void *result, int count)
+{
+    double best = 0;
+
+    for (int run = 0; run < RUNS; ++run)
+    {
+        double start = now();
+
+        for (int done = 0; done < WORK; done += count)
+        {
+            if (isBoxed)
+                runBoxed(kernel, numbers, result, count);
+            else
+                runUnboxed(kernel, numbers, result, count);
+        }
+
+        double elapsed = now() - start;
+
+        if (run == 0 || elapsed < best)
+            best = elapsed;
+    }
+
+    return best;
+}
+
+int main()
+{
+    double *numbers = malloc(LARGE * sizeof(double));
+    double *scaled = malloc(LARGE * sizeof(double));
+    Value *values = malloc(LARGE * sizeof(Value));
+    Value *scaledValues = malloc(LARGE * sizeof(Value));
+
+    for (int i = 0; i < LARGE; ++i)
+    {
+        numbers[i] = (i % 1000 * 7919 % 1000) / 8.0;
+        values[i] = NUMBER_VAL(numbers[i]);
+    }
+
+#if defined(SIMD_LIST) && defined(__AVX__)
+    const char *kind = "avx";
+#elif defined(SIMD_LIST)
+    const char *kind = "sse2";
+#else
+    const char *kind = "scalar";
+#endif
+
+    int sizes[] = {SMALL, LARGE};
+
+    for (int size = 0; size < 2; ++size)
+    {
+        for (int kernel = SUM; kernel <= SCALE; ++kernel)
+        {
+            double unboxed = timeKernel(kernel, false, numbers, scaled, sizes[size]);
+            double boxed = timeKernel(kernel, true, values, scaledValues, sizes[size]);
+
+            fprintf(stderr, "%-6s %-5s %8d numbers  unboxed %7.0f M/s  boxed %7.0f M/s  (%.1fx)\n", kind,
+                    kernelNames[kernel], sizes[size], WORK / unboxed / 1e6, WORK / boxed / 1e6, boxed / unboxed);
+        }
+    }
+
+    free(numbers);
+    free(scaled);
+    free(values);
+    free(scaledValues);
+
+    return sink == 0;
+}
@@ -0,0 +1,66 @@
+// Runs a command once and prints its wall time, peak RSS and exit status:
+//
+//     measure <command> [<args>...]
+//     12.345 1780 0
+//
+// The command's stdout goes to /dev/null, stderr is left alone. Used by run.sh,
+// which builds it with: cc -O2 -o measure bench/measure.c
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: measure <command> [<args>...]\n");
+        return 64;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t child = fork();
+
+    if (child == -1)
+    {
+        perror("fork");
+        return 71;
+    }
+
+    if (child == 0)
+    {
+        int devNull = open("/dev/null", O_WRONLY);
+        if (devNull != -1)
+            dup2(devNull, STDOUT_FILENO);
+
+        execvp(argv[1], &argv[1]);
+        perror(argv[1]);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+
+    if (wait4(child, &status, 0, &usage) == -1)
+    {
+        perror("wait4");
+        return 71;
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double wallMs = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    int exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+    // ru_maxrss is in KiB on Linux.
+    printf("%.3f %ld %d\n", wallMs, usage.ru_maxrss, exitStatus);
+
+    return 0;
+}
@@ -0,0 +1,108 @@
+// Regression check for the REPL, which compiles every line onto the end of one
+// Program, so a line's compile starts with the earlier lines' constants in the pool.
+//
+// Feeds each case to compile() and interpretProgramFrom() a line at a time, the way
+// repl() in main.c does, and compares what the lines print with what they should.
+// Exits with 1 on a mismatch. Build it with AddressSanitizer as well, most of what
+// it guards against is reading or writing past the compiler's bookkeeping.
+//
+//     cc -O2 -Isrc -o repl bench/repl.c $(ls src/*.c | grep -v main.c) -lm
+//     cc -g -fsanitize=address -Isrc -o repl-asan bench/repl.c $(ls src/*.c | grep -v main.c) -lm
+//
+//     ./repl
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "common.h"
+#include "compiler.h"
+#include "cvm.h"
+#include "program.h"
+
+#define MAX_LINES 8
+
+typedef struct
+{
+    const char *name;
+    const char *lines[MAX_LINES];
+    const char *expected;
+} Case;
+
+static const Case cases[] = {
+    // More constants than the compiler's first allocation, then one more on the next line.
+    {"many constants", {"x = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j'}\n", "y = 'k'\n", "println y\n"}, "k\n"},
+    // Constants an earlier line added, loaded again and folded away.
+    {"earlier constants",
+     {"x = {'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 3, 4}\n", "println 3 + 4\n", "println x[10] * x[11]\n"},
+     "7\n12\n"},
+    // A line that is a call echoes what it returns, like any other expression.
+    {"call echo", {"fun twice(x) x * 2 end\n", "twice(3)\n", "len({1, 2})\n"}, "6\n2\n"},
+    // A line that fails to compile leaves nothing behind.
+    {"compile error", {"a = 'one'\n", "b = (\n", "println a\n"}, "one\n"},
+};
+
+// Runs the lines with stdout going to a temporary file, and returns what they printed.
+static char *runLines(const char *const *lines, char *output, size_t size)
+{
+    FILE *captured = tmpfile();
+    int savedStdout = dup(STDOUT_FILENO);
+
+    fflush(stdout);
+    dup2(fileno(captured), STDOUT_FILENO);
+
+    Program program;
+    initProgram(&program);
+
+    for (int i = 0; i < MAX_LINES && lines[i] != NULL; ++i)
+    {
+        int start = program.actuallyInUse;
+        int constCount = program.consts.actuallyInUse;
+
+        if (!compile(lines[i], strlen(lines[i]), &program))
+        {
+            truncateProgram(&program, start);
+            program.consts.actuallyInUse = constCount;
+            continue;
+        }
+
+        interpretProgramFrom(&program, start);
+    }
+
+    freeProgram(&program);
+
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+
+    rewind(captured);
+    size_t length = fread(output, 1, size - 1, captured);
+    output[length] = '\0';
+    fclose(captured);
+
+    return output;
+}
+
+int main()
+{
+    initCVM(&mallocAllocator);
+
+    int failures = 0;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        char output[1024];
+
+        if (strcmp(runLines(cases[i].lines, output, sizeof(output)), cases[i].expected) != 0)
+        {
+            printf("%-20s FAILED, printed:\n%s", cases[i].name, output);
+            ++failures;
+            continue;
+        }
+
+        printf("%-20s ok\n", cases[i].name);
+    }
+
+    freeCVM();
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+#!/bin/sh
+# End-to-end benchmarks of the rv binary.
+#
+#     bench/run.sh [--runs N] [--compare FILE] [--threshold PERCENT] [--output FILE]
+#
+# Builds rv from src/ with $CC (default cc), runs every program in bench/programs/
+# plus the generated ones below, and writes one tab-separated line per program to
+# bench_output.txt at the root of the repository:
+#
+#     name  wall_ms  instructions  instructions_per_sec  peak_rss_kb
+#
+# wall_ms and peak_rss_kb are the best of --runs runs (default 5). The instruction
+# count comes from a second build with COUNT_INSTRUCTIONS defined.
+#
+# --compare prints the change against an earlier output, bench/baseline.txt for
+# instance, and exits with 1 if wall time or peak RSS of any program grew by more
+# than --threshold percent (default 10). Refresh the baseline by copying
+# bench_output.txt over it.
+
+set -e
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+RUNS=5
+COMPARE=
+THRESHOLD=10
+OUTPUT=$ROOT/bench_output.txt
+
+while [ $# -gt 0 ]; do
+    case $1 in
+    --runs) RUNS=$2; shift 2 ;;
+    --compare) COMPARE=$2; shift 2 ;;
+    --threshold) THRESHOLD=$2; shift 2 ;;
+    --output) OUTPUT=$2; shift 2 ;;
+    *) echo "Usage: $0 [--runs N] [--compare FILE] [--threshold PERCENT] [--output FILE]" >&2; exit 64 ;;
+    esac
+done
+
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/rv-bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+# The baseline may be the output file itself, which is truncated below.
+if [ -n "$COMPARE" ]; then
+    cp "$COMPARE" "$WORK/baseline.txt"
+    COMPARE=$WORK/baseline.txt
+fi
+
+$CC $CFLAGS -o "$WORK/rv" "$ROOT"/src/*.c -lm
+$CC $CFLAGS -DCOUNT_INSTRUCTIONS -o "$WORK/rv-count" "$ROOT"/src/*.c -lm
+$CC -O2 -o "$WORK/measure" "$ROOT/bench/measure.c"
+
+# Generated programs, too big to keep in the repository.
+mkdir -p "$WORK/programs"
+
+# A long arithmetic expression over distinct literals, all of it folded at compile time.
+awk 'BEGIN {
+    printf "0";
+    for (i = 1; i <= 60000; ++i)
+        printf " %s (%d.5 * %d - %d) / 3\n", (i % 2 ? "+" : "-"), i, i % 97, i % 13;
+    print "";
+}' > "$WORK/programs/arith_expression.rv"
+
+# Parentheses nested thousands of levels deep, exercising the recursion in the parser.
+awk 'BEGIN {
+    for (i = 0; i < 20000; ++i)
+        printf "(%d + ", i % 10;
+    printf "1";
+    for (i = 0; i < 20000; ++i)
+        printf ")";
+    print "";
+}' > "$WORK/programs/deep_expression.rv"
+
+# The same nesting over a variable, so nothing folds and every level holds a value on
+# the VM stack at once.
+awk 'BEGIN {
+    print "x = 1";
+    for (i = 0; i < 20000; ++i)
+        printf "x + (";
+    printf "x";
+    for (i = 0; i < 20000; ++i)
+        printf ")";
+    print "";
+}' > "$WORK/programs/deep_stack.rv"
+
+# A table of 200k literals drawn from 20k distinct values, for the constant pool.
+awk 'BEGIN {
+    printf "true";
+    for (i = 0; i < 200000; ++i)
+        printf " ==\n%d.%d", (i * 7919) % 20000, i % 3;
+    print "";
+}' > "$WORK/programs/constant_table.rv"
+
+: > "$OUTPUT"
+
+for program in "$ROOT"/bench/programs/*.rv "$WORK"/programs/*.rv; do
+    [ -f "$program" ] || continue
+    name=$(basename "$program" .rv)
+
+    best_ms=
+    best_rss=
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        set -- $("$WORK/measure" "$WORK/rv" "$program")
+        if [ "$3" -ne 0 ]; then
+            echo "$name: rv exited with status $3" >&2
+            exit 1
+        fi
+        best_ms=$(awk -v a="$1" -v b="$best_ms" 'BEGIN { print (b == "" || a < b) ? a : b }')
+        best_rss=$(awk -v a="$2" -v b="$best_rss" 'BEGIN { print (b == "" || a < b) ? a : b }')
+        i=$((i + 1))
+    done
+
+    instructions=$("$WORK/rv-count" "$program" 2>&1 >/dev/null | awk '/^instructions:/ { print $2 }')
+
+    awk -v name="$name" -v ms="$best_ms" -v count="${instructions:-0}" -v rss="$best_rss" 'BEGIN {
+        printf "%s\t%.3f\t%d\t%.0f\t%d\n", name, ms, count, count / (ms / 1000), rss;
+    }' >> "$OUTPUT"
+done
+
+awk -F '\t' 'BEGIN { printf "%-24s %12s %14s %16s %12s\n", "program", "wall ms", "instructions", "instructions/s", "peak KiB" }
+{ printf "%-24s %12.3f %14d %16.0f %12d\n", $1, $2, $3, $4, $5 }' "$OUTPUT"
+
+if [ -n "$COMPARE" ]; then
+    echo
+    awk -F '\t' -v threshold="$THRESHOLD" '
+    NR == FNR { ms[$1] = $2; rss[$1] = $5; next }
+    {
+        if (!($1 in ms)) { printf "%-24s (not in baseline)\n", $1; next }
+        dms = ms[$1] > 0 ? ($2 - ms[$1]) / ms[$1] * 100 : 0;
+        drss = rss[$1] > 0 ? ($5 - rss[$1]) / rss[$1] * 100 : 0;
+        flag = (dms > threshold || drss > threshold) ? "  REGRESSION" : "";
+        if (flag != "") regressed = 1;
+        printf "%-24s wall %+7.1f%%  rss %+7.1f%%%s\n", $1, dms, drss, flag;
+    }
+    END { exit regressed }' "$COMPARE" "$OUTPUT"
+fi
@@ -0,0 +1,132 @@
+// Regression check for compiling a stream, as rv does with piped stdin. The source
+// arrives in chunks, and the SourceStream only keeps the parser's last two tokens
+// valid across a refill, so the compiler must not hold on to any older one.
+//
+// Writes each case to a pipe a chunk at a time from a child process, pausing so that
+// every chunk is a read of its own, compiles from the other end and compares what
+// the program prints with what it should. Exits with 1 on a mismatch. Build it with
+// AddressSanitizer as well, a token kept too long can point at a freed buffer.
+//
+//     cc -O2 -Isrc -o stream bench/stream.c $(ls src/*.c | grep -v main.c) -lm
+//     cc -g -fsanitize=address -Isrc -o stream-asan bench/stream.c $(ls src/*.c | grep -v main.c) -lm
+//
+//     ./stream
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "common.h"
+#include "compiler.h"
+#include "cvm.h"
+#include "program.h"
+#include "source.h"
+
+#define MAX_CHUNKS 8
+
+typedef struct
+{
+    const char *name;
+    const char *chunks[MAX_CHUNKS];
+    const char *expected;
+} Case;
+
+static const Case cases[] = {
+    // The key is two tokens back by the time the colon has been taken.
+    {"dictionary key", {"x = {abcdef ", ": ", "1}\nprintln x\n"}, "{abcdef: 1}\n"},
+    // The same with a key long enough that the buffer has to grow for it.
+    {"long dictionary key",
+     {"x = {abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz ", ": ", "2}\nprintln x\n"},
+     "{abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz: 2}\n"},
+    // The loop variable is named twice, chunks apart.
+    {"for loop", {"for ind", "ex = 1, ", "index <", "= 2 do println index end\n"}, "1\n2\n"},
+};
+
+// Writes the chunks to fd from a child process, one at a time.
+static pid_t writeChunks(const char *const *chunks, int fd)
+{
+    pid_t child = fork();
+
+    if (child != 0)
+        return child;
+
+    for (int i = 0; i < MAX_CHUNKS && chunks[i] != NULL; ++i)
+    {
+        if (write(fd, chunks[i], strlen(chunks[i])) < 0)
+            _exit(1);
+        usleep(20000);
+    }
+
+    _exit(0);
+}
+
+// Compiles and runs the chunks with stdout going to a temporary file, and returns
+// what they printed.
+static char *runChunks(const char *const *chunks, char *output, size_t size)
+{
+    int fds[2];
+
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        exit(1);
+    }
+
+    fflush(stdout);
+    pid_t writer = writeChunks(chunks, fds[1]);
+    close(fds[1]);
+
+    FILE *captured = tmpfile();
+    int savedStdout = dup(STDOUT_FILENO);
+    dup2(fileno(captured), STDOUT_FILENO);
+
+    Program program;
+    initProgram(&program);
+
+    SourceStream stream;
+    initSourceStream(&stream, fds[0]);
+
+    if (compileStream(refillSourceStream, &stream, &program))
+        interpretProgram(&program);
+
+    freeSourceStream(&stream);
+    freeProgram(&program);
+    close(fds[0]);
+    waitpid(writer, NULL, 0);
+
+    fflush(stdout);
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+
+    rewind(captured);
+    size_t length = fread(output, 1, size - 1, captured);
+    output[length] = '\0';
+    fclose(captured);
+
+    return output;
+}
+
+int main()
+{
+    initCVM(&mallocAllocator);
+
+    int failures = 0;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+    {
+        char output[1024];
+
+        if (strcmp(runChunks(cases[i].chunks, output, sizeof(output)), cases[i].expected) != 0)
+        {
+            printf("%-20s FAILED, printed:\n%s", cases[i].name, output);
+            ++failures;
+            continue;
+        }
+
+        printf("%-20s ok\n", cases[i].name);
+    }
+
+    freeCVM();
+    return failures == 0 ? 0 : 1;
+}
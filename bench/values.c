@@ -0,0 +1,87 @@
+// Footprint and stack throughput of the Value representation.
+//
+// Prints how much memory the VM stack and a constant pool take, then times
+// streaming Values through a ValueArray and through push()/pop().
+//
+//     cc -O2 -Isrc -o values bench/values.c $(ls src/*.c | grep -v main.c) -lm
+//     cc -O2 -Isrc -DNAN_BOXING -o values-nan bench/values.c $(ls src/*.c | grep -v main.c) -lm
+//
+//     ./values && ./values-nan
+
+#include <stdio.h>
+#include <time.h>
+#include "common.h"
+#include "cvm.h"
+#include "value.h"
+
+#define CONSTS 1000000
+#define ROUNDS 200
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main()
+{
+#ifdef NAN_BOXING
+    const char *representation = "nan-boxed";
+#else
+    const char *representation = "tagged union";
+#endif
+
+    printf("%s\n", representation);
+    printf("  sizeof(Value)        %zu bytes\n", sizeof(Value));
+    printf("  VM stack (initial)   %zu bytes (%.1f cache lines)\n",
+           sizeof(Value) * STACK_INITIAL, sizeof(Value) * STACK_INITIAL / 64.0);
+
+    ValueArray array;
+    initValueArray(&array);
+    for (int i = 0; i < CONSTS; ++i)
+        writeValueArray(&array, (i % 3) ? NUMBER_VAL(i) : BOOL_VAL(i & 1));
+
+    printf("  constant pool        %zu KiB for %d values\n", sizeof(Value) * array.actuallyInUse / 1024, CONSTS);
+
+    // Scan the pool like the dispatch loop reads constants.
+    double best = 0;
+    double sum = 0;
+    for (int round = 0; round < 20; ++round)
+    {
+        double start = now();
+        for (int i = 0; i < array.actuallyInUse; ++i)
+        {
+            if (IS_NUMBER(array.values[i]))
+                sum += AS_NUMBER(array.values[i]);
+        }
+        double elapsed = now() - start;
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+    }
+    printf("  constant scan        %.1f M values/s\n", array.actuallyInUse / best / 1e6);
+
+    freeValueArray(&array);
+
+    // Fill and drain the whole stack.
+    initCVM(&mallocAllocator);
+    best = 0;
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        double start = now();
+        for (int repeat = 0; repeat < 1000; ++repeat)
+        {
+            for (int i = 0; i < STACK_INITIAL; ++i)
+                push(NUMBER_VAL(i));
+            for (int i = 0; i < STACK_INITIAL; ++i)
+                sum += AS_NUMBER(pop());
+        }
+        double elapsed = now() - start;
+        if (best == 0 || elapsed < best)
+            best = elapsed;
+    }
+    printf("  stack push + pop     %.1f M pairs/s\n", 1000.0 * STACK_INITIAL / best / 1e6);
+    freeCVM();
+
+    return sum == 42 ? 1 : 0;
+}
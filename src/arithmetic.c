@@ -0,0 +1,217 @@
+#include <math.h>
+#include "arithmetic.h"
+
+// Sets *integer to a number with no fraction, an integer or a double that one can hold.
+static bool toInteger(Value value, int64_t *integer)
+{
+  if (IS_INT(value))
+  {
+    *integer = AS_INT(value);
+    return true;
+  }
+
+  double number = AS_FLOAT(value);
+
+  if (!(number >= -0x1p63 && number < 0x1p63) || number != floor(number))
+    return false;
+
+  *integer = (int64_t)number;
+  return true;
+}
+
+// Rounds toward negative infinity, so 7 // -2 is -4, and never overflows but for
+// the smallest integer // -1.
+static Value floorDivideIntegers(int64_t a, int64_t b)
+{
+  if (b == -1)
+    return subtractIntegers(0, a);
+
+  int64_t quotient = a / b;
+
+  if (a % b != 0 && (a < 0) != (b < 0))
+    --quotient;
+
+  return INT_VAL(quotient);
+}
+
+// Takes the sign of b, as a - a // b * b does.
+static Value moduloIntegers(int64_t a, int64_t b)
+{
+  if (b == -1)
+    return INT_VAL(0);
+
+  int64_t remainder = a % b;
+
+  if (remainder != 0 && (remainder < 0) != (b < 0))
+    remainder += b;
+
+  return INT_VAL(remainder);
+}
+
+static double moduloNumbers(double a, double b)
+{
+  double remainder = fmod(a, b);
+
+  if (remainder > 0 ? b < 0 : remainder < 0 && b != remainder)
+    remainder += b;
+
+  return remainder;
+}
+
+// By squaring, as long as the result stays an integer. A negative exponent gives a
+// fraction, so it goes to pow() like doubles do.
+static Value powerIntegers(int64_t base, int64_t exponent)
+{
+  if (exponent < 0)
+    return NUMBER_VAL(pow((double)base, (double)exponent));
+
+  int64_t result = 1;
+  int64_t square = base;
+  int64_t rest = exponent;
+
+  while (true)
+  {
+    if ((rest & 1) && multiplyOverflows(result, square, &result))
+      return NUMBER_VAL(pow((double)base, (double)exponent));
+
+    rest >>= 1;
+    if (rest == 0)
+      return INT_VAL(result);
+
+    if (multiplyOverflows(square, square, &square))
+      return NUMBER_VAL(pow((double)base, (double)exponent));
+  }
+}
+
+// Left by count, or right by -count when it is negative. >> keeps the sign, so
+// a >> n is a // 2^n, and << overflows into a double like * does.
+static Value shiftIntegers(int64_t a, int64_t count)
+{
+  if (count < 0)
+  {
+    if (count <= -63)
+      return INT_VAL(a < 0 ? -1 : 0);
+
+    return INT_VAL(a >> -count);
+  }
+
+  if (a == 0)
+    return INT_VAL(0);
+
+  if (count < 63)
+  {
+    int64_t shifted = (int64_t)((uint64_t)a << count);
+
+    if (shifted >> count == a)
+      return integerValue(shifted);
+  }
+
+  // Past any double's range long before the count gets near an int's.
+  return NUMBER_VAL(ldexp((double)a, count > 4096 ? 4096 : (int)count));
+}
+
+ArithmeticStatus arithmetic(OperationCode operationCode, Value a, Value b, Value *result)
+{
+  if (!IS_NUMBER(a) || !IS_NUMBER(b))
+    return ARITHMETIC_NOT_NUMBERS;
+
+  bool areIntegers = IS_INT(a) && IS_INT(b);
+
+  switch (operationCode)
+  {
+  case OP_ADD:
+    *result = areIntegers ? addIntegers(AS_INT(a), AS_INT(b)) : NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+    return ARITHMETIC_OK;
+  case OP_SUBTRACT:
+    *result = areIntegers ? subtractIntegers(AS_INT(a), AS_INT(b)) : NUMBER_VAL(AS_NUMBER(a) - AS_NUMBER(b));
+    return ARITHMETIC_OK;
+  case OP_MULTIPLY:
+    *result = areIntegers ? multiplyIntegers(AS_INT(a), AS_INT(b)) : NUMBER_VAL(AS_NUMBER(a) * AS_NUMBER(b));
+    return ARITHMETIC_OK;
+  case OP_DIVIDE:
+    *result = NUMBER_VAL(AS_NUMBER(a) / AS_NUMBER(b));
+    return ARITHMETIC_OK;
+  case OP_FLOOR_DIVIDE:
+    if (!areIntegers)
+      *result = NUMBER_VAL(floor(AS_NUMBER(a) / AS_NUMBER(b)));
+    else if (AS_INT(b) == 0)
+      return ARITHMETIC_DIVIDE_BY_ZERO;
+    else
+      *result = floorDivideIntegers(AS_INT(a), AS_INT(b));
+    return ARITHMETIC_OK;
+  case OP_MODULO:
+    if (!areIntegers)
+      *result = NUMBER_VAL(moduloNumbers(AS_NUMBER(a), AS_NUMBER(b)));
+    else if (AS_INT(b) == 0)
+      return ARITHMETIC_DIVIDE_BY_ZERO;
+    else
+      *result = moduloIntegers(AS_INT(a), AS_INT(b));
+    return ARITHMETIC_OK;
+  case OP_POWER:
+    *result = areIntegers ? powerIntegers(AS_INT(a), AS_INT(b)) : NUMBER_VAL(pow(AS_NUMBER(a), AS_NUMBER(b)));
+    return ARITHMETIC_OK;
+  default:
+    break;
+  }
+
+  // The bitwise operators take doubles with no fraction as the integers they are.
+  int64_t x;
+  int64_t y;
+
+  if (!toInteger(a, &x) || !toInteger(b, &y))
+    return ARITHMETIC_NOT_INTEGERS;
+
+  switch (operationCode)
+  {
+  case OP_BIT_AND:
+    *result = integerValue(x & y);
+    return ARITHMETIC_OK;
+  case OP_BIT_OR:
+    *result = integerValue(x | y);
+    return ARITHMETIC_OK;
+  case OP_BIT_XOR:
+    *result = integerValue(x ^ y);
+    return ARITHMETIC_OK;
+  case OP_SHIFT_LEFT:
+    *result = shiftIntegers(x, y);
+    return ARITHMETIC_OK;
+  case OP_SHIFT_RIGHT:
+    *result = shiftIntegers(x, y == INT64_MIN ? INT64_MAX : -y);
+    return ARITHMETIC_OK;
+  default:
+    return ARITHMETIC_NOT_NUMBERS; // Unreachable.
+  }
+}
+
+ArithmeticStatus arithmeticUnary(OperationCode operationCode, Value a, Value *result)
+{
+  if (!IS_NUMBER(a))
+    return ARITHMETIC_NOT_NUMBERS;
+
+  if (operationCode == OP_NEGATE)
+  {
+    *result = IS_INT(a) ? subtractIntegers(0, AS_INT(a)) : NUMBER_VAL(-AS_FLOAT(a));
+    return ARITHMETIC_OK;
+  }
+
+  int64_t x;
+
+  if (!toInteger(a, &x))
+    return ARITHMETIC_NOT_INTEGERS;
+
+  *result = integerValue(~x);
+  return ARITHMETIC_OK;
+}
+
+const char *arithmeticError(ArithmeticStatus status)
+{
+  switch (status)
+  {
+  case ARITHMETIC_NOT_INTEGERS:
+    return "Bitwise operands must be whole numbers";
+  case ARITHMETIC_DIVIDE_BY_ZERO:
+    return "Integer division by zero";
+  default:
+    return "Unmatching type, operands must be numbers";
+  }
+}
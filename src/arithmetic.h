@@ -0,0 +1,192 @@
+#ifndef ARITHMETIC_H
+#define ARITHMETIC_H
+
+#include "common.h"
+#include "program.h"
+#include "value.h"
+
+// Why an operator has no result.
+typedef enum
+{
+  ARITHMETIC_OK,
+  ARITHMETIC_NOT_NUMBERS,
+  ARITHMETIC_NOT_INTEGERS,   // A bitwise operand has a fraction or is out of any integer's range.
+  ARITHMETIC_DIVIDE_BY_ZERO, // Integer // or % by 0.
+} ArithmeticStatus;
+
+// An integer result, or its double when it leaves the range integers hold.
+static inline Value integerValue(int64_t integer)
+{
+  return FITS_INTEGER(integer) ? INT_VAL(integer) : NUMBER_VAL((double)integer);
+}
+
+// Integers stay integers through +, - and *. A result out of their range is the
+// double the operands would have given as doubles.
+//
+// Whether a op b leaves the range integers hold, setting *result when it doesn't.
+// With GCC and Clang the operands are worked on shifted up to the top of an
+// int64_t, so that the processor's overflow flag says whether a result fits in the
+// bits a value holds one in, NaN-boxed or not. Other compilers compare against
+// INTEGER_MIN and INTEGER_MAX first.
+#ifdef NAN_BOXING
+#define INTEGER_SHIFT 16
+#else
+#define INTEGER_SHIFT 0
+#endif
+
+#if defined(__GNUC__)
+static inline int64_t shiftIntegerUp(int64_t integer)
+{
+  return (int64_t)((uint64_t)integer << INTEGER_SHIFT);
+}
+
+static inline bool addOverflows(int64_t a, int64_t b, int64_t *result)
+{
+  int64_t shifted;
+
+  if (__builtin_add_overflow(shiftIntegerUp(a), shiftIntegerUp(b), &shifted))
+    return true;
+
+  *result = shifted >> INTEGER_SHIFT;
+  return false;
+}
+
+static inline bool subtractOverflows(int64_t a, int64_t b, int64_t *result)
+{
+  int64_t shifted;
+
+  if (__builtin_sub_overflow(shiftIntegerUp(a), shiftIntegerUp(b), &shifted))
+    return true;
+
+  *result = shifted >> INTEGER_SHIFT;
+  return false;
+}
+
+static inline bool multiplyOverflows(int64_t a, int64_t b, int64_t *result)
+{
+  int64_t shifted;
+
+  if (__builtin_mul_overflow(shiftIntegerUp(a), b, &shifted))
+    return true;
+
+  *result = shifted >> INTEGER_SHIFT;
+  return false;
+}
+#else
+static inline bool addOverflows(int64_t a, int64_t b, int64_t *result)
+{
+  if (b > 0 ? a > INTEGER_MAX - b : a < INTEGER_MIN - b)
+    return true;
+
+  *result = a + b;
+  return false;
+}
+
+static inline bool subtractOverflows(int64_t a, int64_t b, int64_t *result)
+{
+  if (b > 0 ? a < INTEGER_MIN + b : a > INTEGER_MAX + b)
+    return true;
+
+  *result = a - b;
+  return false;
+}
+
+// Divides the limit by one operand rather than multiplying, one case per pair of
+// signs, so nothing is worked out that could itself overflow.
+static inline bool multiplyOverflows(int64_t a, int64_t b, int64_t *result)
+{
+  if (a > 0 ? (b > 0 ? a > INTEGER_MAX / b : b < INTEGER_MIN / a)
+            : (b > 0 ? a < INTEGER_MIN / b : a != 0 && b < INTEGER_MAX / a))
+    return true;
+
+  *result = a * b;
+  return false;
+}
+#endif
+
+static inline Value addIntegers(int64_t a, int64_t b)
+{
+  int64_t result;
+
+  if (addOverflows(a, b, &result))
+    return NUMBER_VAL((double)a + (double)b);
+
+  return INT_VAL(result);
+}
+
+static inline Value subtractIntegers(int64_t a, int64_t b)
+{
+  int64_t result;
+
+  if (subtractOverflows(a, b, &result))
+    return NUMBER_VAL((double)a - (double)b);
+
+  return INT_VAL(result);
+}
+
+static inline Value multiplyIntegers(int64_t a, int64_t b)
+{
+  int64_t result;
+
+  if (multiplyOverflows(a, b, &result))
+    return NUMBER_VAL((double)a * (double)b);
+
+  return INT_VAL(result);
+}
+
+// The same for two doubles, for code written once for either.
+static inline Value addFloats(double a, double b)
+{
+  return NUMBER_VAL(a + b);
+}
+
+static inline Value subtractFloats(double a, double b)
+{
+  return NUMBER_VAL(a - b);
+}
+
+static inline Value multiplyFloats(double a, double b)
+{
+  return NUMBER_VAL(a * b);
+}
+
+// / always divides as doubles, 7 / 2 is 3.5. 7 // 2 is the integer 3.
+static inline Value divideIntegers(int64_t a, int64_t b)
+{
+  return NUMBER_VAL((double)a / (double)b);
+}
+
+// -1, 0 or 1 as number a is below, equal to or above number b, by their exact values
+// whatever their types. A NaN is neither below nor above, and gives 0, so this is
+// for < and > and the !(<) and !(>) that <= and >= are, not for ==.
+static inline int compareNumbers(Value a, Value b)
+{
+  if (IS_INT(a) && IS_INT(b))
+    return (AS_INT(a) > AS_INT(b)) - (AS_INT(a) < AS_INT(b));
+  if (IS_INT(a))
+    return compareIntegerWithDouble(AS_INT(a), AS_FLOAT(b));
+  if (IS_INT(b))
+    return -compareIntegerWithDouble(AS_INT(b), AS_FLOAT(a));
+
+  return (AS_FLOAT(a) > AS_FLOAT(b)) - (AS_FLOAT(a) < AS_FLOAT(b));
+}
+
+// a < b and a > b for numbers, two integers compared as integers.
+static inline bool isLess(Value a, Value b)
+{
+  return IS_INT(a) && IS_INT(b) ? AS_INT(a) < AS_INT(b) : compareNumbers(a, b) < 0;
+}
+
+static inline bool isGreater(Value a, Value b)
+{
+  return IS_INT(a) && IS_INT(b) ? AS_INT(a) > AS_INT(b) : compareNumbers(a, b) > 0;
+}
+
+// a operator b for OP_ADD through OP_SHIFT_RIGHT. The VM inlines the common cases
+// of + - * / and comes here for the rest, the compiler folds constants with it.
+ArithmeticStatus arithmetic(OperationCode operationCode, Value a, Value b, Value *result);
+// Likewise for OP_NEGATE and OP_BIT_NOT.
+ArithmeticStatus arithmeticUnary(OperationCode operationCode, Value a, Value *result);
+const char *arithmeticError(ArithmeticStatus status);
+
+#endif
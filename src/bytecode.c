@@ -0,0 +1,536 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "cvm.h"
+#include "memory.h"
+#include "object.h"
+
+// Every section starts on this boundary so that it can be used in place.
+#define SECTION_ALIGNMENT 16
+
+#define FNV_OFFSET_32 2166136261u
+#define FNV_PRIME_32 16777619u
+#define FNV_OFFSET_64 14695981039346656037ull
+#define FNV_PRIME_64 1099511628211ull
+
+static uint32_t currentFlags()
+{
+  uint32_t flags = 0;
+
+#ifdef NAN_BOXING
+  flags |= BYTECODE_NAN_BOXING;
+#endif
+#ifdef REGISTER_VM
+  flags |= BYTECODE_REGISTER_VM;
+#endif
+
+  return flags;
+}
+
+static uint32_t updateChecksum(uint32_t checksum, const void *bytes, size_t length)
+{
+  const uint8_t *byte = bytes;
+
+  for (size_t i = 0; i < length; ++i)
+  {
+    checksum ^= byte[i];
+    checksum *= FNV_PRIME_32;
+  }
+
+  return checksum;
+}
+
+uint64_t hashSource(const char *src, size_t length)
+{
+  return continueSourceHash(FNV_OFFSET_64, src, length);
+}
+
+uint64_t continueSourceHash(uint64_t hash, const char *src, size_t length)
+{
+  for (size_t i = 0; i < length; ++i)
+  {
+    hash ^= (uint8_t)src[i];
+    hash *= FNV_PRIME_64;
+  }
+
+  return hash;
+}
+
+static bool readHeader(const char *path, BytecodeHeader *header)
+{
+  FILE *file = fopen(path, "rb");
+
+  if (file == NULL)
+    return false;
+
+  bool read = fread(header, sizeof(BytecodeHeader), 1, file) == 1;
+  fclose(file);
+
+  return read && memcmp(header->magic, BYTECODE_MAGIC, sizeof(header->magic)) == 0;
+}
+
+bool isBytecodeFile(const char *path)
+{
+  BytecodeHeader header;
+  return readHeader(path, &header);
+}
+
+// False when path isn't a .rvc this build could load.
+bool readBytecodeSourceHash(const char *path, uint64_t *sourceHash)
+{
+  BytecodeHeader header;
+
+  if (!readHeader(path, &header) || header.version != BYTECODE_VERSION || header.flags != currentFlags() ||
+      header.valueSize != sizeof(Value))
+    return false;
+
+  *sourceHash = header.sourceHash;
+  return true;
+}
+
+typedef struct
+{
+  FILE *file;
+  uint32_t offset;
+  uint32_t checksum;
+  bool failed;
+} Writer;
+
+static void writeBytes(Writer *writer, const void *bytes, size_t length)
+{
+  if (length == 0)
+    return;
+
+  if (fwrite(bytes, length, 1, writer->file) != 1)
+    writer->failed = true;
+
+  writer->checksum = updateChecksum(writer->checksum, bytes, length);
+  writer->offset += (uint32_t)length;
+}
+
+// Pads to the next section boundary and returns the offset of the section.
+static uint32_t startSection(Writer *writer)
+{
+  static const uint8_t padding[SECTION_ALIGNMENT] = {0};
+
+  writeBytes(writer, padding, (SECTION_ALIGNMENT - writer->offset % SECTION_ALIGNMENT) % SECTION_ALIGNMENT);
+  return writer->offset;
+}
+
+// The tagged union has padding after the type and inside the union, zero it so the
+// checksum only depends on the program.
+static Value normalizeValue(Value value)
+{
+#ifdef NAN_BOXING
+  return value;
+#else
+  Value normalized;
+  memset(&normalized, 0, sizeof(Value));
+  normalized.type = value.type;
+
+  switch (value.type)
+  {
+  case VAL_BOOL:
+    normalized.as.boolean = value.as.boolean;
+    break;
+  case VAL_NONE:
+    break;
+  case VAL_NUMBER:
+    normalized.as.number = value.as.number;
+    break;
+  case VAL_INT:
+    normalized.as.integer = value.as.integer;
+    break;
+  case VAL_OBJ:
+    break; // writeBytecode() never passes objects.
+  }
+
+  return normalized;
+#endif
+}
+
+bool writeBytecode(Program *program, uint64_t sourceHash, const char *path)
+{
+  FILE *file = fopen(path, "wb");
+
+  if (file == NULL)
+  {
+    fprintf(stderr, "Cannot open file \"%s\".\n", path);
+    return false;
+  }
+
+  BytecodeHeader header;
+  memset(&header, 0, sizeof(BytecodeHeader));
+  memcpy(header.magic, BYTECODE_MAGIC, sizeof(header.magic));
+  header.version = BYTECODE_VERSION;
+  header.flags = currentFlags();
+  header.valueSize = sizeof(Value);
+  header.sourceHash = sourceHash;
+
+  // Written once as a placeholder, then again once the offsets and checksum are known.
+  Writer writer = {file, 0, FNV_OFFSET_32, false};
+  if (fwrite(&header, sizeof(BytecodeHeader), 1, file) != 1)
+    writer.failed = true;
+  writer.offset = sizeof(BytecodeHeader);
+
+  header.codeOffset = startSection(&writer);
+  header.codeSize = (uint32_t)program->actuallyInUse;
+  writeBytes(&writer, program->code, program->actuallyInUse);
+
+  LineTable *lines = &program->lines;
+  header.lineOffset = startSection(&writer);
+  header.lineSize = (uint32_t)lines->actuallyInUse;
+  writeBytes(&writer, lines->encoded, lines->actuallyInUse);
+
+  header.checkpointOffset = startSection(&writer);
+  header.checkpointCount = (uint32_t)lines->checkpointsInUse;
+  writeBytes(&writer, lines->checkpoints, sizeof(LineCheckpoint) * lines->checkpointsInUse);
+  header.lineRuns = (uint32_t)lines->runs;
+  header.lastLine = lines->last;
+  header.maxStackDepth = (uint32_t)program->maxStackDepth;
+
+  // A string constant is written as none here, and as a record of its index, length
+  // and characters in the string section. Loading interns it and patches the slot.
+  header.constOffset = startSection(&writer);
+  header.constCount = (uint32_t)program->consts.actuallyInUse;
+  for (int i = 0; i < program->consts.actuallyInUse; ++i)
+  {
+    Value value = IS_OBJ(program->consts.values[i]) ? NONE_VAL : normalizeValue(program->consts.values[i]);
+    writeBytes(&writer, &value, sizeof(Value));
+  }
+
+  header.stringOffset = startSection(&writer);
+  for (int i = 0; i < program->consts.actuallyInUse; ++i)
+  {
+    if (!IS_STRING(program->consts.values[i]))
+      continue;
+
+    ObjString *string = AS_STRING(program->consts.values[i]);
+    uint32_t record[2] = {(uint32_t)i, (uint32_t)string->length};
+    writeBytes(&writer, record, sizeof(record));
+    writeBytes(&writer, string->chars, string->length);
+  }
+  header.stringSize = writer.offset - header.stringOffset;
+
+  // A function is a record of its index, arity, entry, stack depth, name length
+  // (UINT32_MAX when it has none) and capture count, followed by the name's
+  // characters and the captures.
+  header.functionOffset = startSection(&writer);
+  for (int i = 0; i < program->consts.actuallyInUse; ++i)
+  {
+    if (!IS_FUNCTION(program->consts.values[i]))
+      continue;
+
+    ObjFunction *function = AS_FUNCTION(program->consts.values[i]);
+    uint32_t record[6] = {(uint32_t)i, (uint32_t)function->arity, (uint32_t)function->entry,
+                          (uint32_t)function->maxStackDepth,
+                          function->name != NULL ? (uint32_t)function->name->length : UINT32_MAX,
+                          (uint32_t)function->captureCount};
+    writeBytes(&writer, record, sizeof(record));
+
+    if (function->name != NULL)
+      writeBytes(&writer, function->name->chars, function->name->length);
+
+    writeBytes(&writer, function->captures, function->captureCount * sizeof(Capture));
+  }
+  header.functionSize = writer.offset - header.functionOffset;
+
+  // The program was compiled against this VM's slots, so those are the ones it uses.
+  ObjString **names = GROW_ARRAY(NULL, ObjString *, 0, vm.globalCount);
+  for (int i = 0; i < vm.globalNames.numOfAllocated; ++i)
+  {
+    Entry *entry = &vm.globalNames.entries[i];
+    if (entry->key != NULL)
+      names[(int)AS_NUMBER(entry->value)] = entry->key;
+  }
+
+  header.globalOffset = startSection(&writer);
+  header.globalCount = (uint32_t)vm.globalCount;
+  for (int i = 0; i < vm.globalCount; ++i)
+  {
+    uint32_t length = (uint32_t)names[i]->length;
+    writeBytes(&writer, &length, sizeof(length));
+    writeBytes(&writer, names[i]->chars, names[i]->length);
+  }
+  header.globalSize = writer.offset - header.globalOffset;
+
+  FREE_ARRAY(ObjString *, names, vm.globalCount);
+
+  header.checksum = writer.checksum;
+
+  if (fseek(file, 0L, SEEK_SET) != 0 || fwrite(&header, sizeof(BytecodeHeader), 1, file) != 1)
+    writer.failed = true;
+
+  if (fclose(file) != 0 || writer.failed)
+  {
+    fprintf(stderr, "Couldn't write file \"%s\".\n", path);
+    return false;
+  }
+
+  return true;
+}
+
+static bool isSectionValid(uint32_t offset, size_t size, size_t fileSize)
+{
+  return offset % SECTION_ALIGNMENT == 0 && offset >= sizeof(BytecodeHeader) && offset <= fileSize &&
+         size <= fileSize - offset;
+}
+
+static bool isHeaderValid(const char *path, BytecodeHeader *header, size_t fileSize)
+{
+  const char *problem = NULL;
+
+  if (memcmp(header->magic, BYTECODE_MAGIC, sizeof(header->magic)) != 0)
+    problem = "not a bytecode file";
+  else if (header->version != BYTECODE_VERSION)
+    problem = "unsupported bytecode version";
+  else if (header->flags != currentFlags() || header->valueSize != sizeof(Value))
+    problem = "compiled by a differently configured rv";
+  else if (!isSectionValid(header->codeOffset, header->codeSize, fileSize) ||
+           !isSectionValid(header->lineOffset, header->lineSize, fileSize) ||
+           !isSectionValid(header->checkpointOffset, sizeof(LineCheckpoint) * (size_t)header->checkpointCount, fileSize) ||
+           !isSectionValid(header->constOffset, sizeof(Value) * (size_t)header->constCount, fileSize) ||
+           !isSectionValid(header->stringOffset, header->stringSize, fileSize) ||
+           !isSectionValid(header->functionOffset, header->functionSize, fileSize) ||
+           !isSectionValid(header->globalOffset, header->globalSize, fileSize) || header->maxStackDepth > INT32_MAX)
+    problem = "truncated or corrupt";
+
+  if (problem != NULL)
+  {
+    fprintf(stderr, "Cannot load \"%s\": %s.\n", path, problem);
+    return false;
+  }
+
+  return true;
+}
+
+// Interns every string in the string section into its constant slot. False if a
+// record runs past the section or names a slot that doesn't exist.
+static bool loadStrings(uint8_t *mapping, BytecodeHeader *header, Value *consts)
+{
+  uint8_t *record = mapping + header->stringOffset;
+  uint8_t *end = record + header->stringSize;
+
+  while (record < end)
+  {
+    uint32_t fields[2];
+
+    if ((size_t)(end - record) < sizeof(fields))
+      return false;
+
+    memcpy(fields, record, sizeof(fields));
+    record += sizeof(fields);
+
+    if (fields[0] >= header->constCount || fields[1] > (size_t)(end - record) || fields[1] > INT32_MAX)
+      return false;
+
+    consts[fields[0]] = OBJ_VAL(copyString((const char *)record, (int)fields[1]));
+    record += fields[1];
+  }
+
+  return true;
+}
+
+// Makes a function for every record in the function section and puts it in its
+// constant slot. False if a record is cut short or doesn't fit the program.
+static bool loadFunctions(uint8_t *mapping, BytecodeHeader *header, Value *consts)
+{
+  uint8_t *record = mapping + header->functionOffset;
+  uint8_t *end = record + header->functionSize;
+
+  while (record < end)
+  {
+    uint32_t fields[6];
+
+    if ((size_t)(end - record) < sizeof(fields))
+      return false;
+
+    memcpy(fields, record, sizeof(fields));
+    record += sizeof(fields);
+
+    if (fields[0] >= header->constCount || fields[1] > UINT8_MAX || fields[2] >= header->codeSize ||
+        fields[3] > INT32_MAX || fields[5] > CAPTURE_MAX + 1)
+      return false;
+
+    ObjString *name = NULL;
+
+    if (fields[4] != UINT32_MAX)
+    {
+      if (fields[4] > (size_t)(end - record) || fields[4] > INT32_MAX)
+        return false;
+
+      name = copyString((const char *)record, (int)fields[4]);
+      record += fields[4];
+    }
+
+    if (fields[5] * sizeof(Capture) > (size_t)(end - record))
+      return false;
+
+    ObjFunction *function = newFunction(name, (int)fields[5]);
+    function->arity = (int)fields[1];
+    function->entry = (int)fields[2];
+    function->maxStackDepth = (int)fields[3];
+    memcpy(function->captures, record, fields[5] * sizeof(Capture));
+    record += fields[5] * sizeof(Capture);
+
+    for (int i = 0; i < function->captureCount; ++i)
+    {
+      if (function->captures[i].kind > CAPTURE_ENCLOSING)
+        return false;
+    }
+    consts[fields[0]] = OBJ_VAL(function);
+  }
+
+  return true;
+}
+
+// Gives every global named in the file its slot in this VM. The slots only differ
+// from the file's when the VM already had globals, then the code is patched.
+static bool loadGlobals(uint8_t *mapping, BytecodeHeader *header)
+{
+  uint8_t *record = mapping + header->globalOffset;
+  uint8_t *end = record + header->globalSize;
+  int *slots = GROW_ARRAY(NULL, int, 0, header->globalCount);
+  bool isMoved = false;
+  bool isValid = true;
+
+  for (uint32_t i = 0; i < header->globalCount && isValid; ++i)
+  {
+    uint32_t length;
+
+    if ((size_t)(end - record) < sizeof(length))
+    {
+      isValid = false;
+      break;
+    }
+
+    memcpy(&length, record, sizeof(length));
+    record += sizeof(length);
+
+    if (length > (size_t)(end - record) || length > INT32_MAX)
+    {
+      isValid = false;
+      break;
+    }
+
+    slots[i] = globalSlot(copyString((const char *)record, (int)length));
+    isMoved |= slots[i] != (int)i;
+    isValid = slots[i] <= GLOBAL_MAX;
+    record += length;
+  }
+
+  if (isValid && isMoved)
+  {
+    uint8_t *code = mapping + header->codeOffset;
+
+    for (uint32_t offset = 0; offset < header->codeSize; offset += instructionLength(code[offset]))
+    {
+      if (code[offset] != OP_GET_GLOBAL && code[offset] != OP_SET_GLOBAL)
+        continue;
+
+      if (offset + 2 >= header->codeSize || (code[offset + 1] | (code[offset + 2] << 8)) >= (int)header->globalCount)
+      {
+        isValid = false;
+        break;
+      }
+
+      int slot = slots[code[offset + 1] | (code[offset + 2] << 8)];
+      code[offset + 1] = (uint8_t)(slot & 0xff);
+      code[offset + 2] = (uint8_t)((slot >> 8) & 0xff);
+    }
+  }
+
+  FREE_ARRAY(int, slots, header->globalCount);
+
+  return isValid;
+}
+
+// Maps the file and points the program's arrays straight into it. The mapping is
+// private and writable, pages are only copied if something writes to them (string
+// constants do, the constant section gets their interned pointers).
+bool loadBytecode(const char *path, Program *program)
+{
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1)
+  {
+    fprintf(stderr, "Cannot open file \"%s\".\n", path);
+    return false;
+  }
+
+  struct stat status;
+  if (fstat(fd, &status) == -1 || (size_t)status.st_size < sizeof(BytecodeHeader))
+  {
+    fprintf(stderr, "Cannot load \"%s\": truncated or corrupt.\n", path);
+    close(fd);
+    return false;
+  }
+
+  size_t fileSize = (size_t)status.st_size;
+  uint8_t *mapping = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (mapping == MAP_FAILED)
+  {
+    fprintf(stderr, "Couldn't map file \"%s\".\n", path);
+    return false;
+  }
+
+  BytecodeHeader *header = (BytecodeHeader *)mapping;
+
+  if (!isHeaderValid(path, header, fileSize))
+  {
+    munmap(mapping, fileSize);
+    return false;
+  }
+
+  uint32_t checksum = updateChecksum(FNV_OFFSET_32, mapping + sizeof(BytecodeHeader), fileSize - sizeof(BytecodeHeader));
+  if (checksum != header->checksum)
+  {
+    fprintf(stderr, "Cannot load \"%s\": checksum mismatch.\n", path);
+    munmap(mapping, fileSize);
+    return false;
+  }
+
+  Value *consts = (Value *)(mapping + header->constOffset);
+
+  if (!loadStrings(mapping, header, consts) || !loadFunctions(mapping, header, consts) ||
+      !loadGlobals(mapping, header))
+  {
+    fprintf(stderr, "Cannot load \"%s\": truncated or corrupt.\n", path);
+    munmap(mapping, fileSize);
+    return false;
+  }
+
+  initProgram(program);
+
+  program->code = mapping + header->codeOffset;
+  program->actuallyInUse = (int)header->codeSize;
+
+  program->lines.encoded = mapping + header->lineOffset;
+  program->lines.actuallyInUse = (int)header->lineSize;
+  program->lines.checkpoints = (LineCheckpoint *)(mapping + header->checkpointOffset);
+  program->lines.checkpointsInUse = (int)header->checkpointCount;
+  program->lines.runs = (int)header->lineRuns;
+  program->lines.last = header->lastLine;
+
+  program->consts.values = consts;
+  program->consts.actuallyInUse = (int)header->constCount;
+  program->maxStackDepth = (int)header->maxStackDepth;
+
+  // Nothing above is owned by the allocator, numOfAllocated stays 0 everywhere.
+  program->mapping = mapping;
+  program->mappingSize = fileSize;
+
+  return true;
+}
+
+void unmapBytecode(Program *program)
+{
+  munmap(program->mapping, program->mappingSize);
+}
@@ -0,0 +1,53 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include "program.h"
+
+// Precompiled programs (.rvc). Sections are stored in the native layout of the
+// build that wrote them, so a file can be mapped and executed in place. The
+// header records that layout and load refuses files from a different build.
+
+#define BYTECODE_MAGIC "RVC"
+#define BYTECODE_VERSION 11
+
+#define BYTECODE_NAN_BOXING 0x1
+#define BYTECODE_REGISTER_VM 0x2
+
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t valueSize;
+  uint64_t sourceHash; // Of the source text the program was compiled from.
+  uint32_t checksum;   // Of every byte after the header.
+  uint32_t codeOffset;
+  uint32_t codeSize;
+  uint32_t lineOffset;
+  uint32_t lineSize;
+  uint32_t checkpointOffset;
+  uint32_t checkpointCount;
+  uint32_t lineRuns;
+  LineStart lastLine;
+  uint32_t constOffset;
+  uint32_t constCount;
+  uint32_t maxStackDepth;
+  uint32_t stringOffset; // String constants, which the constant section can't hold as pointers.
+  uint32_t stringSize;
+  uint32_t functionOffset; // Function constants, likewise.
+  uint32_t functionSize;
+  uint32_t globalOffset; // The name of every global slot the code uses, in slot order.
+  uint32_t globalSize;
+  uint32_t globalCount;
+} BytecodeHeader;
+
+uint64_t hashSource(const char *src, size_t length);
+// Extends the hash of a source that arrives in pieces. Start from hashSource(NULL, 0).
+uint64_t continueSourceHash(uint64_t hash, const char *src, size_t length);
+bool isBytecodeFile(const char *path);
+bool readBytecodeSourceHash(const char *path, uint64_t *sourceHash);
+bool writeBytecode(Program *program, uint64_t sourceHash, const char *path);
+bool loadBytecode(const char *path, Program *program);
+void unmapBytecode(Program *program);
+
+#endif
@@ -5,7 +5,108 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Pack every Value into a single 64-bit word by hiding non-numbers in the
+// unused bits of a quiet NaN. Halves the size of the stack and constant pools.
+// #define NAN_BOXING
+
+// Compile binary operators to three-address instructions (OP_ADD_R dst, a, b) that
+// read their operands straight from frame registers or the constant pool.
+// #define REGISTER_VM
+
+// Count the instructions run() executes and report the total on exit. Used by bench/run.sh.
+// #define COUNT_INSTRUCTIONS
+
+// Track live and peak bytes, allocations and bytes copied by reallocate(), per
+// category, for `rv --stats`. Compiled out, reallocate() is called directly.
+// #define MEMORY_STATS
+
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
 
+// Run a minor collection and a major step at every safe point, to shake out
+// objects the collector can't see.
+// #define DEBUG_STRESS_GC
+
+// GCC and Clang can take the address of a label, which lets run() jump straight
+// from one opcode handler to the next. Define NO_COMPUTED_GOTO to force the switch.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// Tells GCC and Clang which way a branch nearly always goes, so that they lay that
+// path out straight. run() wraps its integer fast paths in it, which the compilers'
+// own guesses would otherwise move out of line.
+#if defined(__GNUC__)
+#define LIKELY(condition) __builtin_expect(!!(condition), 1)
+#else
+#define LIKELY(condition) (condition)
+#endif
+
+// Marks a handler that runs on into the next one, for -Wimplicit-fallthrough, which
+// does not see a comment in front of run()'s CASE() labels.
+#if defined(__GNUC__) && __GNUC__ >= 7
+#define FALLTHROUGH __attribute__((fallthrough))
+#else
+#define FALLTHROUGH ((void)0)
+#endif
+
+// The zero bits below the lowest set bit and above the highest one, of bits that
+// aren't all zero. An instruction with GCC and Clang, a loop elsewhere.
+static inline int countTrailingZeros(uint32_t bits)
+{
+#if defined(__GNUC__)
+  return __builtin_ctz(bits);
+#else
+  int count = 0;
+
+  for (; (bits & 1) == 0; bits >>= 1)
+    ++count;
+
+  return count;
+#endif
+}
+
+static inline int countLeadingZeros(uint32_t bits)
+{
+#if defined(__GNUC__)
+  return __builtin_clz(bits);
+#else
+  int count = 0;
+
+  for (; (bits & 0x80000000u) == 0; bits <<= 1)
+    ++count;
+
+  return count;
+#endif
+}
+
+// Once an addition, subtraction or multiplication, or a loop condition against a
+// constant, has run on two integers or two doubles, run() rewrites it in place into
+// a form that only checks its operands are still of that type. When they aren't, it
+// becomes a form that never quickens again, so a site that sees both types settles
+// after one rewrite back. Define NO_QUICKENING to run the instructions as compiled.
+#ifndef NO_QUICKENING
+#define QUICKENING
+#endif
+
+// With SSE2 (or AVX2, when the compiler targets it) the lexer classifies a whole block
+// of source per step instead of a char at a time. Define NO_SIMD_LEXER to force the
+// scalar loops.
+#if defined(__SSE2__) && !defined(NO_SIMD_LEXER)
+#define SIMD_LEXER
+#endif
+
+// With SSE2 a dictionary lookup compares a group of 16 control bytes at once. Define
+// NO_SIMD_DICT to force the scalar loop.
+#if defined(__SSE2__) && !defined(NO_SIMD_DICT)
+#define SIMD_DICT
+#endif
+
+// With SSE2 (or AVX, when the compiler targets it) sum(), dot() and the rest run
+// over a list of numbers a vector at a time. Define NO_SIMD_LIST to force the
+// scalar loops, which give the same results.
+#if defined(__SSE2__) && !defined(NO_SIMD_LIST)
+#define SIMD_LIST
+#endif
+
 #endif
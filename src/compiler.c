@@ -1,8 +1,15 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include "arithmetic.h"
 #include "common.h"
 #include "compiler.h"
+#include "cvm.h"
 #include "lexer.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -24,14 +31,20 @@ typedef enum
     PREC_AND,        // and
     PREC_EQUALITY,   // == !=
     PREC_COMPARISON, // < > <= >=
+    PREC_BIT_OR,     // |
+    PREC_BIT_XOR,    // ~
+    PREC_BIT_AND,    // &
+    PREC_SHIFT,      // << >>
+    PREC_CONCAT,     // @
     PREC_ADDSUB,     // + -
-    PREC_MULDIV,     // * /
-    PREC_UNARY,      // ! -
+    PREC_MULDIV,     // * / // %
+    PREC_UNARY,      // ! - ~
+    PREC_POWER,      // **
     PREC_CALL,       // . () []
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)();
+typedef void (*ParseFn)(bool canAssign);
 
 typedef struct
 {
@@ -44,6 +57,74 @@ Parser parser;
 
 Program *compilingProgram;
 
+// Offset where the left operand of the infix rule about to run starts.
+int operandStart;
+
+// Compile-time only, dropped by compile(): finds constants already in the pool so
+// each distinct literal is stored once, and remembers the offset of the load that
+// added each one so that a folded load can give its constant back. The REPL compiles
+// every line onto the same Program, so constants below firstConst are an earlier
+// line's and were not added by any load here.
+ValueIndex constIndex;
+int *constAddedBy;
+int constAddedByAllocated;
+int firstConst;
+
+// Whether the expression just compiled can only produce a number (or fail at runtime
+// before producing anything). Reset by parsePrecedence() for every operand.
+bool producesNumber;
+
+// A scoped variable or a parameter lives in the stack slot at its index for as long
+// as the block that declared it. Names are interned, so they compare by pointer.
+typedef struct
+{
+    ObjString *name; // NULL for the slot a function's callee takes.
+    int depth;       // blockDepth where it was declared.
+    bool isCaptured; // By a fun inside its scope.
+    bool isAssigned; // Anywhere after its declaration.
+} Local;
+
+// A capture of a local by a fun compiled already. It copies the local unless the
+// local turns out to be assigned, which is only known once the local's scope ends.
+typedef struct
+{
+    ObjFunction *function;
+    int index; // In function->captures.
+} PendingCapture;
+
+// What is being compiled for one function, or for the program's top level, which is
+// the outermost. A fun inside a fun is compiled with a Compiler of its own.
+typedef struct Compiler
+{
+    struct Compiler *enclosing;
+    bool isFunction; // False for the top level.
+
+    // Number of values the code emitted so far leaves in the frame. The slots are the
+    // registers of the frame, so this is also the next free register.
+    int stackDepth;
+    int maxStackDepth;
+
+    // How many blocks (loop bodies and the like) enclose the statement being compiled.
+    int blockDepth;
+
+    Local locals[LOCAL_MAX + 1];
+    int localCount;
+
+    // Variables of the enclosing functions this one uses, resolved here, once.
+    Capture captures[CAPTURE_MAX + 1];
+    int captureCount;
+
+    // Captures of this function's locals, by the funs inside it.
+    PendingCapture *pending;
+    int pendingCount;
+    int pendingAllocated;
+} Compiler;
+
+Compiler *current;
+
+// Offset just past the last OP_CALL emitted. A return right there makes it a tail call.
+int callEnd;
+
 static Program *currentProgram()
 {
     return compilingProgram;
@@ -106,6 +187,20 @@ static void validate(TokenType type, const char *msg)
     errorAtCurrent(msg);
 }
 
+static bool check(TokenType type)
+{
+    return parser.current.type == type;
+}
+
+static bool match(TokenType type)
+{
+    if (!check(type))
+        return false;
+
+    advance();
+    return true;
+}
+
 static void emitByte(uint8_t byte)
 {
     writeProgram(currentProgram(), byte, parser.previous.line);
@@ -117,53 +212,506 @@ static void emit2Bytes(uint8_t byte1, uint8_t byte2)
     emitByte(byte2);
 }
 
-static void emitReturn()
+// Emits a jump with a placeholder offset and returns where the offset goes.
+static int emitJump(uint8_t instruction)
 {
-    emitByte(OP_RETURN);
+    emitByte(instruction);
+    emit2Bytes(0xff, 0xff);
+    return currentProgram()->actuallyInUse - 2;
+}
+
+// Points the jump whose offset is at offset to the end of the code.
+static void patchJump(int offset)
+{
+    // The jump is taken from just past its offset.
+    int jump = currentProgram()->actuallyInUse - offset - 2;
+
+    if (jump > JUMP_MAX)
+        error("Too much code to jump over");
+
+    currentProgram()->code[offset] = (uint8_t)(jump & 0xff);
+    currentProgram()->code[offset + 1] = (uint8_t)((jump >> 8) & 0xff);
+}
+
+static void emitLoop(int loopStart)
+{
+    emitByte(OP_LOOP);
+
+    // Back over the whole body and this instruction, operand included.
+    int offset = currentProgram()->actuallyInUse - loopStart + 2;
+
+    if (offset > JUMP_MAX)
+        error("Loop body is too large");
+
+    emit2Bytes((uint8_t)(offset & 0xff), (uint8_t)((offset >> 8) & 0xff));
+}
+
+// Every instruction that leaves one more value on the stack goes through here, so
+// the program knows the deepest it goes before it runs.
+static void pushStack()
+{
+    if (++current->stackDepth > current->maxStackDepth)
+        current->maxStackDepth = current->stackDepth;
 }
 
-static uint8_t makeConst(Value value)
+static int makeConst(Value value)
 {
-    int constant = addConst(currentProgram(), value);
+    Program *program = currentProgram();
+
+    int constant = findValueIndex(&constIndex, &program->consts, value);
+    if (constant != -1)
+        return constant;
+
+    constant = addConst(program, value);
 
-    if (constant > UINT8_MAX)
+    if (constant > CONST_LONG_MAX)
     {
         error("Too many constants in one program");
         return 0;
     }
 
-    return (uint8_t)constant;
+    addValueIndex(&constIndex, &program->consts, constant);
+
+    if (constAddedByAllocated < constant + 1)
+    {
+        int oldAllocated = constAddedByAllocated;
+
+        while (constAddedByAllocated < constant + 1)
+            constAddedByAllocated = GROW_NUM_OF_ALLOCATED(constAddedByAllocated);
+
+        constAddedBy = GROW_ARRAY(constAddedBy, int, oldAllocated, constAddedByAllocated);
+    }
+
+    // The load is about to be written at the end of the code.
+    constAddedBy[constant] = program->actuallyInUse;
+
+    return constant;
 }
 
 static void emitConst(Value value)
 {
-    emit2Bytes(OP_CONST, makeConst(value));
+    int constant = makeConst(value);
+
+    if (constant <= UINT8_MAX)
+    {
+        emit2Bytes(OP_CONST, (uint8_t)constant);
+    }
+    else
+    {
+        emitByte(OP_CONST_LONG);
+        emit2Bytes((uint8_t)(constant & 0xff), (uint8_t)((constant >> 8) & 0xff));
+        emitByte((uint8_t)((constant >> 16) & 0xff));
+    }
+
+    pushStack();
 }
 
-static void endCompile()
+// Returns the value on top of the stack. When that value is what the OP_CALL just
+// emitted leaves there, the call becomes a tail call instead: the frame is done, so
+// the callee can have it, and recursion in tail position runs in constant stack.
+// The OP_RETURN stays behind it for a native callee, which has no frame to take.
+static void emitReturn()
 {
-    emitReturn();
+    Program *program = currentProgram();
 
-#ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError)
+    if (callEnd == program->actuallyInUse && program->code[callEnd - 2] == OP_CALL)
+        program->code[callEnd - 2] = OP_TAIL_CALL;
+
+    emitByte(OP_RETURN);
+
+    --current->stackDepth;
+}
+
+static void initCompiler(Compiler *compiler, bool isFunction)
+{
+    compiler->enclosing = current;
+    compiler->isFunction = isFunction;
+    compiler->stackDepth = 0;
+    compiler->maxStackDepth = 0;
+    compiler->blockDepth = 0;
+    compiler->localCount = 0;
+    compiler->captureCount = 0;
+    compiler->pending = NULL;
+    compiler->pendingCount = 0;
+    compiler->pendingAllocated = 0;
+    current = compiler;
+}
+
+static Local *addLocal(ObjString *name)
+{
+    Local *local = &current->locals[current->localCount++];
+    local->name = name;
+    local->depth = current->blockDepth;
+    local->isCaptured = false;
+    local->isAssigned = false;
+    return local;
+}
+
+static void addPendingCapture(Compiler *compiler, ObjFunction *function, int index)
+{
+    if (compiler->pendingAllocated < compiler->pendingCount + 1)
     {
-        disassembleProgram(currentProgram(), "code");
+        int oldAllocated = compiler->pendingAllocated;
+        compiler->pendingAllocated = GROW_NUM_OF_ALLOCATED(oldAllocated);
+        compiler->pending = GROW_ARRAY(compiler->pending, PendingCapture, oldAllocated, compiler->pendingAllocated);
     }
-#endif
+
+    compiler->pending[compiler->pendingCount].function = function;
+    compiler->pending[compiler->pendingCount].index = index;
+    ++compiler->pendingCount;
+}
+
+// The locals in slot and above go out of scope, so whether each was ever assigned
+// is known now, and with it how the funs that captured it capture it.
+static void settleCaptures(Compiler *compiler, int slot)
+{
+    for (int i = 0; i < compiler->pendingCount;)
+    {
+        Capture *capture = &compiler->pending[i].function->captures[compiler->pending[i].index];
+
+        if (capture->index < slot)
+        {
+            ++i;
+            continue;
+        }
+
+        if (compiler->locals[capture->index].isAssigned)
+            capture->kind = CAPTURE_REFERENCE;
+
+        compiler->pending[i] = compiler->pending[--compiler->pendingCount];
+    }
+}
+
+// Called once every local of compiler has gone out of scope.
+static void freeCompiler(Compiler *compiler)
+{
+    settleCaptures(compiler, 0);
+    FREE_ARRAY(PendingCapture, compiler->pending, compiler->pendingAllocated);
 }
 
 static void expression();
 static ParseRule *getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
+static void parseConsumed(Precedence precedence);
+
+// Index of the constant loaded by the OP_CONST or OP_CONST_LONG at offset.
+static int readConstIndex(Program *program, int offset)
+{
+    uint8_t *operand = &program->code[offset + 1];
+
+    if (program->code[offset] == OP_CONST)
+        return operand[0];
+
+    return operand[0] | (operand[1] << 8) | (operand[2] << 16);
+}
+
+static bool isConstFalsy(Value value)
+{
+    return IS_NONE(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Returns true and sets value when the code in [start, end) is exactly one
+// instruction that loads a constant.
+static bool constAt(int start, int end, Value *value)
+{
+    Program *program = currentProgram();
+
+    if (start >= end || start + instructionLength(program->code[start]) != end)
+        return false;
+
+    switch (program->code[start])
+    {
+    case OP_CONST:
+    case OP_CONST_LONG:
+        *value = program->consts.values[readConstIndex(program, start)];
+        return true;
+    case OP_NONE:
+        *value = NONE_VAL;
+        return true;
+    case OP_TRUE:
+        *value = BOOL_VAL(true);
+        return true;
+    case OP_FALSE:
+        *value = BOOL_VAL(false);
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Removes the load at start, which must be the last instruction. Its constant goes
+// back to the pool if that load is what added it and nothing was added since.
+static void removeLoad(int start)
+{
+    Program *program = currentProgram();
+
+    if (program->code[start] == OP_CONST || program->code[start] == OP_CONST_LONG)
+    {
+        int constant = readConstIndex(program, start);
+
+        if (constant >= firstConst && constant == program->consts.actuallyInUse - 1 && constAddedBy[constant] == start)
+            --program->consts.actuallyInUse;
+    }
+
+    truncateProgram(program, start);
+    --current->stackDepth;
+}
+
+static void emitValue(Value value)
+{
+    if (!IS_NONE(value) && !IS_BOOL(value))
+    {
+        emitConst(value);
+        return;
+    }
+
+    emitByte(IS_NONE(value) ? OP_NONE : AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    pushStack();
+}
+
+// The instruction of an arithmetic or bitwise operator, OP_CONCAT for any other.
+static OperationCode arithmeticCode(TokenType operatorType)
+{
+    switch (operatorType)
+    {
+    case TOKEN_PLUS:
+        return OP_ADD;
+    case TOKEN_MINUS:
+        return OP_SUBTRACT;
+    case TOKEN_ASTERISK:
+        return OP_MULTIPLY;
+    case TOKEN_SLASH:
+        return OP_DIVIDE;
+    case TOKEN_DOUBLE_SLASH:
+        return OP_FLOOR_DIVIDE;
+    case TOKEN_PERCENT:
+        return OP_MODULO;
+    case TOKEN_DOUBLE_ASTERISK:
+        return OP_POWER;
+    case TOKEN_AMPERSAND:
+        return OP_BIT_AND;
+    case TOKEN_PIPE:
+        return OP_BIT_OR;
+    case TOKEN_TILDE:
+        return OP_BIT_XOR;
+    case TOKEN_LESS_LESS:
+        return OP_SHIFT_LEFT;
+    case TOKEN_GREATER_GREATER:
+        return OP_SHIFT_RIGHT;
+    default:
+        return OP_CONCAT;
+    }
+}
+
+// Evaluates a binary operator at compile time the way run() would. Returns false,
+// leaving the work to the runtime, when run() would raise an error instead.
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value *result)
+{
+    switch (operatorType)
+    {
+    case TOKEN_DOUBLE_EQUAL:
+        *result = BOOL_VAL(areValuesEqual(a, b));
+        return true;
+    case TOKEN_BANG_EQUAL:
+        *result = BOOL_VAL(!areValuesEqual(a, b));
+        return true;
+    case TOKEN_AT:
+        if (!canConcatenate(a) || !canConcatenate(b))
+            return false;
+
+        // Constants are interned strings, never ropes.
+        *result = flattenValue(concatenate(a, b));
+        return true;
+    default:
+        break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    switch (operatorType)
+    {
+    case TOKEN_GREATER:
+        *result = BOOL_VAL(isGreater(a, b));
+        return true;
+    case TOKEN_GREATER_EQUAL:
+        *result = BOOL_VAL(!isLess(a, b));
+        return true;
+    case TOKEN_LESS:
+        *result = BOOL_VAL(isLess(a, b));
+        return true;
+    case TOKEN_LESS_EQUAL:
+        *result = BOOL_VAL(!isGreater(a, b));
+        return true;
+    default:
+        return arithmetic(arithmeticCode(operatorType), a, b, result) == ARITHMETIC_OK;
+    }
+}
+
+// x * 1 and x - 0 give back x bit for bit for every number, NaN and signed zeros
+// included, as long as the 1 or 0 is an integer; a double one would make a double
+// of an integer x, as / 1 does. x + 0 does not hold either (-0 + 0 is +0).
+static bool isRightIdentity(TokenType operatorType, Value b)
+{
+    if (!IS_INT(b))
+        return false;
+
+    switch (operatorType)
+    {
+    case TOKEN_ASTERISK:
+        return AS_INT(b) == 1;
+    case TOKEN_MINUS:
+        return AS_INT(b) == 0;
+    default:
+        return false;
+    }
+}
+
+#ifdef REGISTER_VM
+// Returns true and sets the RK operand when the code in [start, end) is a single
+// load an RK operand can name instead: an OP_CONST whose index fits, or an
+// OP_GET_LOCAL, whose slot already is a register.
+static bool loadOperand(int start, int end, uint8_t *operand)
+{
+    Program *program = currentProgram();
+
+    if (end != start + 2 || program->code[start + 1] > RK_MAX)
+        return false;
+
+    switch (program->code[start])
+    {
+    case OP_CONST:
+        *operand = RK_CONST | program->code[start + 1];
+
+        // The RK operand keeps using the constant, it must not be given back.
+        if (program->code[start + 1] >= firstConst)
+            constAddedBy[program->code[start + 1]] = -1;
+        return true;
+    case OP_GET_LOCAL:
+        *operand = program->code[start + 1];
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Emits a three-address instruction over the two operands just compiled, folding
+// constant and local loads into RK operands. Returns false when the registers don't fit, in
+// which case the caller falls back to the stack form.
+static bool emitRegisterOperator(OperationCode operationCode, int leftStart, int leftEnd)
+{
+    Program *program = currentProgram();
+
+    int dst = current->stackDepth - 2;
+    if (dst + 1 > RK_MAX)
+        return false;
+
+    uint8_t a = (uint8_t)dst;
+    uint8_t b = (uint8_t)(dst + 1);
+
+    // The left load can only go once the right one has, the right operand's code
+    // was allocated registers above it.
+    if (loadOperand(leftEnd, program->actuallyInUse, &b))
+    {
+        truncateProgram(program, leftEnd);
+
+        if (loadOperand(leftStart, leftEnd, &a))
+            truncateProgram(program, leftStart);
+    }
+
+    emitByte(operationCode);
+    emit2Bytes((uint8_t)dst, a);
+    emitByte(b);
+    current->stackDepth = dst + 1;
 
-static void binary()
+    return true;
+}
+#endif
+
+static void binary(bool canAssign)
 {
-    // Remember the operator.
+    (void)canAssign;
+
+    // Remember the operator and where the left operand is.
     TokenType operatorType = parser.previous.type;
+    int leftStart = operandStart;
+    int leftEnd = currentProgram()->actuallyInUse;
+    bool leftIsNumber = producesNumber;
 
-    // Compile the right operand.
+    // Compile the right operand. @ and ** are right-associative, the others left.
     ParseRule *rule = getRule(operatorType);
-    parsePrecedence((Precedence)(rule->precedence + 1));
+    bool isRightAssociative = operatorType == TOKEN_AT || operatorType == TOKEN_DOUBLE_ASTERISK;
+    parsePrecedence((Precedence)(rule->precedence + !isRightAssociative));
+
+    producesNumber = arithmeticCode(operatorType) != OP_CONCAT;
+
+    Value a;
+    Value b;
+    Value result;
+
+    if (constAt(leftEnd, currentProgram()->actuallyInUse, &b))
+    {
+        if (constAt(leftStart, leftEnd, &a) && foldBinary(operatorType, a, b, &result))
+        {
+            removeLoad(leftEnd);
+            removeLoad(leftStart);
+            emitValue(result);
+            producesNumber = IS_NUMBER(result);
+            return;
+        }
+
+        // Only when the left operand is known to be a number, so a type error isn't lost.
+        if (leftIsNumber && isRightIdentity(operatorType, b))
+        {
+            removeLoad(leftEnd);
+            return;
+        }
+    }
+
+#ifdef REGISTER_VM
+    OperationCode registerCode;
+
+    switch (operatorType)
+    {
+    case TOKEN_BANG_EQUAL:
+    case TOKEN_DOUBLE_EQUAL:
+        registerCode = OP_EQUAL_R;
+        break;
+    case TOKEN_GREATER:
+    case TOKEN_LESS_EQUAL:
+        registerCode = OP_GREATER_R;
+        break;
+    case TOKEN_LESS:
+    case TOKEN_GREATER_EQUAL:
+        registerCode = OP_LESS_R;
+        break;
+    case TOKEN_PLUS:
+        registerCode = OP_ADD_R;
+        break;
+    case TOKEN_MINUS:
+        registerCode = OP_SUBTRACT_R;
+        break;
+    case TOKEN_ASTERISK:
+        registerCode = OP_MULTIPLY_R;
+        break;
+    case TOKEN_SLASH:
+        registerCode = OP_DIVIDE_R;
+        break;
+    default:
+        registerCode = OP_CONCAT; // @ only has the stack form below.
+        break;
+    }
+
+    if (registerCode != OP_CONCAT && emitRegisterOperator(registerCode, leftStart, leftEnd))
+    {
+        if (operatorType == TOKEN_BANG_EQUAL || operatorType == TOKEN_GREATER_EQUAL ||
+            operatorType == TOKEN_LESS_EQUAL)
+            emitByte(OP_NOT);
+        return;
+    }
+#endif
+
+    --current->stackDepth;
 
     // Emit the operator instruction.
     switch (operatorType)
@@ -186,25 +734,19 @@ static void binary()
     case TOKEN_LESS_EQUAL:
         emit2Bytes(OP_GREATER, OP_NOT);
         break;
-    case TOKEN_PLUS:
-        emitByte(OP_ADD);
-        break;
-    case TOKEN_MINUS:
-        emitByte(OP_SUBTRACT);
-        break;
-    case TOKEN_ASTERISK:
-        emitByte(OP_MULTIPLY);
-        break;
-    case TOKEN_SLASH:
-        emitByte(OP_DIVIDE);
+    case TOKEN_AT:
+        emitByte(OP_CONCAT);
         break;
     default:
-        return; // Unreachable.
+        emitByte(arithmeticCode(operatorType));
+        break;
     }
 }
 
-static void literal()
+static void literal(bool canAssign)
 {
+    (void)canAssign;
+
     switch (parser.previous.type)
     {
     case TOKEN_FALSE:
@@ -219,52 +761,470 @@ static void literal()
     default:
         return; // Unreachable.
     }
+
+    pushStack();
 }
 
-static void group()
+static void group(bool canAssign)
 {
+    (void)canAssign;
+
     expression();
     validate(TOKEN_RPAREN, "Expected ')' after expression");
 }
 
-static void number()
+static void number(bool canAssign)
 {
-    emitConst(NUMBER_VAL(strtod(parser.previous.start, NULL)));
-}
+    (void)canAssign;
 
-static void unary()
-{
-    TokenType operatorType = parser.previous.type;
+    // The source need not be NUL-terminated, so strtod() gets a terminated copy.
+    char digits[64];
+    char *text = digits;
+    int length = parser.previous.length;
 
-    // Compile the operand.
-    parsePrecedence(PREC_UNARY);
+    if (length >= (int)sizeof(digits))
+        text = GROW_ARRAY(NULL, char, 0, length + 1);
 
-    // Emit the operator instruction.
-    switch (operatorType)
+    memcpy(text, parser.previous.start, length);
+    text[length] = '\0';
+
+    // Digits alone are an integer, unless there are too many for one.
+    Value value = NUMBER_VAL(strtod(text, NULL));
+
+    if (memchr(text, '.', length) == NULL)
     {
-    case TOKEN_BANG:
-        emitByte(OP_NOT);
-        break;
-    case TOKEN_MINUS:
-        emitByte(OP_NEGATE);
-        break;
-    default:
-        return; // Unreachable.
+        errno = 0;
+        long long integer = strtoll(text, NULL, 10);
+
+        if (errno != ERANGE && FITS_INTEGER(integer))
+            value = INT_VAL(integer);
     }
+
+    emitConst(value);
+    producesNumber = true;
+
+    if (text != digits)
+        FREE_ARRAY(char, text, length + 1);
 }
 
-ParseRule rules[] = {
-    {group, NULL, PREC_NONE},        // TOKEN_LPAREN
-    {NULL, NULL, PREC_NONE},         // TOKEN_RPAREN
-    {NULL, NULL, PREC_NONE},         // TOKEN_LBRACE
-    {NULL, NULL, PREC_NONE},         // TOKEN_RBRACE
-    {NULL, NULL, PREC_NONE},         // TOKEN_COMMA
-    {NULL, NULL, PREC_NONE},         // TOKEN_DOT
+// The innermost scoped variable of compiler with this name, or -1 when there is none.
+static int resolveLocal(Compiler *compiler, ObjString *name)
+{
+    for (int i = compiler->localCount - 1; i >= 0; --i)
+    {
+        if (compiler->locals[i].name == name)
+            return i;
+    }
+
+    return -1;
+}
+
+static int addCapture(Compiler *compiler, CaptureKind kind, int index)
+{
+    for (int i = 0; i < compiler->captureCount; ++i)
+    {
+        if (compiler->captures[i].kind == kind && compiler->captures[i].index == index)
+            return i;
+    }
+
+    if (compiler->captureCount > CAPTURE_MAX)
+    {
+        error("Too many captured variables in one function");
+        return 0;
+    }
+
+    compiler->captures[compiler->captureCount].kind = (uint8_t)kind;
+    compiler->captures[compiler->captureCount].index = (uint8_t)index;
+    return compiler->captureCount++;
+}
+
+// The index among compiler's captures of the variable of an enclosing function with
+// this name, or -1 when no enclosing function has one. A function in between
+// captures it too, to hand it down.
+static int resolveCapture(Compiler *compiler, ObjString *name, bool isSet)
+{
+    Compiler *enclosing = compiler->enclosing;
+
+    if (enclosing == NULL)
+        return -1;
+
+    int local = resolveLocal(enclosing, name);
+
+    if (local != -1)
+    {
+        enclosing->locals[local].isCaptured = true;
+        enclosing->locals[local].isAssigned |= isSet;
+
+        // A copy for now, settleCaptures() has the final say.
+        return addCapture(compiler, CAPTURE_VALUE, local);
+    }
+
+    int capture = resolveCapture(enclosing, name, isSet);
+
+    if (capture == -1)
+        return -1;
+
+    return addCapture(compiler, CAPTURE_ENCLOSING, capture);
+}
+
+// Variables are resolved to their slot here, once, so running the code never looks
+// a name up. A scoped variable is a stack slot, one of an enclosing function is a
+// capture, anything else is a global, and a global that was never assigned reads
+// as none. Emits the get, or the set of the value on top of the stack.
+static void namedVariable(ObjString *name, bool isSet)
+{
+    OperationCode getCode = OP_GET_LOCAL;
+    OperationCode setCode = OP_SET_LOCAL;
+    int slot = resolveLocal(current, name);
+
+    if (slot != -1)
+    {
+        current->locals[slot].isAssigned |= isSet;
+    }
+    else if ((slot = resolveCapture(current, name, isSet)) != -1)
+    {
+        getCode = OP_GET_UPVALUE;
+        setCode = OP_SET_UPVALUE;
+    }
+    else
+    {
+        getCode = OP_GET_GLOBAL;
+        setCode = OP_SET_GLOBAL;
+        slot = globalSlot(name);
+
+        if (slot > GLOBAL_MAX)
+        {
+            error("Too many global variables");
+            return;
+        }
+    }
+
+    if (isSet)
+    {
+        emitByte(setCode);
+        --current->stackDepth;
+    }
+    else
+    {
+        emitByte(getCode);
+        pushStack();
+    }
+
+    if (getCode != OP_GET_GLOBAL)
+        emitByte((uint8_t)slot);
+    else
+        emit2Bytes((uint8_t)(slot & 0xff), (uint8_t)((slot >> 8) & 0xff));
+}
+
+static void variable(bool canAssign)
+{
+    ObjString *name = copyString(parser.previous.start, parser.previous.length);
+
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        expression();
+        namedVariable(name, true);
+    }
+    else
+    {
+        namedVariable(name, false);
+    }
+}
+
+static void call(bool canAssign)
+{
+    (void)canAssign;
+
+    int argCount = 0;
+
+    if (!check(TOKEN_RPAREN))
+    {
+        do
+        {
+            if (argCount == UINT8_MAX)
+            {
+                error("Too many arguments");
+                return;
+            }
+
+            expression();
+            ++argCount;
+        } while (match(TOKEN_COMMA));
+    }
+
+    validate(TOKEN_RPAREN, "Expected ')' after the arguments");
+
+    emit2Bytes(OP_CALL, (uint8_t)argCount);
+    current->stackDepth -= argCount;
+    callEnd = currentProgram()->actuallyInUse;
+    producesNumber = false;
+}
+
+// d[key] and d.name, which is d['name'], and their assignments.
+static void subscript(bool canAssign)
+{
+    if (parser.previous.type == TOKEN_DOT)
+    {
+        validate(TOKEN_IDENTIFIER, "Expected a key name after '.'");
+        emitConst(OBJ_VAL(copyString(parser.previous.start, parser.previous.length)));
+    }
+    else
+    {
+        expression();
+        validate(TOKEN_RBRACKET, "Expected ']' after the key");
+    }
+
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        expression();
+        emitByte(OP_SET_INDEX);
+        current->stackDepth -= 3;
+    }
+    else
+    {
+        emitByte(OP_GET_INDEX);
+        --current->stackDepth;
+    }
+
+    producesNumber = false;
+}
+
+// {1, 2, name: x, [key]: v}. The values without a key are keys 0, 1, 2..., the
+// count of each kind sizes the dictionary's parts up front.
+static void dictionary(bool canAssign)
+{
+    (void)canAssign;
+
+    emitByte(OP_DICT);
+    int hints = currentProgram()->actuallyInUse;
+    emit2Bytes(0, 0);
+    pushStack();
+
+    int arrayCount = 0;
+    int hashCount = 0;
+
+    while (!check(TOKEN_RBRACE) && !check(TOKEN_EOF))
+    {
+        if (match(TOKEN_LBRACKET))
+        {
+            expression();
+            validate(TOKEN_RBRACKET, "Expected ']' after the key");
+            validate(TOKEN_COLON, "Expected ':' after the key");
+            expression();
+            ++hashCount;
+        }
+        else if (match(TOKEN_IDENTIFIER))
+        {
+            // Interned before the colon is taken, a streamed source may have reused
+            // the name's characters by then.
+            ObjString *name = copyString(parser.previous.start, parser.previous.length);
+
+            if (match(TOKEN_COLON))
+            {
+                emitConst(OBJ_VAL(name));
+                expression();
+                ++hashCount;
+            }
+            else
+            {
+                // Just a value that starts with a name, taken already.
+                emitConst(INT_VAL(arrayCount++));
+                parseConsumed(PREC_OR);
+            }
+        }
+        else
+        {
+            emitConst(INT_VAL(arrayCount++));
+            expression();
+        }
+
+        emitByte(OP_DICT_SET);
+        current->stackDepth -= 2;
+
+        if (!match(TOKEN_COMMA))
+            break;
+    }
+
+    validate(TOKEN_RBRACE, "Expected '}' after the dictionary");
+
+    currentProgram()->code[hints] = (uint8_t)(arrayCount < UINT8_MAX ? arrayCount : UINT8_MAX);
+    currentProgram()->code[hints + 1] = (uint8_t)(hashCount < UINT8_MAX ? hashCount : UINT8_MAX);
+    producesNumber = false;
+}
+
+static void statement();
+
+// Compiles the parameters and body of a function, after its name if it has one, and
+// emits the load of the function. The body goes right here in the code, behind a
+// jump for whatever is running to skip it.
+static void function(ObjString *name)
+{
+    int skipJump = emitJump(OP_JUMP);
+
+    Compiler compiler;
+    initCompiler(&compiler, true);
+    int entry = currentProgram()->actuallyInUse;
+    int arity = 0;
+
+    // Slot 0 holds the function being called, the arguments follow it.
+    addLocal(NULL);
+    pushStack();
+
+    validate(TOKEN_LPAREN, "Expected '(' before the parameters");
+
+    if (!check(TOKEN_RPAREN))
+    {
+        do
+        {
+            if (current->localCount > LOCAL_MAX)
+            {
+                error("Too many parameters");
+                break;
+            }
+
+            validate(TOKEN_IDENTIFIER, "Expected a parameter name");
+            if (parser.crazyMode)
+                break;
+
+            addLocal(copyString(parser.previous.start, parser.previous.length));
+            ++arity;
+            pushStack();
+        } while (match(TOKEN_COMMA));
+    }
+
+    validate(TOKEN_RPAREN, "Expected ')' after the parameters");
+
+    while (!check(TOKEN_END) && !check(TOKEN_EOF))
+        statement();
+
+    validate(TOKEN_END, "'end' is expected after the function body");
+
+    // Falling off the end returns none, unless the last statement returned already.
+    emitValue(NONE_VAL);
+    emitReturn();
+
+    ObjFunction *function = newFunction(name, compiler.captureCount);
+    function->arity = arity;
+    function->entry = entry;
+    function->maxStackDepth = compiler.maxStackDepth;
+    memcpy(function->captures, compiler.captures, compiler.captureCount * sizeof(Capture));
+
+    freeCompiler(&compiler);
+    current = current->enclosing;
+
+    patchJump(skipJump);
+
+    // Without captures the function is all there is to it, a constant.
+    if (function->captureCount == 0)
+    {
+        emitConst(OBJ_VAL(function));
+        return;
+    }
+
+    for (int i = 0; i < function->captureCount; ++i)
+    {
+        if (function->captures[i].kind == CAPTURE_VALUE)
+            addPendingCapture(current, function, i);
+    }
+
+    int constant = makeConst(OBJ_VAL(function));
+    emitByte(OP_CLOSURE);
+    emit2Bytes((uint8_t)(constant & 0xff), (uint8_t)((constant >> 8) & 0xff));
+    emitByte((uint8_t)((constant >> 16) & 0xff));
+    pushStack();
+}
+
+// fun (parameters) body end, a function with no name.
+static void lambda(bool canAssign)
+{
+    (void)canAssign;
+
+    function(NULL);
+}
+
+static void string(bool canAssign)
+{
+    (void)canAssign;
+
+    // Drop the quotes.
+    emitConst(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+}
+
+static void unary(bool canAssign)
+{
+    (void)canAssign;
+
+    TokenType operatorType = parser.previous.type;
+    int start = currentProgram()->actuallyInUse;
+
+    // Compile the operand.
+    parsePrecedence(PREC_UNARY);
+
+    Value value;
+
+    if (constAt(start, currentProgram()->actuallyInUse, &value))
+    {
+        if (operatorType == TOKEN_BANG)
+        {
+            removeLoad(start);
+            emitValue(BOOL_VAL(isConstFalsy(value)));
+            producesNumber = false;
+            return;
+        }
+
+        Value result;
+
+        if (operatorType != TOKEN_BANG &&
+            arithmeticUnary(operatorType == TOKEN_MINUS ? OP_NEGATE : OP_BIT_NOT, value, &result) == ARITHMETIC_OK)
+        {
+            removeLoad(start);
+            emitValue(result);
+            producesNumber = true;
+            return;
+        }
+    }
+
+    producesNumber = operatorType != TOKEN_BANG;
+
+    // Emit the operator instruction.
+    switch (operatorType)
+    {
+    case TOKEN_BANG:
+        emitByte(OP_NOT);
+        break;
+    case TOKEN_MINUS:
+        emitByte(OP_NEGATE);
+        break;
+    case TOKEN_TILDE:
+        emitByte(OP_BIT_NOT);
+        break;
+    default:
+        return; // Unreachable.
+    }
+}
+
+ParseRule rules[] = {
+    {group, call, PREC_CALL},        // TOKEN_LPAREN
+    {NULL, NULL, PREC_NONE},         // TOKEN_RPAREN
+    {dictionary, NULL, PREC_NONE},   // TOKEN_LBRACE
+    {NULL, NULL, PREC_NONE},         // TOKEN_RBRACE
+    {NULL, subscript, PREC_CALL},    // TOKEN_LBRACKET
+    {NULL, NULL, PREC_NONE},         // TOKEN_RBRACKET
+    {NULL, NULL, PREC_NONE},         // TOKEN_COMMA
+    {NULL, subscript, PREC_CALL},    // TOKEN_DOT
     {unary, binary, PREC_ADDSUB},    // TOKEN_MINUS
     {NULL, binary, PREC_ADDSUB},     // TOKEN_PLUS
     {NULL, NULL, PREC_NONE},         // TOKEN_SEMICOLON
+    {NULL, NULL, PREC_NONE},         // TOKEN_COLON
     {NULL, binary, PREC_MULDIV},     // TOKEN_SLASH
     {NULL, binary, PREC_MULDIV},     // TOKEN_ASTERISK
+    {NULL, binary, PREC_CONCAT},     // TOKEN_AT
+    {NULL, binary, PREC_MULDIV},     // TOKEN_PERCENT
+    {NULL, binary, PREC_BIT_AND},    // TOKEN_AMPERSAND
+    {NULL, binary, PREC_BIT_OR},     // TOKEN_PIPE
+    {unary, binary, PREC_BIT_XOR},   // TOKEN_TILDE
+    {NULL, binary, PREC_MULDIV},     // TOKEN_DOUBLE_SLASH
+    {NULL, binary, PREC_POWER},      // TOKEN_DOUBLE_ASTERISK
     {unary, NULL, PREC_NONE},        // TOKEN_BANG
     {NULL, binary, PREC_EQUALITY},   // TOKEN_BANG_EQUAL
     {NULL, NULL, PREC_NONE},         // TOKEN_EQUAL
@@ -273,21 +1233,29 @@ ParseRule rules[] = {
     {NULL, binary, PREC_COMPARISON}, // TOKEN_GREATER_EQUAL
     {NULL, binary, PREC_COMPARISON}, // TOKEN_LESS
     {NULL, binary, PREC_COMPARISON}, // TOKEN_LESS_EQUAL
-    {NULL, NULL, PREC_NONE},         // TOKEN_IDENTIFIER
-    {NULL, NULL, PREC_NONE},         // TOKEN_STRING
+    {NULL, binary, PREC_SHIFT},      // TOKEN_LESS_LESS
+    {NULL, binary, PREC_SHIFT},      // TOKEN_GREATER_GREATER
+    {variable, NULL, PREC_NONE},     // TOKEN_IDENTIFIER
+    {string, NULL, PREC_NONE},       // TOKEN_STRING
     {number, NULL, PREC_NONE},       // TOKEN_NUMBER
     {NULL, NULL, PREC_NONE},         // TOKEN_AND
     {NULL, NULL, PREC_NONE},         // TOKEN_CLASS
+    {NULL, NULL, PREC_NONE},         // TOKEN_DO
+    {NULL, NULL, PREC_NONE},         // TOKEN_ELIF
     {NULL, NULL, PREC_NONE},         // TOKEN_ELSE
+    {NULL, NULL, PREC_NONE},         // TOKEN_END
     {literal, NULL, PREC_NONE},      // TOKEN_FALSE
     {NULL, NULL, PREC_NONE},         // TOKEN_FOR
-    {NULL, NULL, PREC_NONE},         // TOKEN_FUN
+    {lambda, NULL, PREC_NONE},       // TOKEN_FUN
     {NULL, NULL, PREC_NONE},         // TOKEN_IF
     {literal, NULL, PREC_NONE},      // TOKEN_NONE
     {NULL, NULL, PREC_NONE},         // TOKEN_OR
     {NULL, NULL, PREC_NONE},         // TOKEN_PRINT
+    {NULL, NULL, PREC_NONE},         // TOKEN_PRINTLN
     {NULL, NULL, PREC_NONE},         // TOKEN_RETURN
+    {NULL, NULL, PREC_NONE},         // TOKEN_SCOPED
     {NULL, NULL, PREC_NONE},         // TOKEN_SUPER
+    {NULL, NULL, PREC_NONE},         // TOKEN_THEN
     {NULL, NULL, PREC_NONE},         // TOKEN_THIS
     {literal, NULL, PREC_NONE},      // TOKEN_TRUE
     {NULL, NULL, PREC_NONE},         // TOKEN_VAR
@@ -296,9 +1264,10 @@ ParseRule rules[] = {
     {NULL, NULL, PREC_NONE},         // TOKEN_EOF
 };
 
-static void parsePrecedence(Precedence precedence)
+// parsePrecedence() once the operand's first token has been consumed.
+static void parseConsumed(Precedence precedence)
 {
-    advance();
+    int start = currentProgram()->actuallyInUse;
     ParseFn prefixRule = getRule(parser.previous.type)->prefix;
     if (prefixRule == NULL)
     {
@@ -306,14 +1275,28 @@ static void parsePrecedence(Precedence precedence)
         return;
     }
 
-    prefixRule();
+    // Only a statement parses at PREC_ASSIGNMENT, assignment isn't an expression.
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+
+    producesNumber = false;
+    prefixRule(canAssign);
 
     while (precedence <= getRule(parser.current.type)->precedence)
     {
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule();
+        operandStart = start;
+        infixRule(canAssign);
     }
+
+    if (canAssign && match(TOKEN_EQUAL))
+        error("Invalid assignment target");
+}
+
+static void parsePrecedence(Precedence precedence)
+{
+    advance();
+    parseConsumed(precedence);
 }
 
 static ParseRule *getRule(TokenType type)
@@ -323,23 +1306,423 @@ static ParseRule *getRule(TokenType type)
 
 void expression()
 {
-    parsePrecedence(PREC_ASSIGNMENT);
+    parsePrecedence(PREC_OR);
+}
+
+// The scoped variables of the block being left end with it. Those closures share
+// move to the heap.
+static void endBlock()
+{
+    --current->blockDepth;
+
+    while (current->localCount > 0 && current->locals[current->localCount - 1].depth > current->blockDepth)
+    {
+        Local *local = &current->locals[current->localCount - 1];
+        emitByte(local->isCaptured && local->isAssigned ? OP_CLOSE_UPVALUE : OP_POP);
+        --current->localCount;
+        --current->stackDepth;
+    }
+
+    settleCaptures(current, current->localCount);
+}
+
+static void block()
+{
+    ++current->blockDepth;
+
+    while (!check(TOKEN_END) && !check(TOKEN_ELIF) && !check(TOKEN_ELSE) && !check(TOKEN_EOF))
+        statement();
+
+    endBlock();
+}
+
+// isConsumed is set when statement() already took the first token to see what it is.
+static void expressionStatement(bool isConsumed)
+{
+    int depth = current->stackDepth;
+
+    if (isConsumed)
+        parseConsumed(PREC_ASSIGNMENT);
+    else
+        parsePrecedence(PREC_ASSIGNMENT);
+
+    // An assignment leaves nothing behind.
+    if (current->stackDepth == depth)
+        return;
+
+    // A function returns the value of its last statement, as a tail call when it is
+    // one. That of the last statement of a program is printed, the way it always was
+    // when a program was a single expression, so the REPL echoes every line.
+    if (current->blockDepth == 0 && current->isFunction && check(TOKEN_END))
+    {
+        emitReturn();
+        return;
+    }
+
+    emitByte(current->blockDepth == 0 && !current->isFunction && check(TOKEN_EOF) ? OP_PRINTLN : OP_POP);
+    --current->stackDepth;
+}
+
+static void printStatement(OperationCode operationCode)
+{
+    expression();
+    emitByte(operationCode);
+    --current->stackDepth;
+}
+
+// if x then ... elif y then ... else ... end. An elif is compiled as an if of its own
+// in the else branch, which shares the if's end.
+static void ifStatement()
+{
+    expression();
+    validate(TOKEN_THEN, "'then' is expected after the condition");
+
+    int thenJump = emitJump(OP_JUMP_IF_FALSE);
+    --current->stackDepth;
+
+    block();
+
+    if (!check(TOKEN_ELIF) && !check(TOKEN_ELSE))
+    {
+        patchJump(thenJump);
+        validate(TOKEN_END, "'end' is expected after the if body");
+        return;
+    }
+
+    int elseJump = emitJump(OP_JUMP);
+    patchJump(thenJump);
+
+    if (match(TOKEN_ELIF))
+    {
+        ifStatement();
+    }
+    else
+    {
+        advance();
+        block();
+        validate(TOKEN_END, "'end' is expected after the else body");
+    }
+
+    patchJump(elseJump);
+}
+
+// return with no value returns none. At the top level it ends the program.
+static void returnStatement()
+{
+    if (check(TOKEN_END) || check(TOKEN_ELIF) || check(TOKEN_ELSE) || check(TOKEN_EOF) || check(TOKEN_SEMICOLON))
+        emitValue(NONE_VAL);
+    else
+        expression();
+
+    emitReturn();
+    match(TOKEN_SEMICOLON);
+}
+
+// fun name(parameters) body end assigns the function to name, the way name = would.
+// Without a name it is a fun expression.
+static void funStatement()
+{
+    if (!match(TOKEN_IDENTIFIER))
+    {
+        expressionStatement(true);
+        return;
+    }
+
+    ObjString *name = copyString(parser.previous.start, parser.previous.length);
+    function(name);
+    namedVariable(name, true);
+}
+
+// scoped a, b = x, y declares variables local to the enclosing block. The values are
+// evaluated before the names exist, so scoped x = x reads the outer x. Missing
+// values are none and extra ones are evaluated and dropped.
+static void scopedStatement()
+{
+    ObjString *names[LOCAL_MAX + 1];
+    int count = 0;
+
+    // scoped fun name(parameters) body end declares a function the same way.
+    if (match(TOKEN_FUN))
+    {
+        if (current->localCount > LOCAL_MAX)
+        {
+            error("Too many scoped variables");
+            return;
+        }
+
+        validate(TOKEN_IDENTIFIER, "Expected a function name");
+        if (parser.crazyMode)
+            return;
+
+        // Declared first so the body can call it, which it does through the slot
+        // the function is about to be stored in.
+        ObjString *name = copyString(parser.previous.start, parser.previous.length);
+        int slot = current->localCount;
+        addLocal(name);
+        function(name);
+
+        if (current->locals[slot].isCaptured)
+            current->locals[slot].isAssigned = true;
+        return;
+    }
+
+    do
+    {
+        if (current->localCount + count > LOCAL_MAX)
+        {
+            error("Too many scoped variables");
+            return;
+        }
+
+        validate(TOKEN_IDENTIFIER, "Expected a variable name");
+        if (parser.crazyMode)
+            return;
+
+        names[count++] = copyString(parser.previous.start, parser.previous.length);
+    } while (match(TOKEN_COMMA));
+
+    int values = 0;
+
+    if (match(TOKEN_EQUAL))
+    {
+        do
+        {
+            expression();
+            ++values;
+        } while (match(TOKEN_COMMA));
+    }
+
+    for (; values < count; ++values)
+        emitValue(NONE_VAL);
+
+    for (; values > count; --values)
+    {
+        emitByte(OP_POP);
+        --current->stackDepth;
+    }
+
+    // The values are already in the slots the variables take.
+    for (int i = 0; i < count; ++i)
+        addLocal(names[i]);
+}
+
+static void whileStatement()
+{
+    int loopStart = currentProgram()->actuallyInUse;
+
+    expression();
+    validate(TOKEN_DO, "'do' is expected after the condition");
+
+    int exitJump = emitJump(OP_JUMP_IF_FALSE);
+    --current->stackDepth;
+
+    block();
+    validate(TOKEN_END, "'end' is expected after the loop body");
+
+    emitLoop(loopStart);
+    patchJump(exitJump);
 }
 
-bool compile(const char *src, Program *program)
+// for i = start, i < limit do ... end counts i up by one while the condition holds,
+// for i = start, i > limit do ... end down by one, and <= and >= likewise. A step
+// can follow the limit: for i = 0, i < 10, 2 do. The limit and the step are
+// evaluated once, before the first time round, and kept in hidden variables above
+// i, which is scoped to the loop. OP_FORLOOP steps, compares and jumps back at once.
+static void forStatement()
 {
-    initLexer(src);
+    validate(TOKEN_IDENTIFIER, "Expected the loop variable after 'for'");
+    if (parser.crazyMode)
+        return;
+
+    ObjString *name = copyString(parser.previous.start, parser.previous.length);
+
+    if (current->localCount + 2 > LOCAL_MAX)
+    {
+        error("Too many scoped variables");
+        return;
+    }
+
+    validate(TOKEN_EQUAL, "'=' is expected after the loop variable");
+    expression();
+    validate(TOKEN_COMMA, "',' is expected after the start value");
+
+    validate(TOKEN_IDENTIFIER, "Expected the loop variable to compare with the limit");
+    if (parser.crazyMode)
+        return;
 
+    if (copyString(parser.previous.start, parser.previous.length) != name)
+        error("The condition must compare the loop variable");
+
+    ForComparison comparison = FOR_LESS;
+
+    if (match(TOKEN_LESS_EQUAL))
+        comparison = FOR_LESS_EQUAL;
+    else if (match(TOKEN_GREATER))
+        comparison = FOR_GREATER;
+    else if (match(TOKEN_GREATER_EQUAL))
+        comparison = FOR_GREATER_EQUAL;
+    else
+        validate(TOKEN_LESS, "Expected <, <=, > or >= after the loop variable");
+
+    if (parser.crazyMode)
+        return;
+
+    expression();
+
+    if (match(TOKEN_COMMA))
+        expression();
+    else
+        emitValue(INT_VAL(comparison == FOR_LESS || comparison == FOR_LESS_EQUAL ? 1 : -1));
+
+    validate(TOKEN_DO, "'do' is expected after the condition");
+
+    // The values are already in the slots the variables take.
+    ++current->blockDepth;
+    int slot = current->localCount;
+    addLocal(name);
+    addLocal(NULL);
+    addLocal(NULL);
+
+    emit2Bytes(OP_FORPREP, (uint8_t)slot);
+    emitByte((uint8_t)comparison);
+    emit2Bytes(0xff, 0xff);
+    int exitJump = currentProgram()->actuallyInUse - 2;
+
+    int bodyStart = currentProgram()->actuallyInUse;
+
+    block();
+    validate(TOKEN_END, "'end' is expected after the loop body");
+
+    emit2Bytes(OP_FORLOOP, (uint8_t)slot);
+    emitByte((uint8_t)comparison);
+
+    // Back over the whole body and this instruction, operand included.
+    int offset = currentProgram()->actuallyInUse - bodyStart + 2;
+
+    if (offset > JUMP_MAX)
+        error("Loop body is too large");
+
+    emit2Bytes((uint8_t)(offset & 0xff), (uint8_t)((offset >> 8) & 0xff));
+    patchJump(exitJump);
+
+    endBlock();
+}
+
+// Skips to the next statement after an error, so that one mistake is reported once.
+static void synchronize()
+{
+    parser.crazyMode = false;
+
+    while (!check(TOKEN_EOF))
+    {
+        switch (parser.current.type)
+        {
+        case TOKEN_DO:
+        case TOKEN_FOR:
+        case TOKEN_FUN:
+        case TOKEN_IF:
+        case TOKEN_PRINT:
+        case TOKEN_PRINTLN:
+        case TOKEN_RETURN:
+        case TOKEN_SCOPED:
+        case TOKEN_WHILE:
+            return;
+        default:
+            advance();
+        }
+    }
+}
+
+static void statement()
+{
+    if (match(TOKEN_PRINT))
+        printStatement(OP_PRINT);
+    else if (match(TOKEN_PRINTLN))
+        printStatement(OP_PRINTLN);
+    else if (match(TOKEN_WHILE))
+        whileStatement();
+    else if (match(TOKEN_FOR))
+        forStatement();
+    else if (match(TOKEN_IF))
+        ifStatement();
+    else if (match(TOKEN_RETURN))
+        returnStatement();
+    else if (match(TOKEN_FUN))
+        funStatement();
+    else if (match(TOKEN_SCOPED))
+        scopedStatement();
+    else if (match(TOKEN_DO))
+    {
+        block();
+        validate(TOKEN_END, "'end' is expected after the block");
+    }
+    else if (!match(TOKEN_SEMICOLON))
+        expressionStatement(false);
+
+    if (parser.crazyMode)
+        synchronize();
+}
+
+static void endCompile()
+{
+    // Falling off the end of the top level returns none like a function would.
+    emitValue(NONE_VAL);
+    emitReturn();
+
+    if (current->maxStackDepth > currentProgram()->maxStackDepth)
+        currentProgram()->maxStackDepth = current->maxStackDepth;
+
+    freeCompiler(current);
+    current = current->enclosing;
+
+    if (!parser.hadError)
+        optimizeProgram(currentProgram());
+
+#ifdef DEBUG_PRINT_CODE
+    if (!parser.hadError)
+    {
+        disassembleProgram(currentProgram(), "code");
+    }
+#endif
+}
+
+static bool compileLexed(Program *program)
+{
     compilingProgram = program;
 
     parser.hadError = false;
     parser.crazyMode = false;
 
+    Compiler compiler;
+    current = NULL;
+    initCompiler(&compiler, false);
+    callEnd = -1;
+    initValueIndex(&constIndex);
+    firstConst = program->consts.actuallyInUse;
+
     advance();
-    expression();
-    validate(TOKEN_EOF, "EOF is expected");
+
+    while (!match(TOKEN_EOF))
+        statement();
 
     endCompile();
 
+    freeValueIndex(&constIndex);
+    FREE_ARRAY(int, constAddedBy, constAddedByAllocated);
+    constAddedBy = NULL;
+    constAddedByAllocated = 0;
+
     return !parser.hadError;
 }
+
+bool compile(const char *src, size_t length, Program *program)
+{
+    initLexer(src, src + length);
+    return compileLexed(program);
+}
+
+bool compileStream(RefillSource refill, void *context, Program *program)
+{
+    initStreamLexer(refill, context);
+    return compileLexed(program);
+}
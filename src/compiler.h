@@ -2,7 +2,9 @@
 #define COMPILER_H
 
 #include "cvm.h"                                
+#include "lexer.h"
 
-bool compile(const char *src, Program *program);
+bool compile(const char *src, size_t length, Program *program);
+bool compileStream(RefillSource refill, void *context, Program *program);
 
 #endif
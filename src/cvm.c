@@ -1,18 +1,71 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arithmetic.h"
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "dict.h"
 #include "cvm.h"
+#include "native.h"
+#include "object.h"
 
 CVM vm;
 
 static void resetStack()
 {
     vm.stackTop = vm.stack;
+    vm.frameCount = 0;
+    vm.openUpvalues = NULL;
 }
 
-static void runtimeError(const char *format, ...)
+// The function a call to callee runs, or NULL when callee can't be called.
+static inline ObjFunction *functionOf(Value callee)
+{
+    if (IS_FUNCTION(callee))
+        return AS_FUNCTION(callee);
+    if (IS_CLOSURE(callee))
+        return AS_CLOSURE(callee)->function;
+    return NULL;
+}
+
+// Returns the open upvalue of the variable in slot, an index in vm.stack, opening
+// one if there is none yet, so that every closure capturing it shares it.
+static ObjUpvalue *captureUpvalue(int slot)
+{
+    ObjUpvalue **link = &vm.openUpvalues;
+
+    while (*link != NULL && (*link)->slot > slot)
+        link = &(*link)->nextOpen;
+
+    if (*link != NULL && (*link)->slot == slot)
+        return *link;
+
+    ObjUpvalue *upvalue = newUpvalue(slot);
+    upvalue->nextOpen = *link;
+    *link = upvalue;
+
+    return upvalue;
+}
+
+// The variables in slot and above go out of scope: their upvalues take their values.
+static void closeUpvalues(int slot)
+{
+    while (vm.openUpvalues != NULL && vm.openUpvalues->slot >= slot)
+    {
+        ObjUpvalue *upvalue = vm.openUpvalues;
+        upvalue->closed = vm.stack[upvalue->slot];
+        upvalue->slot = -1;
+        vm.openUpvalues = upvalue->nextOpen;
+        upvalue->nextOpen = NULL;
+
+        if (IS_OBJ(upvalue->closed))
+            writeBarrier(&upvalue->obj, AS_OBJ(upvalue->closed));
+    }
+}
+
+void runtimeError(const char *format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -20,25 +73,158 @@ static void runtimeError(const char *format, ...)
     va_end(args);
     fputs("\n", stderr);
 
-    size_t instruction = vm.ip - vm.program->code;
-    int line = vm.program->lines[instruction];
-    fprintf(stderr, "on line %d\n", line);
+    // ip is already past the failing instruction, its last byte is at ip - 1.
+    size_t instruction = vm.ip - vm.program->code - 1;
+    int line = getLine(vm.program, (int)instruction);
+    // The top level is frame 0, every frame above it is a call.
+    ObjFunction *function = vm.frameCount > 1 ? functionOf(vm.stack[vm.frames[vm.frameCount - 1].base]) : NULL;
 
+    if (function != NULL && function->name != NULL)
+        fprintf(stderr, "on line %d in %s()\n", line, function->name->chars);
+    else
+        fprintf(stderr, "on line %d\n", line);
+
+    // Closures that outlive the program, in a global, keep what their variables held.
+    closeUpvalues(0);
     resetStack();
 }
 
-void initCVM()
+void initCVM(Allocator *allocator)
 {
+    vm.allocator = allocator;
+    Allocator *previous = useAllocator(vm.allocator);
+    vm.stack = NULL;
+    vm.stackAllocated = 0;
+    vm.frames = NULL;
+    vm.framesAllocated = 0;
     resetStack();
+    vm.program = NULL;
+    vm.objects = NULL;
+    initGC();
+    initTable(&vm.strings);
+    initTable(&vm.globalNames);
+    vm.globals = NULL;
+    vm.globalCount = 0;
+    vm.globalsAllocated = 0;
+    vm.quickenedCount = 0;
+    vm.deoptimizedCount = 0;
+    defineNatives();
+    useAllocator(previous);
 }
 
 void freeCVM()
 {
-    vm.stackTop = vm.stack;
+    Allocator *previous = useAllocator(vm.allocator);
+    FREE_ARRAY_FOR(MEMORY_STACK, Value, vm.stack, vm.stackAllocated);
+    vm.stack = NULL;
+    vm.stackAllocated = 0;
+    FREE_ARRAY_FOR(MEMORY_STACK, CallFrame, vm.frames, vm.framesAllocated);
+    vm.frames = NULL;
+    vm.framesAllocated = 0;
+    resetStack();
+    freeTable(&vm.strings);
+    freeTable(&vm.globalNames);
+    FREE_ARRAY(Value, vm.globals, vm.globalsAllocated);
+    vm.globals = NULL;
+    vm.globalCount = 0;
+    vm.globalsAllocated = 0;
+    freeGC();
+    useAllocator(previous);
+}
+
+int globalSlot(ObjString *name)
+{
+    Value slot;
+
+    if (tableGet(&vm.globalNames, name, &slot))
+        return (int)AS_NUMBER(slot);
+
+    // Like objects, globals outlive the program whose compilation added them.
+    Allocator *previous = useAllocator(vm.allocator);
+
+    if (vm.globalsAllocated < vm.globalCount + 1)
+    {
+        int oldAllocated = vm.globalsAllocated;
+        vm.globalsAllocated = GROW_NUM_OF_ALLOCATED(oldAllocated);
+        vm.globals = GROW_ARRAY(vm.globals, Value, oldAllocated, vm.globalsAllocated);
+    }
+
+    vm.globals[vm.globalCount] = NONE_VAL;
+    tableSet(&vm.globalNames, name, NUMBER_VAL(vm.globalCount));
+
+    useAllocator(previous);
+
+    return vm.globalCount++;
+}
+
+bool reserveStack(int count)
+{
+    int depth = (int)(vm.stackTop - vm.stack);
+
+    if (depth + count <= vm.stackAllocated)
+        return true;
+
+    if (count > STACK_MAX - depth)
+        return false;
+
+    int oldAllocated = vm.stackAllocated;
+    int newAllocated = oldAllocated < STACK_INITIAL ? STACK_INITIAL : oldAllocated;
+    while (newAllocated < depth + count)
+        newAllocated *= 2;
+    if (newAllocated > STACK_MAX)
+        newAllocated = STACK_MAX;
+
+    Allocator *previous = useAllocator(vm.allocator);
+    Value *stack = GROW_ARRAY_FOR(MEMORY_STACK, vm.stack, Value, oldAllocated, newAllocated);
+    useAllocator(previous);
+
+    if (stack == NULL)
+        return false;
+
+    // The stack may have moved, so stackTop is rebuilt from its depth.
+    vm.stack = stack;
+    vm.stackAllocated = newAllocated;
+    vm.stackTop = vm.stack + depth;
+
+    return true;
+}
+
+// Makes room for one more frame whose slots run up to top, an index in vm.stack.
+// False past FRAMES_MAX or STACK_MAX.
+static bool reserveFrame(int top)
+{
+    if (vm.frameCount == vm.framesAllocated)
+    {
+        if (vm.framesAllocated == FRAMES_MAX)
+            return false;
+
+        int oldAllocated = vm.framesAllocated;
+        int newAllocated = oldAllocated < FRAMES_INITIAL ? FRAMES_INITIAL : oldAllocated * 2;
+        if (newAllocated > FRAMES_MAX)
+            newAllocated = FRAMES_MAX;
+
+        Allocator *previous = useAllocator(vm.allocator);
+        CallFrame *frames = GROW_ARRAY_FOR(MEMORY_STACK, vm.frames, CallFrame, oldAllocated, newAllocated);
+        useAllocator(previous);
+
+        if (frames == NULL)
+            return false;
+
+        vm.frames = frames;
+        vm.framesAllocated = newAllocated;
+    }
+
+    return reserveStack(top - (int)(vm.stackTop - vm.stack));
 }
 
 void push(Value value)
 {
+    if (vm.stackTop == vm.stack + vm.stackAllocated && !reserveStack(1))
+    {
+        fprintf(stderr, "Stack overflow, more than %d values.\n", STACK_MAX);
+        exit(70);
+    }
+
     *vm.stackTop = value;
     ++vm.stackTop;
 }
@@ -49,114 +235,1231 @@ Value pop()
     return *vm.stackTop;
 }
 
-static Value peek(int distance)
+static bool isFalsy(Value value)
 {
-    return vm.stackTop[-1 - distance];
+    return IS_NONE(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static bool isFalsy(Value value)
+// Reports why callee can't be called with argCount arguments.
+static void callError(Value callee, int argCount)
 {
-    return IS_NONE(value) || (IS_BOOL(value) && !AS_BOOL(value));
+    ObjFunction *function = functionOf(callee);
+
+    if (function != NULL)
+        runtimeError("Expected %d arguments but got %d", function->arity, argCount);
+    else if (IS_NATIVE(callee))
+        runtimeError("Expected %d arguments but got %d", AS_NATIVE(callee)->arity, argCount);
+    else
+        runtimeError("Can only call functions");
+}
+
+// Calls what OP_CALL found no function to call in, which runs right away, in no
+// frame of its own. The result takes the callee's slot. False after a runtime error.
+static bool callNative(Value callee, int argCount)
+{
+    if (!IS_NATIVE(callee) || AS_NATIVE(callee)->arity != argCount)
+    {
+        callError(callee, argCount);
+        return false;
+    }
+
+    Value *args = vm.stackTop - argCount;
+
+    if (!AS_NATIVE(callee)->function(args, &args[-1]))
+        return false;
+
+    vm.stackTop = args;
+    return true;
 }
 
+// Whether a for loop runs again, with its variable at i. <= and >= are !(i > limit)
+// and !(i < limit), as in the condition the loop is written with.
+#define FOR_COMPARE(comparison, i, limit)                \
+    ((comparison) == FOR_LESS         ? (i) < (limit)    \
+     : (comparison) == FOR_LESS_EQUAL ? !((i) > (limit)) \
+     : (comparison) == FOR_GREATER    ? (i) > (limit)    \
+                                      : !((i) < (limit)))
+// Two integers are compared as integers, anything else by compareNumbers(). A macro, as a
+// function this size is one the compiler stops inlining into run().
+#define FOR_CONTINUES(comparison, i, limit)                      \
+    (LIKELY(IS_INT(i) && IS_INT(limit))                          \
+         ? FOR_COMPARE(comparison, AS_INT(i), AS_INT(limit))     \
+         : FOR_COMPARE(comparison, compareNumbers(i, limit), 0))
+
 static InterpretResult run()
 {
-#define READ_BYTE() (*vm.ip++)
+    // Kept in locals so the hot loop doesn't reload them through the global vm.
+    // Anything that reads vm.ip or vm.stackTop (runtimeError) must SYNC_STATE() first.
+    uint8_t *ip = vm.ip;
+    Value *stackTop = vm.stackTop;
+    // Only compiling adds globals, so the array can't move while a program runs.
+    Value *globals = vm.globals;
+    // The current frame's slots. The stack only moves when a call makes room for its
+    // frame, which loads this again anyway.
+    Value *slots = vm.stack + vm.frames[vm.frameCount - 1].base;
+
+#define READ_BYTE() (*ip++)
 #define READ_CONST() (vm.program->consts.values[READ_BYTE()])
+#define READ_CONST_LONG() \
+    (ip += 3, vm.program->consts.values[ip[-3] | (ip[-2] << 8) | (ip[-1] << 16)])
+#define READ_SHORT() (ip += 2, (uint16_t)(ip[-2] | (ip[-1] << 8)))
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define SYNC_STATE() (vm.ip = ip, vm.stackTop = stackTop)
+    // Where the collector may run: everything live is on the stack, in a global or a constant.
+#define GC_SAFE_POINT()         \
+    do                          \
+    {                           \
+        if (vm.gc.pending)      \
+        {                       \
+            SYNC_STATE();       \
+            collectGarbage();   \
+        }                       \
+    } while (false)
+
+    // Two integers go through integerOperation, addIntegers() say or one of the
+    // *_INTEGERS comparisons below, two doubles through operator. An integer and a
+    // double go through mixed, MIXED_ARITHMETIC or MIXED_COMPARISON.
+#define BINARY_OPERATOR(integerOperation, valueType, operator, mixed)   \
+    do                                                                  \
+    {                                                                   \
+        Value b = PEEK(0);                                              \
+        Value a = PEEK(1);                                              \
+        if (LIKELY(IS_INT(a) && IS_INT(b)))                             \
+            stackTop[-2] = integerOperation(AS_INT(a), AS_INT(b));      \
+        else if (IS_FLOAT(a) && IS_FLOAT(b))                            \
+            stackTop[-2] = valueType(AS_FLOAT(a) operator AS_FLOAT(b)); \
+        else if (IS_NUMBER(a) && IS_NUMBER(b))                          \
+            stackTop[-2] = valueType(mixed(a, operator, b));            \
+        else                                                            \
+        {                                                               \
+            SYNC_STATE();                                               \
+            runtimeError("Unmatching type, operands must be numbers");  \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+        --stackTop;                                                     \
+    } while (false)
+
+    // Arithmetic on an integer and a double is done in doubles, comparisons are
+    // exact (see compareNumbers()).
+#define MIXED_ARITHMETIC(a, operator, b) (AS_NUMBER(a) operator AS_NUMBER(b))
+#define MIXED_COMPARISON(a, operator, b) (compareNumbers(a, b) operator 0)
+
+#define GREATER_INTEGERS(a, b) BOOL_VAL((a) > (b))
+#define LESS_INTEGERS(a, b) BOOL_VAL((a) < (b))
+#define NOT_GREATER_INTEGERS(a, b) BOOL_VAL(!((a) > (b)))
+#define NOT_LESS_INTEGERS(a, b) BOOL_VAL(!((a) < (b)))
+
+    // The rest of the arithmetic, which has errors of its own to raise.
+#define ARITHMETIC_OPERATOR(operationCode)                                        \
+    do                                                                            \
+    {                                                                             \
+        Value b = PEEK(0);                                                        \
+        Value a = PEEK(1);                                                        \
+        ArithmeticStatus status = arithmetic(operationCode, a, b, &stackTop[-2]); \
+        if (status != ARITHMETIC_OK)                                              \
+        {                                                                         \
+            SYNC_STATE();                                                         \
+            runtimeError("%s", arithmeticError(status));                          \
+            return INTERPRET_RUNTIME_ERROR;                                       \
+        }                                                                         \
+        --stackTop;                                                               \
+    } while (false)
+
+#define CHECK_DICT(value)                                \
+    do                                                   \
+    {                                                    \
+        if (!IS_DICT(value))                             \
+        {                                                \
+            SYNC_STATE();                                \
+            runtimeError("Can only index dictionaries"); \
+            return INTERPRET_RUNTIME_ERROR;              \
+        }                                                \
+    } while (false)
+
+#define CHECK_DICT_KEY(value, key)                                                \
+    do                                                                            \
+    {                                                                             \
+        if (!dictKey(value, &key))                                                \
+        {                                                                         \
+            SYNC_STATE();                                                         \
+            runtimeError("Dictionary keys must be numbers, strings or booleans"); \
+            return INTERPRET_RUNTIME_ERROR;                                       \
+        }                                                                         \
+    } while (false)
 
-#define BINARY_OPERATOR(valueType, operator)                           \
+    // >= and <= stay !(a < b) and !(a > b) so NaN compares the same as the unfused pairs.
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+    // The right operand comes from the constant pool instead of the stack.
+#define CONST_OPERATOR(integerOperation, valueType, operator, mixed)    \
+    do                                                                  \
+    {                                                                   \
+        Value b = READ_CONST();                                         \
+        Value a = PEEK(0);                                              \
+        if (LIKELY(IS_INT(a) && IS_INT(b)))                             \
+            stackTop[-1] = integerOperation(AS_INT(a), AS_INT(b));      \
+        else if (IS_FLOAT(a) && IS_FLOAT(b))                            \
+            stackTop[-1] = valueType(AS_FLOAT(a) operator AS_FLOAT(b)); \
+        else if (IS_NUMBER(a) && IS_NUMBER(b))                          \
+            stackTop[-1] = valueType(mixed(a, operator, b));            \
+        else                                                            \
+        {                                                               \
+            SYNC_STATE();                                               \
+            runtimeError("Unmatching type, operands must be numbers");  \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+    } while (false)
+
+    // Jumps by the offset that ends the instruction when a operator b comes out as
+    // test, so a NaN takes the same branch as with the comparison and jump unfused.
+    // A jump dispatches from a NEXT() of its own: choosing ip with a conditional move
+    // instead, as compilers like to for integers, makes every dispatch wait for it.
+#define COMPARE_JUMP(a, b, operator, test)                             \
     do                                                                 \
     {                                                                  \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)))                \
+        uint16_t offset = READ_SHORT();                                \
+        bool isJump;                                                   \
+        if (LIKELY(IS_INT(a) && IS_INT(b)))                            \
+            isJump = (AS_INT(a) operator AS_INT(b)) == (test);         \
+        else if (IS_FLOAT(a) && IS_FLOAT(b))                           \
+            isJump = (AS_FLOAT(a) operator AS_FLOAT(b)) == (test);     \
+        else if (IS_NUMBER(a) && IS_NUMBER(b))                         \
+            isJump = MIXED_COMPARISON(a, operator, b) == (test);       \
+        else                                                           \
         {                                                              \
+            SYNC_STATE();                                              \
             runtimeError("Unmatching type, operands must be numbers"); \
             return INTERPRET_RUNTIME_ERROR;                            \
         }                                                              \
-        double b = AS_NUMBER(pop());                                   \
-        double a = AS_NUMBER(pop());                                   \
-        push(valueType(a operator b));                                 \
+        if (isJump)                                                    \
+        {                                                              \
+            ip += offset;                                              \
+            NEXT();                                                    \
+        }                                                              \
     } while (false)
 
-    while (true)
-    {
+#ifdef REGISTER_VM
+#define READ_RK(operand) \
+    (IS_RK_CONST(operand) ? vm.program->consts.values[RK_INDEX(operand)] : slots[operand])
+
+    // Writes into register dst, which is always the lowest register the operands
+    // were allocated from, so the stack top lands right above it.
+#define REGISTER_OPERATOR(integerOperation, valueType, operator, mixed) \
+    do                                                                  \
+    {                                                                   \
+        uint8_t dst = READ_BYTE();                                      \
+        uint8_t operandA = READ_BYTE();                                 \
+        uint8_t operandB = READ_BYTE();                                 \
+        Value a = READ_RK(operandA);                                    \
+        Value b = READ_RK(operandB);                                    \
+        if (LIKELY(IS_INT(a) && IS_INT(b)))                             \
+            slots[dst] = integerOperation(AS_INT(a), AS_INT(b));        \
+        else if (IS_FLOAT(a) && IS_FLOAT(b))                            \
+            slots[dst] = valueType(AS_FLOAT(a) operator AS_FLOAT(b));   \
+        else if (IS_NUMBER(a) && IS_NUMBER(b))                          \
+            slots[dst] = valueType(mixed(a, operator, b));              \
+        else                                                            \
+        {                                                               \
+            SYNC_STATE();                                               \
+            runtimeError("Unmatching type, operands must be numbers");  \
+            return INTERPRET_RUNTIME_ERROR;                             \
+        }                                                               \
+        stackTop = slots + dst + 1;                                     \
+    } while (false)
+
+    // The comparison's register is where the condition would have been popped from.
+#define REGISTER_JUMP(operator)              \
+    do                                       \
+    {                                        \
+        uint8_t dst = READ_BYTE();           \
+        uint8_t operandA = READ_BYTE();      \
+        uint8_t operandB = READ_BYTE();      \
+        Value a = READ_RK(operandA);         \
+        Value b = READ_RK(operandB);         \
+        stackTop = slots + dst;              \
+        COMPARE_JUMP(a, b, operator, false); \
+    } while (false)
+#endif
+
+    // Quickening. A generic instruction looks at its operands before it runs and
+    // rewrites itself into the form for their type, whose handler then only checks
+    // that they still are. Just the opcode byte changes, so jumps and lines stay
+    // put; a loaded .rvc file's code is a private, writable mapping.
+#define PEEK_CONST() (vm.program->consts.values[*ip])
+#ifdef QUICKENING
+#define QUICKEN(a, b, integerCode, floatCode) \
+    do                                        \
+    {                                         \
+        if (IS_INT(a) && IS_INT(b))           \
+        {                                     \
+            ip[-1] = (integerCode);           \
+            ++vm.quickenedCount;              \
+        }                                     \
+        else if (IS_FLOAT(a) && IS_FLOAT(b))  \
+        {                                     \
+            ip[-1] = (floatCode);             \
+            ++vm.quickenedCount;              \
+        }                                     \
+    } while (false)
+#else
+#define QUICKEN(a, b, integerCode, floatCode) \
+    do                                        \
+    {                                         \
+    } while (false)
+#endif
+
+    // Over to mixedCode for good, which the NEXT() after it runs from the start of
+    // the instruction. Nothing of it has been read but the opcode. A site that went
+    // back to the generic form could quicken again on its next run, and a site that
+    // sees integers and doubles in turn would be rewritten twice every time.
+#define DEOPTIMIZE(mixedCode) (ip[-1] = (mixedCode), --ip, ++vm.deoptimizedCount)
+
+#define QUICK_OPERATOR(isType, asType, operation, mixedCode) \
+    do                                                       \
+    {                                                        \
+        Value b = PEEK(0);                                   \
+        Value a = PEEK(1);                                   \
+        if (LIKELY(isType(a) && isType(b)))                  \
+        {                                                    \
+            stackTop[-2] = operation(asType(a), asType(b));  \
+            --stackTop;                                      \
+        }                                                    \
+        else                                                 \
+            DEOPTIMIZE(mixedCode);                           \
+    } while (false)
+
+    // The constant's type was checked when the instruction was quickened.
+#define QUICK_CONST_OPERATOR(isType, asType, operation, mixedCode)     \
+    do                                                                 \
+    {                                                                  \
+        Value a = PEEK(0);                                             \
+        if (LIKELY(isType(a)))                                         \
+            stackTop[-1] = operation(asType(a), asType(READ_CONST())); \
+        else                                                           \
+            DEOPTIMIZE(mixedCode);                                     \
+    } while (false)
+
+#define QUICK_COMPARE_JUMP(isType, asType, operator, mixedCode) \
+    do                                                          \
+    {                                                           \
+        Value a = PEEK(0);                                      \
+        if (LIKELY(isType(a)))                                  \
+        {                                                       \
+            Value b = READ_CONST();                             \
+            uint16_t offset = READ_SHORT();                     \
+            --stackTop;                                         \
+            if (!(asType(a) operator asType(b)))                \
+            {                                                   \
+                ip += offset;                                   \
+                NEXT();                                         \
+            }                                                   \
+        }                                                       \
+        else                                                    \
+            DEOPTIMIZE(mixedCode);                              \
+    } while (false)
+
+#ifdef REGISTER_VM
+#define QUICK_REGISTER_OPERATOR(isType, asType, operation, mixedCode) \
+    do                                                                \
+    {                                                                 \
+        Value a = READ_RK(ip[1]);                                     \
+        Value b = READ_RK(ip[2]);                                     \
+        if (LIKELY(isType(a) && isType(b)))                           \
+        {                                                             \
+            uint8_t dst = READ_BYTE();                                \
+            ip += 2;                                                  \
+            slots[dst] = operation(asType(a), asType(b));             \
+            stackTop = slots + dst + 1;                               \
+        }                                                             \
+        else                                                          \
+            DEOPTIMIZE(mixedCode);                                    \
+    } while (false)
+#endif
+
 #ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; ++slot)
-        {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
+#define TRACE_EXECUTION()                                                 \
+    do                                                                    \
+    {                                                                     \
+        printf("          ");                                             \
+        for (Value *traced = vm.stack; traced < stackTop; ++traced)       \
+        {                                                                 \
+            printf("[ ");                                                 \
+            printValue(*traced);                                          \
+            printf(" ]");                                                 \
+        }                                                                 \
+        printf("\n");                                                     \
+        disassembleInstruction(vm.program, (int)(ip - vm.program->code)); \
+    } while (false)
+#else
+#define TRACE_EXECUTION() ((void)0)
+#endif
+
+#ifdef COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() (++vm.instructionCount)
+#else
+#define COUNT_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef COMPUTED_GOTO
+    // One indirect jump per handler instead of one shared jump at the top of the switch.
+    static void *dispatchTable[] = {
+        [OP_CONST] = &&CASE_OP_CONST,
+        [OP_CONST_LONG] = &&CASE_OP_CONST_LONG,
+        [OP_NONE] = &&CASE_OP_NONE,
+        [OP_TRUE] = &&CASE_OP_TRUE,
+        [OP_FALSE] = &&CASE_OP_FALSE,
+        [OP_EQUAL] = &&CASE_OP_EQUAL,
+        [OP_GREATER] = &&CASE_OP_GREATER,
+        [OP_LESS] = &&CASE_OP_LESS,
+        [OP_ADD] = &&CASE_OP_ADD,
+        [OP_SUBTRACT] = &&CASE_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&CASE_OP_MULTIPLY,
+        [OP_DIVIDE] = &&CASE_OP_DIVIDE,
+        [OP_FLOOR_DIVIDE] = &&CASE_OP_FLOOR_DIVIDE,
+        [OP_MODULO] = &&CASE_OP_MODULO,
+        [OP_POWER] = &&CASE_OP_POWER,
+        [OP_BIT_AND] = &&CASE_OP_BIT_AND,
+        [OP_BIT_OR] = &&CASE_OP_BIT_OR,
+        [OP_BIT_XOR] = &&CASE_OP_BIT_XOR,
+        [OP_SHIFT_LEFT] = &&CASE_OP_SHIFT_LEFT,
+        [OP_SHIFT_RIGHT] = &&CASE_OP_SHIFT_RIGHT,
+        [OP_CONCAT] = &&CASE_OP_CONCAT,
+        [OP_NOT] = &&CASE_OP_NOT,
+        [OP_NEGATE] = &&CASE_OP_NEGATE,
+        [OP_BIT_NOT] = &&CASE_OP_BIT_NOT,
+        [OP_POP] = &&CASE_OP_POP,
+        [OP_GET_GLOBAL] = &&CASE_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&CASE_OP_SET_GLOBAL,
+        [OP_GET_LOCAL] = &&CASE_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&CASE_OP_SET_LOCAL,
+        [OP_JUMP] = &&CASE_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&CASE_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&CASE_OP_LOOP,
+        [OP_PRINT] = &&CASE_OP_PRINT,
+        [OP_PRINTLN] = &&CASE_OP_PRINTLN,
+        [OP_CALL] = &&CASE_OP_CALL,
+        [OP_TAIL_CALL] = &&CASE_OP_TAIL_CALL,
+        [OP_RETURN] = &&CASE_OP_RETURN,
+        [OP_CLOSURE] = &&CASE_OP_CLOSURE,
+        [OP_GET_UPVALUE] = &&CASE_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&CASE_OP_SET_UPVALUE,
+        [OP_CLOSE_UPVALUE] = &&CASE_OP_CLOSE_UPVALUE,
+        [OP_DICT] = &&CASE_OP_DICT,
+        [OP_DICT_SET] = &&CASE_OP_DICT_SET,
+        [OP_GET_INDEX] = &&CASE_OP_GET_INDEX,
+        [OP_SET_INDEX] = &&CASE_OP_SET_INDEX,
+        [OP_NOT_EQUAL] = &&CASE_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&CASE_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&CASE_OP_LESS_EQUAL,
+        [OP_EQUAL_CONST] = &&CASE_OP_EQUAL_CONST,
+        [OP_GREATER_CONST] = &&CASE_OP_GREATER_CONST,
+        [OP_LESS_CONST] = &&CASE_OP_LESS_CONST,
+        [OP_ADD_CONST] = &&CASE_OP_ADD_CONST,
+        [OP_SUBTRACT_CONST] = &&CASE_OP_SUBTRACT_CONST,
+        [OP_MULTIPLY_CONST] = &&CASE_OP_MULTIPLY_CONST,
+        [OP_DIVIDE_CONST] = &&CASE_OP_DIVIDE_CONST,
+        [OP_FORPREP] = &&CASE_OP_FORPREP,
+        [OP_FORLOOP] = &&CASE_OP_FORLOOP,
+        [OP_JUMP_IF_NOT_EQUAL] = &&CASE_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_EQUAL] = &&CASE_OP_JUMP_IF_EQUAL,
+        [OP_JUMP_IF_NOT_GREATER] = &&CASE_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_LESS] = &&CASE_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_GREATER] = &&CASE_OP_JUMP_IF_GREATER,
+        [OP_JUMP_IF_LESS] = &&CASE_OP_JUMP_IF_LESS,
+        [OP_JUMP_IF_TRUE] = &&CASE_OP_JUMP_IF_TRUE,
+        [OP_JUMP_IF_NOT_EQUAL_CONST] = &&CASE_OP_JUMP_IF_NOT_EQUAL_CONST,
+        [OP_JUMP_IF_NOT_GREATER_CONST] = &&CASE_OP_JUMP_IF_NOT_GREATER_CONST,
+        [OP_JUMP_IF_NOT_LESS_CONST] = &&CASE_OP_JUMP_IF_NOT_LESS_CONST,
+        [OP_ADD_INT] = &&CASE_OP_ADD_INT,
+        [OP_ADD_FLOAT] = &&CASE_OP_ADD_FLOAT,
+        [OP_SUBTRACT_INT] = &&CASE_OP_SUBTRACT_INT,
+        [OP_SUBTRACT_FLOAT] = &&CASE_OP_SUBTRACT_FLOAT,
+        [OP_MULTIPLY_INT] = &&CASE_OP_MULTIPLY_INT,
+        [OP_MULTIPLY_FLOAT] = &&CASE_OP_MULTIPLY_FLOAT,
+        [OP_ADD_INT_CONST] = &&CASE_OP_ADD_INT_CONST,
+        [OP_ADD_FLOAT_CONST] = &&CASE_OP_ADD_FLOAT_CONST,
+        [OP_SUBTRACT_INT_CONST] = &&CASE_OP_SUBTRACT_INT_CONST,
+        [OP_SUBTRACT_FLOAT_CONST] = &&CASE_OP_SUBTRACT_FLOAT_CONST,
+        [OP_MULTIPLY_INT_CONST] = &&CASE_OP_MULTIPLY_INT_CONST,
+        [OP_MULTIPLY_FLOAT_CONST] = &&CASE_OP_MULTIPLY_FLOAT_CONST,
+        [OP_JUMP_IF_NOT_GREATER_INT_CONST] = &&CASE_OP_JUMP_IF_NOT_GREATER_INT_CONST,
+        [OP_JUMP_IF_NOT_GREATER_FLOAT_CONST] = &&CASE_OP_JUMP_IF_NOT_GREATER_FLOAT_CONST,
+        [OP_JUMP_IF_NOT_LESS_INT_CONST] = &&CASE_OP_JUMP_IF_NOT_LESS_INT_CONST,
+        [OP_JUMP_IF_NOT_LESS_FLOAT_CONST] = &&CASE_OP_JUMP_IF_NOT_LESS_FLOAT_CONST,
+        [OP_ADD_MIXED] = &&CASE_OP_ADD_MIXED,
+        [OP_SUBTRACT_MIXED] = &&CASE_OP_SUBTRACT_MIXED,
+        [OP_MULTIPLY_MIXED] = &&CASE_OP_MULTIPLY_MIXED,
+        [OP_ADD_MIXED_CONST] = &&CASE_OP_ADD_MIXED_CONST,
+        [OP_SUBTRACT_MIXED_CONST] = &&CASE_OP_SUBTRACT_MIXED_CONST,
+        [OP_MULTIPLY_MIXED_CONST] = &&CASE_OP_MULTIPLY_MIXED_CONST,
+        [OP_JUMP_IF_NOT_GREATER_MIXED_CONST] = &&CASE_OP_JUMP_IF_NOT_GREATER_MIXED_CONST,
+        [OP_JUMP_IF_NOT_LESS_MIXED_CONST] = &&CASE_OP_JUMP_IF_NOT_LESS_MIXED_CONST,
+#ifdef REGISTER_VM
+        [OP_EQUAL_R] = &&CASE_OP_EQUAL_R,
+        [OP_GREATER_R] = &&CASE_OP_GREATER_R,
+        [OP_LESS_R] = &&CASE_OP_LESS_R,
+        [OP_ADD_R] = &&CASE_OP_ADD_R,
+        [OP_SUBTRACT_R] = &&CASE_OP_SUBTRACT_R,
+        [OP_MULTIPLY_R] = &&CASE_OP_MULTIPLY_R,
+        [OP_DIVIDE_R] = &&CASE_OP_DIVIDE_R,
+        [OP_JUMP_IF_NOT_EQUAL_R] = &&CASE_OP_JUMP_IF_NOT_EQUAL_R,
+        [OP_JUMP_IF_NOT_GREATER_R] = &&CASE_OP_JUMP_IF_NOT_GREATER_R,
+        [OP_JUMP_IF_NOT_LESS_R] = &&CASE_OP_JUMP_IF_NOT_LESS_R,
+        [OP_ADD_INT_R] = &&CASE_OP_ADD_INT_R,
+        [OP_ADD_FLOAT_R] = &&CASE_OP_ADD_FLOAT_R,
+        [OP_SUBTRACT_INT_R] = &&CASE_OP_SUBTRACT_INT_R,
+        [OP_SUBTRACT_FLOAT_R] = &&CASE_OP_SUBTRACT_FLOAT_R,
+        [OP_MULTIPLY_INT_R] = &&CASE_OP_MULTIPLY_INT_R,
+        [OP_MULTIPLY_FLOAT_R] = &&CASE_OP_MULTIPLY_FLOAT_R,
+        [OP_ADD_MIXED_R] = &&CASE_OP_ADD_MIXED_R,
+        [OP_SUBTRACT_MIXED_R] = &&CASE_OP_SUBTRACT_MIXED_R,
+        [OP_MULTIPLY_MIXED_R] = &&CASE_OP_MULTIPLY_MIXED_R,
+#endif
+    };
 
-        disassembleInstruction(vm.program, (int)(vm.ip - vm.program->code));
+#define CASE(operationCode) \
+    case operationCode:     \
+    CASE_##operationCode
+#define NEXT()                                \
+    do                                        \
+    {                                         \
+        TRACE_EXECUTION();                    \
+        COUNT_INSTRUCTION();                  \
+        goto *dispatchTable[READ_BYTE()];     \
+    } while (false)
+#else
+#define CASE(operationCode) case operationCode
+#define NEXT() break
 #endif
 
-        uint8_t instruction;
+    // The switch only decodes the first instruction when COMPUTED_GOTO is on,
+    // every handler after that jumps to its successor through dispatchTable.
+    while (true)
+    {
+        TRACE_EXECUTION();
+        COUNT_INSTRUCTION();
 
-        switch (instruction = READ_BYTE())
+        switch (READ_BYTE())
         {
-        case OP_CONST:
+        CASE(OP_CONST):
         {
             Value constant = READ_CONST();
-            push(constant);
-            break;
-        }
-        case OP_NONE:
-            push(NONE_VAL);
-            break;
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-        case OP_EQUAL:
-        {
-            Value b = pop();
-            Value a = pop();
-            push(BOOL_VAL(areValuesEqual(a, b)));
-            break;
-        }
-        case OP_GREATER:
-            BINARY_OPERATOR(BOOL_VAL, >);
-            break;
-        case OP_LESS:
-            BINARY_OPERATOR(BOOL_VAL, <);
-            break;
-        case OP_ADD:
-            BINARY_OPERATOR(NUMBER_VAL, +);
-            break;
-        case OP_SUBTRACT:
-            BINARY_OPERATOR(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
-            BINARY_OPERATOR(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
-            BINARY_OPERATOR(NUMBER_VAL, /);
-            break;
-        case OP_NOT:
-            push(BOOL_VAL(isFalsy(pop())));
-            break;
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0)))
+            PUSH(constant);
+            NEXT();
+        }
+        CASE(OP_CONST_LONG):
+        {
+            Value constant = READ_CONST_LONG();
+            PUSH(constant);
+            NEXT();
+        }
+        CASE(OP_NONE):
+            PUSH(NONE_VAL);
+            NEXT();
+        CASE(OP_TRUE):
+            PUSH(BOOL_VAL(true));
+            NEXT();
+        CASE(OP_FALSE):
+            PUSH(BOOL_VAL(false));
+            NEXT();
+        CASE(OP_EQUAL):
+        {
+            Value b = POP();
+            Value a = POP();
+            PUSH(BOOL_VAL(areValuesEqual(a, b)));
+            NEXT();
+        }
+        CASE(OP_GREATER):
+            BINARY_OPERATOR(GREATER_INTEGERS, BOOL_VAL, >, MIXED_COMPARISON);
+            NEXT();
+        CASE(OP_LESS):
+            BINARY_OPERATOR(LESS_INTEGERS, BOOL_VAL, <, MIXED_COMPARISON);
+            NEXT();
+        CASE(OP_ADD):
+            QUICKEN(PEEK(1), PEEK(0), OP_ADD_INT, OP_ADD_FLOAT);
+            FALLTHROUGH;
+        CASE(OP_ADD_MIXED):
+            BINARY_OPERATOR(addIntegers, NUMBER_VAL, +, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_SUBTRACT):
+            QUICKEN(PEEK(1), PEEK(0), OP_SUBTRACT_INT, OP_SUBTRACT_FLOAT);
+            FALLTHROUGH;
+        CASE(OP_SUBTRACT_MIXED):
+            BINARY_OPERATOR(subtractIntegers, NUMBER_VAL, -, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_MULTIPLY):
+            QUICKEN(PEEK(1), PEEK(0), OP_MULTIPLY_INT, OP_MULTIPLY_FLOAT);
+            FALLTHROUGH;
+        CASE(OP_MULTIPLY_MIXED):
+            BINARY_OPERATOR(multiplyIntegers, NUMBER_VAL, *, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_DIVIDE):
+            BINARY_OPERATOR(divideIntegers, NUMBER_VAL, /, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_FLOOR_DIVIDE):
+            ARITHMETIC_OPERATOR(OP_FLOOR_DIVIDE);
+            NEXT();
+        CASE(OP_MODULO):
+            ARITHMETIC_OPERATOR(OP_MODULO);
+            NEXT();
+        CASE(OP_POWER):
+            ARITHMETIC_OPERATOR(OP_POWER);
+            NEXT();
+        CASE(OP_BIT_AND):
+            ARITHMETIC_OPERATOR(OP_BIT_AND);
+            NEXT();
+        CASE(OP_BIT_OR):
+            ARITHMETIC_OPERATOR(OP_BIT_OR);
+            NEXT();
+        CASE(OP_BIT_XOR):
+            ARITHMETIC_OPERATOR(OP_BIT_XOR);
+            NEXT();
+        CASE(OP_SHIFT_LEFT):
+            ARITHMETIC_OPERATOR(OP_SHIFT_LEFT);
+            NEXT();
+        CASE(OP_SHIFT_RIGHT):
+            ARITHMETIC_OPERATOR(OP_SHIFT_RIGHT);
+            NEXT();
+        CASE(OP_CONCAT):
+            if (!canConcatenate(PEEK(0)) || !canConcatenate(PEEK(1)))
             {
+                SYNC_STATE();
+                runtimeError("Unmatching type, operands must be strings or numbers");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            // The operands stay on the stack until the result replaces them.
+            stackTop[-2] = concatenate(PEEK(1), PEEK(0));
+            --stackTop;
+            GC_SAFE_POINT();
+            NEXT();
+        CASE(OP_NOT):
+            stackTop[-1] = BOOL_VAL(isFalsy(stackTop[-1]));
+            NEXT();
+        CASE(OP_NEGATE):
+            if (!IS_NUMBER(PEEK(0)))
+            {
+                SYNC_STATE();
                 runtimeError("Unmatching type, operand must be a number");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_RETURN:
-            printValue(pop());
+            if (IS_INT(PEEK(0)))
+                stackTop[-1] = subtractIntegers(0, AS_INT(PEEK(0)));
+            else
+                stackTop[-1] = NUMBER_VAL(-AS_FLOAT(PEEK(0)));
+            NEXT();
+        CASE(OP_BIT_NOT):
+        {
+            ArithmeticStatus status = arithmeticUnary(OP_BIT_NOT, PEEK(0), &stackTop[-1]);
+            if (status != ARITHMETIC_OK)
+            {
+                SYNC_STATE();
+                runtimeError("%s", arithmeticError(status));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            NEXT();
+        }
+        CASE(OP_POP):
+            --stackTop;
+            NEXT();
+        CASE(OP_GET_GLOBAL):
+        {
+            uint16_t slot = READ_SHORT();
+            PUSH(globals[slot]);
+            NEXT();
+        }
+        CASE(OP_SET_GLOBAL):
+        {
+            uint16_t slot = READ_SHORT();
+            globals[slot] = POP();
+            NEXT();
+        }
+        CASE(OP_GET_LOCAL):
+        {
+            uint8_t slot = READ_BYTE();
+            PUSH(slots[slot]);
+            NEXT();
+        }
+        CASE(OP_SET_LOCAL):
+        {
+            uint8_t slot = READ_BYTE();
+            slots[slot] = POP();
+            NEXT();
+        }
+        CASE(OP_JUMP):
+        {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_FALSE):
+        {
+            uint16_t offset = READ_SHORT();
+            if (isFalsy(POP()))
+                ip += offset;
+            NEXT();
+        }
+        CASE(OP_LOOP):
+        {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            GC_SAFE_POINT();
+            NEXT();
+        }
+        CASE(OP_PRINT):
+            printValue(POP());
+            NEXT();
+        CASE(OP_PRINTLN):
+            printValue(POP());
             printf("\n");
-            return INTERPRET_OK;
+            NEXT();
+        CASE(OP_CALL):
+        {
+            int argCount = READ_BYTE();
+            Value callee = PEEK(argCount);
+            ObjFunction *function = functionOf(callee);
+            if (function == NULL || function->arity != argCount)
+            {
+                SYNC_STATE();
+                if (!callNative(callee, argCount))
+                    return INTERPRET_RUNTIME_ERROR;
+                stackTop = vm.stackTop;
+                GC_SAFE_POINT();
+                NEXT();
+            }
+            int base = (int)(stackTop - vm.stack) - argCount - 1;
+            // The one overflow check per call: the compiler worked out how deep the body goes.
+            if (vm.frameCount == vm.framesAllocated || base + function->maxStackDepth > vm.stackAllocated)
+            {
+                SYNC_STATE();
+                if (!reserveFrame(base + function->maxStackDepth))
+                {
+                    runtimeError("Stack overflow, calls nested too deep");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                stackTop = vm.stackTop;
+            }
+            vm.frames[vm.frameCount - 1].ip = ip;
+            vm.frames[vm.frameCount++].base = base;
+            slots = vm.stack + base;
+            ip = vm.program->code + function->entry;
+            NEXT();
+        }
+        CASE(OP_TAIL_CALL):
+        {
+            int argCount = READ_BYTE();
+            Value callee = PEEK(argCount);
+            ObjFunction *function = functionOf(callee);
+            if (function == NULL || function->arity != argCount)
+            {
+                // The OP_RETURN after every tail call returns what a native leaves.
+                SYNC_STATE();
+                if (!callNative(callee, argCount))
+                    return INTERPRET_RUNTIME_ERROR;
+                stackTop = vm.stackTop;
+                GC_SAFE_POINT();
+                NEXT();
+            }
+            // The calling frame was about to return, so the callee and its arguments
+            // move down over it and the callee runs in its place. Its variables end
+            // here, as they would have on return.
+            if (vm.openUpvalues != NULL)
+                closeUpvalues((int)(slots - vm.stack));
+            Value *callSlots = stackTop - argCount - 1;
+            for (int i = 0; i <= argCount; ++i)
+                slots[i] = callSlots[i];
+            stackTop = slots + argCount + 1;
+            int base = (int)(slots - vm.stack);
+            if (base + function->maxStackDepth > vm.stackAllocated)
+            {
+                SYNC_STATE();
+                if (!reserveStack(function->maxStackDepth - argCount - 1))
+                {
+                    runtimeError("Stack overflow, calls nested too deep");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                stackTop = vm.stackTop;
+                slots = vm.stack + base;
+            }
+            ip = vm.program->code + function->entry;
+            NEXT();
+        }
+        CASE(OP_RETURN):
+        {
+            Value result = POP();
+            if (vm.openUpvalues != NULL)
+                closeUpvalues((int)(slots - vm.stack));
+            // Drops the frame's locals along with anything else it left behind, the
+            // callee's slot included, which the result takes.
+            stackTop = slots;
+            if (--vm.frameCount == 0)
+            {
+                SYNC_STATE();
+                return INTERPRET_OK;
+            }
+            PUSH(result);
+            CallFrame *frame = &vm.frames[vm.frameCount - 1];
+            slots = vm.stack + frame->base;
+            ip = frame->ip;
+            NEXT();
+        }
+        CASE(OP_CLOSURE):
+        {
+            ObjFunction *function = AS_FUNCTION(READ_CONST_LONG());
+            ObjClosure *closure = newClosure(function);
+            for (int i = 0; i < function->captureCount; ++i)
+            {
+                Capture capture = function->captures[i];
+                Value value;
+                if (capture.kind == CAPTURE_VALUE)
+                    value = slots[capture.index];
+                else if (capture.kind == CAPTURE_REFERENCE)
+                    value = OBJ_VAL(captureUpvalue((int)(slots - vm.stack) + capture.index));
+                else
+                    value = AS_CLOSURE(slots[0])->captures[capture.index];
+                closure->captures[i] = value;
+                if (IS_OBJ(value))
+                    writeBarrier(&closure->obj, AS_OBJ(value));
+            }
+            PUSH(OBJ_VAL(closure));
+            GC_SAFE_POINT();
+            NEXT();
+        }
+        CASE(OP_GET_UPVALUE):
+        {
+            Value value = AS_CLOSURE(slots[0])->captures[READ_BYTE()];
+            if (IS_UPVALUE(value))
+            {
+                ObjUpvalue *upvalue = AS_UPVALUE(value);
+                value = upvalue->slot >= 0 ? vm.stack[upvalue->slot] : upvalue->closed;
+            }
+            PUSH(value);
+            NEXT();
+        }
+        CASE(OP_SET_UPVALUE):
+        {
+            // Only assigned variables are set, and those are always captured by reference.
+            ObjUpvalue *upvalue = AS_UPVALUE(AS_CLOSURE(slots[0])->captures[READ_BYTE()]);
+            Value value = POP();
+            if (upvalue->slot >= 0)
+                vm.stack[upvalue->slot] = value;
+            else
+            {
+                upvalue->closed = value;
+                if (IS_OBJ(value))
+                    writeBarrier(&upvalue->obj, AS_OBJ(value));
+            }
+            NEXT();
+        }
+        CASE(OP_CLOSE_UPVALUE):
+            closeUpvalues((int)(stackTop - vm.stack) - 1);
+            --stackTop;
+            NEXT();
+        CASE(OP_DICT):
+        {
+            uint8_t arrayCount = READ_BYTE();
+            uint8_t hashCount = READ_BYTE();
+            PUSH(OBJ_VAL(newDict(arrayCount, hashCount)));
+            GC_SAFE_POINT();
+            NEXT();
+        }
+        CASE(OP_DICT_SET):
+        {
+            Value key;
+            CHECK_DICT_KEY(PEEK(1), key);
+            dictSet(AS_DICT(PEEK(2)), key, PEEK(0));
+            stackTop -= 2;
+            NEXT();
+        }
+        CASE(OP_GET_INDEX):
+        {
+            Value key;
+            CHECK_DICT(PEEK(1));
+            CHECK_DICT_KEY(PEEK(0), key);
+            Value value = dictGet(AS_DICT(PEEK(1)), key);
+            --stackTop;
+            stackTop[-1] = value;
+            NEXT();
+        }
+        CASE(OP_SET_INDEX):
+        {
+            Value key;
+            CHECK_DICT(PEEK(2));
+            CHECK_DICT_KEY(PEEK(1), key);
+            dictSet(AS_DICT(PEEK(2)), key, PEEK(0));
+            stackTop -= 3;
+            NEXT();
+        }
+        CASE(OP_NOT_EQUAL):
+        {
+            Value b = POP();
+            stackTop[-1] = BOOL_VAL(!areValuesEqual(stackTop[-1], b));
+            NEXT();
+        }
+        CASE(OP_GREATER_EQUAL):
+            BINARY_OPERATOR(NOT_LESS_INTEGERS, NOT_BOOL_VAL, <, MIXED_COMPARISON);
+            NEXT();
+        CASE(OP_LESS_EQUAL):
+            BINARY_OPERATOR(NOT_GREATER_INTEGERS, NOT_BOOL_VAL, >, MIXED_COMPARISON);
+            NEXT();
+        CASE(OP_EQUAL_CONST):
+        {
+            Value b = READ_CONST();
+            stackTop[-1] = BOOL_VAL(areValuesEqual(stackTop[-1], b));
+            NEXT();
+        }
+        CASE(OP_GREATER_CONST):
+            CONST_OPERATOR(GREATER_INTEGERS, BOOL_VAL, >, MIXED_COMPARISON);
+            NEXT();
+        CASE(OP_LESS_CONST):
+            CONST_OPERATOR(LESS_INTEGERS, BOOL_VAL, <, MIXED_COMPARISON);
+            NEXT();
+        CASE(OP_ADD_CONST):
+            QUICKEN(PEEK(0), PEEK_CONST(), OP_ADD_INT_CONST, OP_ADD_FLOAT_CONST);
+            FALLTHROUGH;
+        CASE(OP_ADD_MIXED_CONST):
+            CONST_OPERATOR(addIntegers, NUMBER_VAL, +, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_SUBTRACT_CONST):
+            QUICKEN(PEEK(0), PEEK_CONST(), OP_SUBTRACT_INT_CONST, OP_SUBTRACT_FLOAT_CONST);
+            FALLTHROUGH;
+        CASE(OP_SUBTRACT_MIXED_CONST):
+            CONST_OPERATOR(subtractIntegers, NUMBER_VAL, -, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_MULTIPLY_CONST):
+            QUICKEN(PEEK(0), PEEK_CONST(), OP_MULTIPLY_INT_CONST, OP_MULTIPLY_FLOAT_CONST);
+            FALLTHROUGH;
+        CASE(OP_MULTIPLY_MIXED_CONST):
+            CONST_OPERATOR(multiplyIntegers, NUMBER_VAL, *, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_DIVIDE_CONST):
+            CONST_OPERATOR(divideIntegers, NUMBER_VAL, /, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_FORPREP):
+        {
+            Value *loop = slots + READ_BYTE();
+            uint8_t comparison = READ_BYTE();
+            uint16_t offset = READ_SHORT();
+            if (!IS_NUMBER(loop[0]) || !IS_NUMBER(loop[1]) || !IS_NUMBER(loop[2]))
+            {
+                SYNC_STATE();
+                runtimeError("The start, limit and step of a for loop must be numbers");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            // The variable would never reach the limit, as in Lua.
+            if (AS_NUMBER(loop[2]) == 0)
+            {
+                SYNC_STATE();
+                runtimeError("The step of a for loop is zero");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (!FOR_CONTINUES(comparison, loop[0], loop[1]))
+                ip += offset;
+            NEXT();
+        }
+        CASE(OP_FORLOOP):
+        {
+            Value *loop = slots + READ_BYTE();
+            uint8_t comparison = READ_BYTE();
+            uint16_t offset = READ_SHORT();
+            if (LIKELY(IS_INT(loop[0]) && IS_INT(loop[2])))
+                loop[0] = addIntegers(AS_INT(loop[0]), AS_INT(loop[2]));
+            else if (IS_NUMBER(loop[0]))
+                loop[0] = NUMBER_VAL(AS_NUMBER(loop[0]) + AS_NUMBER(loop[2]));
+            else
+            {
+                // The body may have assigned the variable; the limit and step are out of its reach.
+                SYNC_STATE();
+                runtimeError("The variable of a for loop must stay a number");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (FOR_CONTINUES(comparison, loop[0], loop[1]))
+            {
+                ip -= offset;
+                GC_SAFE_POINT();
+                NEXT();
+            }
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_NOT_EQUAL):
+        {
+            Value b = POP();
+            Value a = POP();
+            uint16_t offset = READ_SHORT();
+            if (!areValuesEqual(a, b))
+                ip += offset;
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_EQUAL):
+        {
+            Value b = POP();
+            Value a = POP();
+            uint16_t offset = READ_SHORT();
+            if (areValuesEqual(a, b))
+                ip += offset;
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_NOT_GREATER):
+        {
+            Value b = POP();
+            Value a = POP();
+            COMPARE_JUMP(a, b, >, false);
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_NOT_LESS):
+        {
+            Value b = POP();
+            Value a = POP();
+            COMPARE_JUMP(a, b, <, false);
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_GREATER):
+        {
+            Value b = POP();
+            Value a = POP();
+            COMPARE_JUMP(a, b, >, true);
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_LESS):
+        {
+            Value b = POP();
+            Value a = POP();
+            COMPARE_JUMP(a, b, <, true);
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_TRUE):
+        {
+            uint16_t offset = READ_SHORT();
+            if (!isFalsy(POP()))
+                ip += offset;
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_NOT_EQUAL_CONST):
+        {
+            Value b = READ_CONST();
+            uint16_t offset = READ_SHORT();
+            if (!areValuesEqual(POP(), b))
+                ip += offset;
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_NOT_GREATER_CONST):
+            QUICKEN(PEEK(0), PEEK_CONST(), OP_JUMP_IF_NOT_GREATER_INT_CONST, OP_JUMP_IF_NOT_GREATER_FLOAT_CONST);
+            FALLTHROUGH;
+        CASE(OP_JUMP_IF_NOT_GREATER_MIXED_CONST):
+        {
+            Value b = READ_CONST();
+            Value a = POP();
+            COMPARE_JUMP(a, b, >, false);
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_NOT_LESS_CONST):
+            QUICKEN(PEEK(0), PEEK_CONST(), OP_JUMP_IF_NOT_LESS_INT_CONST, OP_JUMP_IF_NOT_LESS_FLOAT_CONST);
+            FALLTHROUGH;
+        CASE(OP_JUMP_IF_NOT_LESS_MIXED_CONST):
+        {
+            Value b = READ_CONST();
+            Value a = POP();
+            COMPARE_JUMP(a, b, <, false);
+            NEXT();
+        }
+        CASE(OP_ADD_INT):
+            QUICK_OPERATOR(IS_INT, AS_INT, addIntegers, OP_ADD_MIXED);
+            NEXT();
+        CASE(OP_ADD_FLOAT):
+            QUICK_OPERATOR(IS_FLOAT, AS_FLOAT, addFloats, OP_ADD_MIXED);
+            NEXT();
+        CASE(OP_SUBTRACT_INT):
+            QUICK_OPERATOR(IS_INT, AS_INT, subtractIntegers, OP_SUBTRACT_MIXED);
+            NEXT();
+        CASE(OP_SUBTRACT_FLOAT):
+            QUICK_OPERATOR(IS_FLOAT, AS_FLOAT, subtractFloats, OP_SUBTRACT_MIXED);
+            NEXT();
+        CASE(OP_MULTIPLY_INT):
+            QUICK_OPERATOR(IS_INT, AS_INT, multiplyIntegers, OP_MULTIPLY_MIXED);
+            NEXT();
+        CASE(OP_MULTIPLY_FLOAT):
+            QUICK_OPERATOR(IS_FLOAT, AS_FLOAT, multiplyFloats, OP_MULTIPLY_MIXED);
+            NEXT();
+        CASE(OP_ADD_INT_CONST):
+            QUICK_CONST_OPERATOR(IS_INT, AS_INT, addIntegers, OP_ADD_MIXED_CONST);
+            NEXT();
+        CASE(OP_ADD_FLOAT_CONST):
+            QUICK_CONST_OPERATOR(IS_FLOAT, AS_FLOAT, addFloats, OP_ADD_MIXED_CONST);
+            NEXT();
+        CASE(OP_SUBTRACT_INT_CONST):
+            QUICK_CONST_OPERATOR(IS_INT, AS_INT, subtractIntegers, OP_SUBTRACT_MIXED_CONST);
+            NEXT();
+        CASE(OP_SUBTRACT_FLOAT_CONST):
+            QUICK_CONST_OPERATOR(IS_FLOAT, AS_FLOAT, subtractFloats, OP_SUBTRACT_MIXED_CONST);
+            NEXT();
+        CASE(OP_MULTIPLY_INT_CONST):
+            QUICK_CONST_OPERATOR(IS_INT, AS_INT, multiplyIntegers, OP_MULTIPLY_MIXED_CONST);
+            NEXT();
+        CASE(OP_MULTIPLY_FLOAT_CONST):
+            QUICK_CONST_OPERATOR(IS_FLOAT, AS_FLOAT, multiplyFloats, OP_MULTIPLY_MIXED_CONST);
+            NEXT();
+        CASE(OP_JUMP_IF_NOT_GREATER_INT_CONST):
+            QUICK_COMPARE_JUMP(IS_INT, AS_INT, >, OP_JUMP_IF_NOT_GREATER_MIXED_CONST);
+            NEXT();
+        CASE(OP_JUMP_IF_NOT_GREATER_FLOAT_CONST):
+            QUICK_COMPARE_JUMP(IS_FLOAT, AS_FLOAT, >, OP_JUMP_IF_NOT_GREATER_MIXED_CONST);
+            NEXT();
+        CASE(OP_JUMP_IF_NOT_LESS_INT_CONST):
+            QUICK_COMPARE_JUMP(IS_INT, AS_INT, <, OP_JUMP_IF_NOT_LESS_MIXED_CONST);
+            NEXT();
+        CASE(OP_JUMP_IF_NOT_LESS_FLOAT_CONST):
+            QUICK_COMPARE_JUMP(IS_FLOAT, AS_FLOAT, <, OP_JUMP_IF_NOT_LESS_MIXED_CONST);
+            NEXT();
+#ifdef REGISTER_VM
+        CASE(OP_EQUAL_R):
+        {
+            uint8_t dst = READ_BYTE();
+            uint8_t operandA = READ_BYTE();
+            uint8_t operandB = READ_BYTE();
+            bool equal = areValuesEqual(READ_RK(operandA), READ_RK(operandB));
+            stackTop = slots + dst;
+            PUSH(BOOL_VAL(equal));
+            NEXT();
+        }
+        CASE(OP_GREATER_R):
+            REGISTER_OPERATOR(GREATER_INTEGERS, BOOL_VAL, >, MIXED_COMPARISON);
+            NEXT();
+        CASE(OP_LESS_R):
+            REGISTER_OPERATOR(LESS_INTEGERS, BOOL_VAL, <, MIXED_COMPARISON);
+            NEXT();
+        CASE(OP_ADD_R):
+            QUICKEN(READ_RK(ip[1]), READ_RK(ip[2]), OP_ADD_INT_R, OP_ADD_FLOAT_R);
+            FALLTHROUGH;
+        CASE(OP_ADD_MIXED_R):
+            REGISTER_OPERATOR(addIntegers, NUMBER_VAL, +, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_SUBTRACT_R):
+            QUICKEN(READ_RK(ip[1]), READ_RK(ip[2]), OP_SUBTRACT_INT_R, OP_SUBTRACT_FLOAT_R);
+            FALLTHROUGH;
+        CASE(OP_SUBTRACT_MIXED_R):
+            REGISTER_OPERATOR(subtractIntegers, NUMBER_VAL, -, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_MULTIPLY_R):
+            QUICKEN(READ_RK(ip[1]), READ_RK(ip[2]), OP_MULTIPLY_INT_R, OP_MULTIPLY_FLOAT_R);
+            FALLTHROUGH;
+        CASE(OP_MULTIPLY_MIXED_R):
+            REGISTER_OPERATOR(multiplyIntegers, NUMBER_VAL, *, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_DIVIDE_R):
+            REGISTER_OPERATOR(divideIntegers, NUMBER_VAL, /, MIXED_ARITHMETIC);
+            NEXT();
+        CASE(OP_JUMP_IF_NOT_EQUAL_R):
+        {
+            uint8_t dst = READ_BYTE();
+            uint8_t operandA = READ_BYTE();
+            uint8_t operandB = READ_BYTE();
+            uint16_t offset = READ_SHORT();
+            bool equal = areValuesEqual(READ_RK(operandA), READ_RK(operandB));
+            stackTop = slots + dst;
+            if (!equal)
+                ip += offset;
+            NEXT();
+        }
+        CASE(OP_JUMP_IF_NOT_GREATER_R):
+            REGISTER_JUMP(>);
+            NEXT();
+        CASE(OP_JUMP_IF_NOT_LESS_R):
+            REGISTER_JUMP(<);
+            NEXT();
+        CASE(OP_ADD_INT_R):
+            QUICK_REGISTER_OPERATOR(IS_INT, AS_INT, addIntegers, OP_ADD_MIXED_R);
+            NEXT();
+        CASE(OP_ADD_FLOAT_R):
+            QUICK_REGISTER_OPERATOR(IS_FLOAT, AS_FLOAT, addFloats, OP_ADD_MIXED_R);
+            NEXT();
+        CASE(OP_SUBTRACT_INT_R):
+            QUICK_REGISTER_OPERATOR(IS_INT, AS_INT, subtractIntegers, OP_SUBTRACT_MIXED_R);
+            NEXT();
+        CASE(OP_SUBTRACT_FLOAT_R):
+            QUICK_REGISTER_OPERATOR(IS_FLOAT, AS_FLOAT, subtractFloats, OP_SUBTRACT_MIXED_R);
+            NEXT();
+        CASE(OP_MULTIPLY_INT_R):
+            QUICK_REGISTER_OPERATOR(IS_INT, AS_INT, multiplyIntegers, OP_MULTIPLY_MIXED_R);
+            NEXT();
+        CASE(OP_MULTIPLY_FLOAT_R):
+            QUICK_REGISTER_OPERATOR(IS_FLOAT, AS_FLOAT, multiplyFloats, OP_MULTIPLY_MIXED_R);
+            NEXT();
+#endif
         }
     }
 
 #undef READ_BYTE
 #undef READ_CONST
+#undef READ_CONST_LONG
+#undef READ_SHORT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef SYNC_STATE
+#undef GC_SAFE_POINT
 #undef BINARY_OPERATOR
+#undef GREATER_INTEGERS
+#undef LESS_INTEGERS
+#undef NOT_GREATER_INTEGERS
+#undef NOT_LESS_INTEGERS
+#undef ARITHMETIC_OPERATOR
+#undef CONST_OPERATOR
+#undef COMPARE_JUMP
+#undef CHECK_DICT
+#undef CHECK_DICT_KEY
+#undef NOT_BOOL_VAL
+#undef MIXED_ARITHMETIC
+#undef MIXED_COMPARISON
+#undef PEEK_CONST
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef QUICK_OPERATOR
+#undef QUICK_CONST_OPERATOR
+#undef QUICK_COMPARE_JUMP
+#ifdef REGISTER_VM
+#undef READ_RK
+#undef REGISTER_OPERATOR
+#undef REGISTER_JUMP
+#undef QUICK_REGISTER_OPERATOR
+#endif
+#undef TRACE_EXECUTION
+#undef COUNT_INSTRUCTION
+#undef CASE
+#undef NEXT
+}
+
+InterpretResult interpretProgram(Program *program)
+{
+    return interpretProgramFrom(program, 0);
+}
+
+InterpretResult interpretProgramFrom(Program *program, int offset)
+{
+    vm.program = program;
+    vm.ip = vm.program->code + offset;
+    resetStack();
+
+    // The one overflow check for the top level: the compiler worked out how deep it
+    // goes, so pushes while it runs never need to check. Calls check for their own.
+    if (!reserveFrame(program->maxStackDepth))
+    {
+        fprintf(stderr, "Stack overflow, the program needs %d values but at most %d fit.\n", program->maxStackDepth,
+                STACK_MAX);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    vm.frames[0].base = 0;
+    vm.frameCount = 1;
+
+    Allocator *previous = useAllocator(vm.allocator);
+    InterpretResult result = run();
+    useAllocator(previous);
+
+    // Its constants stop being roots.
+    vm.program = NULL;
+
+    return result;
 }
 
 InterpretResult interpret(const char *src)
@@ -164,17 +1467,27 @@ InterpretResult interpret(const char *src)
     Program program;
     initProgram(&program);
 
-    if (!compile(src, &program))
+    if (!compile(src, strlen(src), &program))
     {
         freeProgram(&program);
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm.program = &program;
-    vm.ip = vm.program->code;
-
-    InterpretResult result = run();
+    InterpretResult result = interpretProgram(&program);
 
     freeProgram(&program);
     return result;
 }
+
+void printQuickeningStats(FILE *file, bool json)
+{
+    if (json)
+    {
+        fprintf(file, "\"quickening\": {\"quickened\": %llu, \"deoptimized\": %llu}",
+                (unsigned long long)vm.quickenedCount, (unsigned long long)vm.deoptimizedCount);
+        return;
+    }
+
+    fprintf(file, "quickening %llu quickened, %llu deoptimized\n", (unsigned long long)vm.quickenedCount,
+            (unsigned long long)vm.deoptimizedCount);
+}
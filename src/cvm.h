@@ -1,18 +1,53 @@
 #ifndef CVM_H
 #define CVM_H
 
+#include <stdio.h>
+#include "gc.h"
+#include "memory.h"
+#include "object.h"
 #include "program.h"
+#include "table.h"
 #include "value.h"
 
-#define STACK_MAX 256
+// The stack starts at STACK_INITIAL values and doubles up to STACK_MAX.
+#define STACK_INITIAL 256
+#define STACK_MAX (1 << 22)
+// Likewise for the frames, which bounds how deep calls nest.
+#define FRAMES_INITIAL 64
+#define FRAMES_MAX (1 << 20)
+
+// A call in progress. The frames are one array that grows by doubling, so a call
+// only ever fills in the next one.
+typedef struct
+{
+    uint8_t *ip; // Where the frame goes on once the frame above it returns.
+    int base;    // Where its slots start in vm.stack. Slot 0 of a call holds the function or closure called.
+} CallFrame;
 
 typedef struct
 {
     Program *program;
     uint8_t *ip;
-    Value stack[STACK_MAX];
+    Value *stack;         // Grows, so pointers into it are only stable between calls.
     Value *stackTop;
-
+    int stackAllocated;
+    CallFrame *frames;
+    int frameCount;
+    int framesAllocated;
+    ObjUpvalue *openUpvalues; // Those still referring to a stack slot, highest slot first.
+    Allocator *allocator; // What the VM and its objects allocate from, the one given to initCVM().
+    Table strings;        // Every interned string, keys only.
+    Table globalNames;    // Global name to its slot in globals, only used by the compiler.
+    Value *globals;       // Indexed by OP_GET_GLOBAL and OP_SET_GLOBAL. none until assigned.
+    int globalCount;
+    int globalsAllocated;
+    Obj *objects;         // The old generation, newest first. Young objects are in gc's nursery.
+    GC gc;
+#ifdef COUNT_INSTRUCTIONS
+    uint64_t instructionCount;
+#endif
+    uint64_t quickenedCount;   // Instructions rewritten into a form for integers or doubles.
+    uint64_t deoptimizedCount; // Quickened ones rewritten back after operands of another type.
 } CVM;
 
 typedef enum
@@ -22,10 +57,28 @@ typedef enum
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-void initCVM();
+// allocator is what everything the VM allocates comes from, &mallocAllocator for
+// plain malloc. It has to outlive freeCVM().
+void initCVM(Allocator *allocator);
 void freeCVM();
 InterpretResult interpret(const char *src);
+InterpretResult interpretProgram(Program *program);
+// Runs program's code from offset on. For a REPL that appends every line to one
+// program, so functions defined by earlier lines stay valid.
+InterpretResult interpretProgramFrom(Program *program, int offset);
+// Returns the slot of the global with this name, adding one for a new name.
+int globalSlot(ObjString *name);
+// Reports an error at the instruction running and unwinds the stack, for a native
+// function or an opcode handler that then gives up.
+void runtimeError(const char *format, ...);
+// Makes room for count more values above stackTop, false past STACK_MAX.
+bool reserveStack(int count);
+// How often run() has quickened and deoptimized an instruction, for `rv --stats`. With
+// json, the "quickening" member of the object it prints.
+void printQuickeningStats(FILE *file, bool json);
 void push(Value value);
 Value pop();
 
+extern CVM vm;
+
 #endif
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include "debug.h"
+#include "object.h"
 #include "value.h"
 
 static int simpleInstruction(const char *name, int offset)
@@ -17,6 +18,118 @@ static int constantInstruction(const char *name, Program *program, int offset)
   return offset + 2;
 }
 
+static int readConstLong(Program *program, int offset)
+{
+  uint8_t *operand = &program->code[offset + 1];
+  return operand[0] | (operand[1] << 8) | (operand[2] << 16);
+}
+
+static int constantLongInstruction(const char *name, Program *program, int offset)
+{
+  int constant = readConstLong(program, offset);
+  printf("%-16s %4d '", name, constant);
+  printValue(program->consts.values[constant]);
+  printf("'\n");
+  return offset + 4;
+}
+
+static int closureInstruction(Program *program, int offset)
+{
+  static const char *kinds[] = {"value", "reference", "enclosing"};
+
+  ObjFunction *function = AS_FUNCTION(program->consts.values[readConstLong(program, offset)]);
+  offset = constantLongInstruction("OP_CLOSURE", program, offset);
+
+  for (int i = 0; i < function->captureCount; ++i)
+    printf("          %-16s %4d\n", kinds[function->captures[i].kind], function->captures[i].index);
+
+  return offset;
+}
+
+static int slotInstruction(const char *name, Program *program, int offset)
+{
+  uint8_t *operand = &program->code[offset + 1];
+  printf("%-16s %4d\n", name, operand[0] | (operand[1] << 8));
+  return offset + 3;
+}
+
+static int byteInstruction(const char *name, Program *program, int offset)
+{
+  printf("%-16s %4d\n", name, program->code[offset + 1]);
+  return offset + 2;
+}
+
+static int dictInstruction(Program *program, int offset)
+{
+  printf("%-16s %4d %4d\n", "OP_DICT", program->code[offset + 1], program->code[offset + 2]);
+  return offset + 3;
+}
+
+static int jumpInstruction(const char *name, int sign, Program *program, int offset)
+{
+  uint8_t *operand = &program->code[offset + 1];
+  int jump = operand[0] | (operand[1] << 8);
+  printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+  return offset + 3;
+}
+
+static int forInstruction(const char *name, int sign, Program *program, int offset)
+{
+  static const char *comparisons[] = {"<", "<=", ">", ">="};
+
+  uint8_t *operand = &program->code[offset + 1];
+  int jump = operand[2] | (operand[3] << 8);
+  printf("%-16s %4d %-2s %4d -> %d\n", name, operand[0], comparisons[operand[1]], offset, offset + 5 + sign * jump);
+  return offset + 5;
+}
+
+static int constantJumpInstruction(const char *name, Program *program, int offset)
+{
+  uint8_t constant = program->code[offset + 1];
+  int jump = program->code[offset + 2] | (program->code[offset + 3] << 8);
+  printf("%-16s %4d '", name, constant);
+  printValue(program->consts.values[constant]);
+  printf("' %4d -> %d\n", offset, offset + 4 + jump);
+  return offset + 4;
+}
+
+static void rkOperand(Program *program, uint8_t operand)
+{
+  if (IS_RK_CONST(operand))
+  {
+    printf("k%d '", RK_INDEX(operand));
+    printValue(program->consts.values[RK_INDEX(operand)]);
+    printf("'");
+  }
+  else
+  {
+    printf("r%d", operand);
+  }
+}
+
+static int registerInstruction(const char *name, Program *program, int offset)
+{
+  uint8_t dst = program->code[offset + 1];
+  printf("%-16s r%d, ", name, dst);
+  rkOperand(program, program->code[offset + 2]);
+  printf(", ");
+  rkOperand(program, program->code[offset + 3]);
+  printf("\n");
+  return offset + 4;
+}
+
+static int registerJumpInstruction(const char *name, Program *program, int offset)
+{
+  uint8_t *operand = &program->code[offset + 1];
+  int jump = operand[3] | (operand[4] << 8);
+  printf("%-16s r%d, ", name, operand[0]);
+  rkOperand(program, operand[1]);
+  printf(", ");
+  rkOperand(program, operand[2]);
+  printf(" %4d -> %d\n", offset, offset + 6 + jump);
+  return offset + 6;
+}
+
 void disassembleProgram(Program *program, const char *name)
 {
   printf("== %s ==\n", name);
@@ -31,13 +144,15 @@ int disassembleInstruction(Program *program, int offset)
 {
   printf("%04d ", offset);
 
-  if (offset > 0 && program->lines[offset] == program->lines[offset - 1])
+  int line = getLine(program, offset);
+
+  if (offset > 0 && line == getLine(program, offset - 1))
   {
     printf("   | ");
   }
   else
   {
-    printf("%4d ", program->lines[offset]);
+    printf("%4d ", line);
   }
 
   uint8_t instruction = program->code[offset];
@@ -46,6 +161,14 @@ int disassembleInstruction(Program *program, int offset)
   {
   case OP_CONST:
     return constantInstruction("OP_CONST", program, offset);
+  case OP_CONST_LONG:
+    return constantLongInstruction("OP_CONST_LONG", program, offset);
+  case OP_NONE:
+    return simpleInstruction("OP_NONE", offset);
+  case OP_TRUE:
+    return simpleInstruction("OP_TRUE", offset);
+  case OP_FALSE:
+    return simpleInstruction("OP_FALSE", offset);
   case OP_EQUAL:
     return simpleInstruction("OP_EQUAL", offset);
   case OP_GREATER:
@@ -60,12 +183,202 @@ int disassembleInstruction(Program *program, int offset)
     return simpleInstruction("OP_MULTIPLY", offset);
   case OP_DIVIDE:
     return simpleInstruction("OP_DIVIDE", offset);
+  case OP_FLOOR_DIVIDE:
+    return simpleInstruction("OP_FLOOR_DIVIDE", offset);
+  case OP_MODULO:
+    return simpleInstruction("OP_MODULO", offset);
+  case OP_POWER:
+    return simpleInstruction("OP_POWER", offset);
+  case OP_BIT_AND:
+    return simpleInstruction("OP_BIT_AND", offset);
+  case OP_BIT_OR:
+    return simpleInstruction("OP_BIT_OR", offset);
+  case OP_BIT_XOR:
+    return simpleInstruction("OP_BIT_XOR", offset);
+  case OP_SHIFT_LEFT:
+    return simpleInstruction("OP_SHIFT_LEFT", offset);
+  case OP_SHIFT_RIGHT:
+    return simpleInstruction("OP_SHIFT_RIGHT", offset);
+  case OP_CONCAT:
+    return simpleInstruction("OP_CONCAT", offset);
   case OP_NOT:
     return simpleInstruction("OP_NOT", offset);
   case OP_NEGATE:
     return simpleInstruction("OP_NEGATE", offset);
+  case OP_BIT_NOT:
+    return simpleInstruction("OP_BIT_NOT", offset);
+  case OP_POP:
+    return simpleInstruction("OP_POP", offset);
+  case OP_GET_GLOBAL:
+    return slotInstruction("OP_GET_GLOBAL", program, offset);
+  case OP_SET_GLOBAL:
+    return slotInstruction("OP_SET_GLOBAL", program, offset);
+  case OP_GET_LOCAL:
+    return byteInstruction("OP_GET_LOCAL", program, offset);
+  case OP_SET_LOCAL:
+    return byteInstruction("OP_SET_LOCAL", program, offset);
+  case OP_JUMP:
+    return jumpInstruction("OP_JUMP", 1, program, offset);
+  case OP_JUMP_IF_FALSE:
+    return jumpInstruction("OP_JUMP_IF_FALSE", 1, program, offset);
+  case OP_LOOP:
+    return jumpInstruction("OP_LOOP", -1, program, offset);
+  case OP_PRINT:
+    return simpleInstruction("OP_PRINT", offset);
+  case OP_PRINTLN:
+    return simpleInstruction("OP_PRINTLN", offset);
+  case OP_CALL:
+    return byteInstruction("OP_CALL", program, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", program, offset);
   case OP_RETURN:
     return simpleInstruction("OP_RETURN", offset);
+  case OP_CLOSURE:
+    return closureInstruction(program, offset);
+  case OP_GET_UPVALUE:
+    return byteInstruction("OP_GET_UPVALUE", program, offset);
+  case OP_SET_UPVALUE:
+    return byteInstruction("OP_SET_UPVALUE", program, offset);
+  case OP_CLOSE_UPVALUE:
+    return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+  case OP_DICT:
+    return dictInstruction(program, offset);
+  case OP_DICT_SET:
+    return simpleInstruction("OP_DICT_SET", offset);
+  case OP_GET_INDEX:
+    return simpleInstruction("OP_GET_INDEX", offset);
+  case OP_SET_INDEX:
+    return simpleInstruction("OP_SET_INDEX", offset);
+  case OP_NOT_EQUAL:
+    return simpleInstruction("OP_NOT_EQUAL", offset);
+  case OP_GREATER_EQUAL:
+    return simpleInstruction("OP_GREATER_EQUAL", offset);
+  case OP_LESS_EQUAL:
+    return simpleInstruction("OP_LESS_EQUAL", offset);
+  case OP_EQUAL_CONST:
+    return constantInstruction("OP_EQUAL_CONST", program, offset);
+  case OP_GREATER_CONST:
+    return constantInstruction("OP_GREATER_CONST", program, offset);
+  case OP_LESS_CONST:
+    return constantInstruction("OP_LESS_CONST", program, offset);
+  case OP_ADD_CONST:
+    return constantInstruction("OP_ADD_CONST", program, offset);
+  case OP_SUBTRACT_CONST:
+    return constantInstruction("OP_SUBTRACT_CONST", program, offset);
+  case OP_MULTIPLY_CONST:
+    return constantInstruction("OP_MULTIPLY_CONST", program, offset);
+  case OP_DIVIDE_CONST:
+    return constantInstruction("OP_DIVIDE_CONST", program, offset);
+  case OP_EQUAL_R:
+    return registerInstruction("OP_EQUAL_R", program, offset);
+  case OP_GREATER_R:
+    return registerInstruction("OP_GREATER_R", program, offset);
+  case OP_LESS_R:
+    return registerInstruction("OP_LESS_R", program, offset);
+  case OP_ADD_R:
+    return registerInstruction("OP_ADD_R", program, offset);
+  case OP_SUBTRACT_R:
+    return registerInstruction("OP_SUBTRACT_R", program, offset);
+  case OP_MULTIPLY_R:
+    return registerInstruction("OP_MULTIPLY_R", program, offset);
+  case OP_DIVIDE_R:
+    return registerInstruction("OP_DIVIDE_R", program, offset);
+  case OP_FORPREP:
+    return forInstruction("OP_FORPREP", 1, program, offset);
+  case OP_FORLOOP:
+    return forInstruction("OP_FORLOOP", -1, program, offset);
+  case OP_JUMP_IF_NOT_EQUAL:
+    return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, program, offset);
+  case OP_JUMP_IF_EQUAL:
+    return jumpInstruction("OP_JUMP_IF_EQUAL", 1, program, offset);
+  case OP_JUMP_IF_NOT_GREATER:
+    return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, program, offset);
+  case OP_JUMP_IF_NOT_LESS:
+    return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, program, offset);
+  case OP_JUMP_IF_GREATER:
+    return jumpInstruction("OP_JUMP_IF_GREATER", 1, program, offset);
+  case OP_JUMP_IF_LESS:
+    return jumpInstruction("OP_JUMP_IF_LESS", 1, program, offset);
+  case OP_JUMP_IF_TRUE:
+    return jumpInstruction("OP_JUMP_IF_TRUE", 1, program, offset);
+  case OP_JUMP_IF_NOT_EQUAL_CONST:
+    return constantJumpInstruction("OP_JUMP_IF_NOT_EQUAL_CONST", program, offset);
+  case OP_JUMP_IF_NOT_GREATER_CONST:
+    return constantJumpInstruction("OP_JUMP_IF_NOT_GREATER_CONST", program, offset);
+  case OP_JUMP_IF_NOT_LESS_CONST:
+    return constantJumpInstruction("OP_JUMP_IF_NOT_LESS_CONST", program, offset);
+  case OP_JUMP_IF_NOT_EQUAL_R:
+    return registerJumpInstruction("OP_JUMP_IF_NOT_EQUAL_R", program, offset);
+  case OP_JUMP_IF_NOT_GREATER_R:
+    return registerJumpInstruction("OP_JUMP_IF_NOT_GREATER_R", program, offset);
+  case OP_JUMP_IF_NOT_LESS_R:
+    return registerJumpInstruction("OP_JUMP_IF_NOT_LESS_R", program, offset);
+  case OP_ADD_INT:
+    return simpleInstruction("OP_ADD_INT", offset);
+  case OP_ADD_FLOAT:
+    return simpleInstruction("OP_ADD_FLOAT", offset);
+  case OP_SUBTRACT_INT:
+    return simpleInstruction("OP_SUBTRACT_INT", offset);
+  case OP_SUBTRACT_FLOAT:
+    return simpleInstruction("OP_SUBTRACT_FLOAT", offset);
+  case OP_MULTIPLY_INT:
+    return simpleInstruction("OP_MULTIPLY_INT", offset);
+  case OP_MULTIPLY_FLOAT:
+    return simpleInstruction("OP_MULTIPLY_FLOAT", offset);
+  case OP_ADD_INT_CONST:
+    return constantInstruction("OP_ADD_INT_CONST", program, offset);
+  case OP_ADD_FLOAT_CONST:
+    return constantInstruction("OP_ADD_FLOAT_CONST", program, offset);
+  case OP_SUBTRACT_INT_CONST:
+    return constantInstruction("OP_SUBTRACT_INT_CONST", program, offset);
+  case OP_SUBTRACT_FLOAT_CONST:
+    return constantInstruction("OP_SUBTRACT_FLOAT_CONST", program, offset);
+  case OP_MULTIPLY_INT_CONST:
+    return constantInstruction("OP_MULTIPLY_INT_CONST", program, offset);
+  case OP_MULTIPLY_FLOAT_CONST:
+    return constantInstruction("OP_MULTIPLY_FLOAT_CONST", program, offset);
+  case OP_ADD_INT_R:
+    return registerInstruction("OP_ADD_INT_R", program, offset);
+  case OP_ADD_FLOAT_R:
+    return registerInstruction("OP_ADD_FLOAT_R", program, offset);
+  case OP_SUBTRACT_INT_R:
+    return registerInstruction("OP_SUBTRACT_INT_R", program, offset);
+  case OP_SUBTRACT_FLOAT_R:
+    return registerInstruction("OP_SUBTRACT_FLOAT_R", program, offset);
+  case OP_MULTIPLY_INT_R:
+    return registerInstruction("OP_MULTIPLY_INT_R", program, offset);
+  case OP_MULTIPLY_FLOAT_R:
+    return registerInstruction("OP_MULTIPLY_FLOAT_R", program, offset);
+  case OP_JUMP_IF_NOT_GREATER_INT_CONST:
+    return constantJumpInstruction("OP_JUMP_IF_NOT_GREATER_INT_CONST", program, offset);
+  case OP_JUMP_IF_NOT_GREATER_FLOAT_CONST:
+    return constantJumpInstruction("OP_JUMP_IF_NOT_GREATER_FLOAT_CONST", program, offset);
+  case OP_JUMP_IF_NOT_LESS_INT_CONST:
+    return constantJumpInstruction("OP_JUMP_IF_NOT_LESS_INT_CONST", program, offset);
+  case OP_JUMP_IF_NOT_LESS_FLOAT_CONST:
+    return constantJumpInstruction("OP_JUMP_IF_NOT_LESS_FLOAT_CONST", program, offset);
+  case OP_ADD_MIXED:
+    return simpleInstruction("OP_ADD_MIXED", offset);
+  case OP_SUBTRACT_MIXED:
+    return simpleInstruction("OP_SUBTRACT_MIXED", offset);
+  case OP_MULTIPLY_MIXED:
+    return simpleInstruction("OP_MULTIPLY_MIXED", offset);
+  case OP_ADD_MIXED_CONST:
+    return constantInstruction("OP_ADD_MIXED_CONST", program, offset);
+  case OP_SUBTRACT_MIXED_CONST:
+    return constantInstruction("OP_SUBTRACT_MIXED_CONST", program, offset);
+  case OP_MULTIPLY_MIXED_CONST:
+    return constantInstruction("OP_MULTIPLY_MIXED_CONST", program, offset);
+  case OP_ADD_MIXED_R:
+    return registerInstruction("OP_ADD_MIXED_R", program, offset);
+  case OP_SUBTRACT_MIXED_R:
+    return registerInstruction("OP_SUBTRACT_MIXED_R", program, offset);
+  case OP_MULTIPLY_MIXED_R:
+    return registerInstruction("OP_MULTIPLY_MIXED_R", program, offset);
+  case OP_JUMP_IF_NOT_GREATER_MIXED_CONST:
+    return constantJumpInstruction("OP_JUMP_IF_NOT_GREATER_MIXED_CONST", program, offset);
+  case OP_JUMP_IF_NOT_LESS_MIXED_CONST:
+    return constantJumpInstruction("OP_JUMP_IF_NOT_LESS_MIXED_CONST", program, offset);
   default:
     printf("Unknown opcode %d\n", instruction);
     return offset + 1;
@@ -0,0 +1,517 @@
+#include <string.h>
+#include "cvm.h"
+#include "dict.h"
+#include "gc.h"
+#include "memory.h"
+
+#ifdef SIMD_DICT
+#include <emmintrin.h>
+#endif
+
+// The hash part is a Swiss table: open addressing over groups of DICT_GROUP slots,
+// with the control bytes of the slots kept apart from the entries. The control byte
+// of a full slot holds the low 7 bits of its key's hash (its h2), so a probe matches
+// a whole group against h2 in one compare and only looks at the entries whose byte
+// matched, about one in 128 of the others. The rest of the hash (h1) picks the first
+// group, then the probe moves on by 1, 2, 3... groups, which visits every group
+// when there is a power of two of them. A group with an empty slot ends the probe.
+//
+// A removed key leaves a deleted slot, unless its group has an empty one already:
+// no probe can have gone past that group, so the slot can be empty again.
+
+#define CONTROL_EMPTY ((int8_t)-128)
+#define CONTROL_DELETED ((int8_t)-2)
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((int8_t)((hash) & 0x7f))
+
+// Grow once 7/8 of the slots are taken, deleted ones included.
+#define DICT_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+// Bit i is set for slot i of a group.
+typedef uint32_t GroupMask;
+
+static inline GroupMask matchByte(const int8_t *group, int8_t byte)
+{
+#ifdef SIMD_DICT
+  __m128i control = _mm_loadu_si128((const __m128i *)group);
+  return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(byte)));
+#else
+  GroupMask mask = 0;
+  for (int i = 0; i < DICT_GROUP; ++i)
+    mask |= (GroupMask)(group[i] == byte) << i;
+  return mask;
+#endif
+}
+
+// Empty and deleted slots, the control bytes with the sign bit set.
+static inline GroupMask matchFree(const int8_t *group)
+{
+#ifdef SIMD_DICT
+  return (GroupMask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+  GroupMask mask = 0;
+  for (int i = 0; i < DICT_GROUP; ++i)
+    mask |= (GroupMask)(group[i] < 0) << i;
+  return mask;
+#endif
+}
+
+static inline int firstSlot(GroupMask mask)
+{
+  return countTrailingZeros(mask);
+}
+
+// Numbers hash their bits, an integer those of its int64_t. Doubles that differ only
+// in the high word of their bits are folded into the low one before the multiply
+// spreads it over the high half.
+static uint32_t hashKey(Value key)
+{
+  uint64_t bits;
+
+  if (IS_STRING(key))
+    bits = AS_STRING(key)->hash;
+  else if (IS_INT(key))
+    bits = (uint64_t)AS_INT(key);
+  else if (IS_FLOAT(key))
+  {
+    double number = AS_FLOAT(key);
+    memcpy(&bits, &number, sizeof(bits));
+  }
+  else
+    bits = AS_BOOL(key) ? 1 : 2;
+
+  bits ^= bits >> 32;
+  bits *= 0x9e3779b97f4a7c15u;
+  return (uint32_t)(bits >> 32);
+}
+
+// Doubles hold every integer up to 2^53 exactly.
+#define EXACT_INTEGER_MAX ((int64_t)1 << 53)
+
+static inline bool isUnboxable(Value value)
+{
+  return IS_FLOAT(value) || (IS_INT(value) && AS_INT(value) >= -EXACT_INTEGER_MAX && AS_INT(value) <= EXACT_INTEGER_MAX);
+}
+
+bool dictKey(Value key, Value *normalized)
+{
+  if (IS_INT(key))
+  {
+    *normalized = key;
+    return true;
+  }
+
+  // A whole double an integer can hold is that integer, as the two are equal, and
+  // -0 is 0. Any other is a key of its own, never one an integer rounds to.
+  if (IS_FLOAT(key))
+  {
+    double number = AS_FLOAT(key);
+
+    if (number != number)
+      return false;
+
+    if (number >= (double)INTEGER_MIN && number < -(double)INTEGER_MIN && (double)(int64_t)number == number)
+      *normalized = INT_VAL((int64_t)number);
+    else
+      *normalized = key;
+
+    return true;
+  }
+
+  key = flattenValue(key);
+
+  if (!IS_STRING(key) && !IS_BOOL(key))
+    return false;
+
+  *normalized = key;
+  return true;
+}
+
+// Sets index when key is a whole number from 0 to limit.
+static inline bool arrayIndex(Value key, int limit, int *index)
+{
+  if (!IS_NUMBER(key))
+    return false;
+
+  double number = AS_NUMBER(key);
+
+  if (!(number >= 0 && number <= limit) || (int)number != number)
+    return false;
+
+  *index = (int)number;
+  return true;
+}
+
+// Bytes the parts take, which count toward the old generation like the object.
+static void allocateHashPart(ObjDict *dict, int capacity)
+{
+  dict->control = GROW_ARRAY_FOR(MEMORY_OBJECTS, NULL, int8_t, 0, capacity);
+  dict->entries = GROW_ARRAY_FOR(MEMORY_OBJECTS, NULL, DictEntry, 0, capacity);
+  memset(dict->control, CONTROL_EMPTY, capacity);
+  dict->capacity = capacity;
+  dict->count = 0;
+  dict->growthLeft = DICT_MAX_LOAD(capacity);
+  growOldBytes((ptrdiff_t)capacity * (sizeof(int8_t) + sizeof(DictEntry)));
+}
+
+static void freeHashPart(int8_t *control, DictEntry *entries, int capacity)
+{
+  FREE_ARRAY_FOR(MEMORY_OBJECTS, int8_t, control, capacity);
+  FREE_ARRAY_FOR(MEMORY_OBJECTS, DictEntry, entries, capacity);
+  growOldBytes(-(ptrdiff_t)capacity * (sizeof(int8_t) + sizeof(DictEntry)));
+}
+
+// The smallest capacity, a power of two number of groups, that holds count keys.
+static int capacityFor(int count)
+{
+  int capacity = DICT_GROUP;
+
+  while (DICT_MAX_LOAD(capacity) < count)
+    capacity *= 2;
+
+  return capacity;
+}
+
+static inline size_t elementSize(ObjDict *dict)
+{
+  return dict->isNumeric ? sizeof(double) : sizeof(Value);
+}
+
+static void growArray(ObjDict *dict, int count)
+{
+  int oldAllocated = dict->arrayAllocated;
+
+  if (dict->isNumeric)
+    dict->array.numbers = GROW_ARRAY_FOR(MEMORY_OBJECTS, dict->array.numbers, double, oldAllocated, count);
+  else
+    dict->array.values = GROW_ARRAY_FOR(MEMORY_OBJECTS, dict->array.values, Value, oldAllocated, count);
+
+  dict->arrayAllocated = count;
+  growOldBytes((ptrdiff_t)(count - oldAllocated) * elementSize(dict));
+}
+
+static void freeArray(ObjDict *dict)
+{
+  if (dict->isNumeric)
+    FREE_ARRAY_FOR(MEMORY_OBJECTS, double, dict->array.numbers, dict->arrayAllocated);
+  else
+    FREE_ARRAY_FOR(MEMORY_OBJECTS, Value, dict->array.values, dict->arrayAllocated);
+
+  growOldBytes(-(ptrdiff_t)dict->arrayAllocated * elementSize(dict));
+}
+
+// Switches the array part to Value[], for a value that isn't a number, or to
+// double[] once it holds nothing else again.
+static void convertArray(ObjDict *dict)
+{
+  Allocator *previous = useAllocator(vm.allocator);
+
+  int allocated = dict->arrayAllocated;
+  ObjDict converted = *dict;
+  converted.isNumeric = !dict->isNumeric;
+  converted.array.values = NULL;
+  converted.arrayAllocated = 0;
+  growArray(&converted, allocated);
+
+  for (int i = 0; i < dict->arrayCount; ++i)
+  {
+    if (dict->isNumeric)
+      converted.array.values[i] = NUMBER_VAL(dict->array.numbers[i]);
+    else
+      converted.array.numbers[i] = AS_NUMBER(dict->array.values[i]);
+  }
+
+  freeArray(dict);
+  dict->array = converted.array;
+  dict->isNumeric = converted.isNumeric;
+
+  useAllocator(previous);
+}
+
+bool dictUnbox(ObjDict *dict)
+{
+  if (dict->isNumeric)
+    return true;
+
+  for (int i = 0; i < dict->arrayCount; ++i)
+  {
+    if (!isUnboxable(dict->array.values[i]))
+      return false;
+  }
+
+  convertArray(dict);
+  return true;
+}
+
+ObjDict *newNumberList(int count)
+{
+  ObjDict *dict = newDict(count, 0);
+  dict->arrayCount = count;
+  return dict;
+}
+
+ObjDict *newDict(int arrayCount, int hashCount)
+{
+  Allocator *previous = useAllocator(vm.allocator);
+
+  ObjDict *dict = (ObjDict *)allocateOldObject(sizeof(ObjDict), OBJ_DICT);
+  dict->array.numbers = NULL;
+  dict->isNumeric = true;
+  dict->arrayCount = 0;
+  dict->arrayAllocated = 0;
+  dict->control = NULL;
+  dict->entries = NULL;
+  dict->capacity = 0;
+  dict->count = 0;
+  dict->growthLeft = 0;
+
+  if (arrayCount > 0)
+    growArray(dict, arrayCount);
+  if (hashCount > 0)
+    allocateHashPart(dict, capacityFor(hashCount));
+
+  useAllocator(previous);
+
+  return dict;
+}
+
+void freeDictParts(ObjDict *dict)
+{
+  freeArray(dict);
+  freeHashPart(dict->control, dict->entries, dict->capacity);
+}
+
+static DictEntry *findEntry(ObjDict *dict, Value key, uint32_t hash)
+{
+  if (dict->count == 0)
+    return NULL;
+
+  uint32_t groupMask = (uint32_t)dict->capacity / DICT_GROUP - 1;
+  uint32_t group = H1(hash) & groupMask;
+
+  for (uint32_t step = 1;; group = (group + step++) & groupMask)
+  {
+    const int8_t *control = dict->control + group * DICT_GROUP;
+
+    for (GroupMask match = matchByte(control, H2(hash)); match != 0; match &= match - 1)
+    {
+      DictEntry *entry = &dict->entries[group * DICT_GROUP + firstSlot(match)];
+
+      if (areValuesIdentical(entry->key, key))
+        return entry;
+    }
+
+    if (matchByte(control, CONTROL_EMPTY) != 0)
+      return NULL;
+  }
+}
+
+// The first empty or deleted slot on the probe sequence of hash.
+static int findFreeSlot(ObjDict *dict, uint32_t hash)
+{
+  uint32_t groupMask = (uint32_t)dict->capacity / DICT_GROUP - 1;
+  uint32_t group = H1(hash) & groupMask;
+
+  for (uint32_t step = 1;; group = (group + step++) & groupMask)
+  {
+    GroupMask free = matchFree(dict->control + group * DICT_GROUP);
+
+    if (free != 0)
+      return (int)(group * DICT_GROUP) + firstSlot(free);
+  }
+}
+
+static void insertEntry(ObjDict *dict, int slot, Value key, Value value, uint32_t hash)
+{
+  if (dict->control[slot] == CONTROL_EMPTY)
+    --dict->growthLeft;
+
+  dict->control[slot] = H2(hash);
+  dict->entries[slot].key = key;
+  dict->entries[slot].value = value;
+  ++dict->count;
+}
+
+// Moves the keys to a new hash part, twice the size unless deleted slots are most
+// of what filled the old one.
+static void rehash(ObjDict *dict)
+{
+  int8_t *control = dict->control;
+  DictEntry *entries = dict->entries;
+  int capacity = dict->capacity;
+  int count = dict->count;
+
+  Allocator *previous = useAllocator(vm.allocator);
+
+  if (capacity == 0)
+    allocateHashPart(dict, DICT_GROUP);
+  else
+    allocateHashPart(dict, count + 1 <= DICT_MAX_LOAD(capacity) / 2 ? capacity : capacity * 2);
+
+  for (int i = 0; i < capacity; ++i)
+  {
+    if (control[i] < 0)
+      continue;
+
+    uint32_t hash = hashKey(entries[i].key);
+    insertEntry(dict, findFreeSlot(dict, hash), entries[i].key, entries[i].value, hash);
+  }
+
+  if (capacity > 0)
+    freeHashPart(control, entries, capacity);
+
+  useAllocator(previous);
+}
+
+static void removeEntry(ObjDict *dict, DictEntry *entry)
+{
+  int slot = (int)(entry - dict->entries);
+
+  if (matchByte(dict->control + (slot & ~(DICT_GROUP - 1)), CONTROL_EMPTY) != 0)
+  {
+    dict->control[slot] = CONTROL_EMPTY;
+    ++dict->growthLeft;
+  }
+  else
+    dict->control[slot] = CONTROL_DELETED;
+
+  --dict->count;
+}
+
+static void setHashPart(ObjDict *dict, Value key, Value value)
+{
+  uint32_t hash = hashKey(key);
+  int slot = -1;
+
+  // Looks for the key and for the first free slot in the same probe, the key can't
+  // be past a group with an empty slot.
+  if (dict->capacity > 0)
+  {
+    uint32_t groupMask = (uint32_t)dict->capacity / DICT_GROUP - 1;
+    uint32_t group = H1(hash) & groupMask;
+
+    for (uint32_t step = 1;; group = (group + step++) & groupMask)
+    {
+      const int8_t *control = dict->control + group * DICT_GROUP;
+
+      for (GroupMask match = matchByte(control, H2(hash)); match != 0; match &= match - 1)
+      {
+        DictEntry *entry = &dict->entries[group * DICT_GROUP + firstSlot(match)];
+
+        if (!areValuesIdentical(entry->key, key))
+          continue;
+
+        if (IS_NONE(value))
+          removeEntry(dict, entry);
+        else
+          entry->value = value;
+        return;
+      }
+
+      GroupMask free = matchFree(control);
+
+      if (slot == -1 && free != 0)
+        slot = (int)(group * DICT_GROUP) + firstSlot(free);
+
+      if (matchByte(control, CONTROL_EMPTY) != 0)
+        break;
+    }
+  }
+
+  if (IS_NONE(value))
+    return;
+
+  // A deleted slot can be reused as it is, an empty one has to be spared.
+  if (slot == -1 || (dict->control[slot] == CONTROL_EMPTY && dict->growthLeft == 0))
+  {
+    rehash(dict);
+    slot = findFreeSlot(dict, hash);
+  }
+
+  insertEntry(dict, slot, key, value, hash);
+}
+
+// Appends to the array part, then moves over the keys that follow from the hash
+// part, so that a key is never in the hash part while it could be in the array.
+static void appendArray(ObjDict *dict, Value value)
+{
+  while (true)
+  {
+    if (dict->isNumeric && !isUnboxable(value))
+      convertArray(dict);
+
+    if (dict->arrayCount == dict->arrayAllocated)
+    {
+      Allocator *previous = useAllocator(vm.allocator);
+      growArray(dict, GROW_NUM_OF_ALLOCATED(dict->arrayAllocated));
+      useAllocator(previous);
+    }
+
+    if (dict->isNumeric)
+      dict->array.numbers[dict->arrayCount++] = AS_NUMBER(value);
+    else
+      dict->array.values[dict->arrayCount++] = value;
+
+    if (dict->count == 0)
+      return;
+
+    Value next = INT_VAL(dict->arrayCount);
+    DictEntry *entry = findEntry(dict, next, hashKey(next));
+
+    if (entry == NULL)
+      return;
+
+    value = entry->value;
+    removeEntry(dict, entry);
+  }
+}
+
+Value dictGet(ObjDict *dict, Value key)
+{
+  int index;
+
+  if (arrayIndex(key, dict->arrayCount - 1, &index))
+    return dictArrayValue(dict, index);
+
+  DictEntry *entry = findEntry(dict, key, hashKey(key));
+  return entry != NULL ? entry->value : NONE_VAL;
+}
+
+void dictSet(ObjDict *dict, Value key, Value value)
+{
+  int index;
+
+  if (arrayIndex(key, dict->arrayCount, &index))
+  {
+    if (index == dict->arrayCount)
+    {
+      // Nothing to remove, the key would be in the array part.
+      if (!IS_NONE(value))
+        appendArray(dict, value);
+    }
+    else if (dict->isNumeric && isUnboxable(value))
+      dict->array.numbers[index] = AS_NUMBER(value);
+    else if (dict->isNumeric && IS_NONE(value) && index == dict->arrayCount - 1)
+      --dict->arrayCount; // Numbers leave no holes before it.
+    else
+    {
+      if (dict->isNumeric)
+        convertArray(dict);
+
+      dict->array.values[index] = value;
+
+      // The array part ends at its last key.
+      while (dict->arrayCount > 0 && IS_NONE(dict->array.values[dict->arrayCount - 1]))
+        --dict->arrayCount;
+    }
+  }
+  else
+    setHashPart(dict, key, value);
+
+  // Dictionaries are always old.
+  if (IS_OBJ(key))
+    writeBarrier(&dict->obj, AS_OBJ(key));
+  if (IS_OBJ(value))
+    writeBarrier(&dict->obj, AS_OBJ(value));
+}
@@ -0,0 +1,34 @@
+#ifndef DICT_H
+#define DICT_H
+
+#include "common.h"
+#include "object.h"
+#include "value.h"
+
+// Slots of the hash part that are probed together, one control byte each.
+#define DICT_GROUP 16
+
+// Room for arrayCount keys 0, 1, 2... and hashCount others before anything grows.
+ObjDict *newDict(int arrayCount, int hashCount);
+// Sets key to the form dictionaries store it in: a rope is flattened, and a whole
+// double an integer can hold is that integer, -0 included.
+// False when key can't be one, because it is none, NaN or an object but a string.
+bool dictKey(Value key, Value *normalized);
+// key must have been through dictKey(). none when it is missing.
+Value dictGet(ObjDict *dict, Value key);
+// Likewise. Setting a key to none removes it.
+void dictSet(ObjDict *dict, Value key, Value value);
+// Frees the parts of a dictionary the collector found dead.
+void freeDictParts(ObjDict *dict);
+// True when every value of keys 0 to arrayCount - 1 is a number, which leaves them
+// in array.numbers: a boxed array part that holds only numbers again is unboxed.
+bool dictUnbox(ObjDict *dict);
+// A dictionary of count numbers, keys 0 to count - 1, for the caller to fill in.
+ObjDict *newNumberList(int count);
+
+static inline Value dictArrayValue(ObjDict *dict, int index)
+{
+  return dict->isNumeric ? NUMBER_VAL(dict->array.numbers[index]) : dict->array.values[index];
+}
+
+#endif
@@ -0,0 +1,654 @@
+// For clock_gettime(), which -std=c99 leaves out of <time.h>.
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <time.h>
+#include "cvm.h"
+#include "dict.h"
+#include "gc.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+
+// Nursery objects are carved up on this boundary, enough for the pointers in them.
+#define NURSERY_ALIGNMENT 8
+#define NURSERY_ALIGN(size) (((size) + NURSERY_ALIGNMENT - 1) & ~(size_t)(NURSERY_ALIGNMENT - 1))
+
+// Anything bigger goes straight to the old generation, copying it out of the
+// nursery would cost more than allocating it there.
+#define NURSERY_MAX_OBJECT (vm.gc.nurserySize / 8)
+
+// Everything but the settings and the statistics, which outlive freeGC() so that
+// they can be reported at exit.
+static void resetHeap()
+{
+  vm.gc.nursery = NULL;
+  vm.gc.nurseryTop = NULL;
+  vm.gc.nurseryEnd = NULL;
+
+  vm.gc.pending = false;
+  vm.gc.isNurseryFull = false;
+  vm.gc.debt = 0;
+
+  vm.gc.phase = GC_IDLE;
+  vm.gc.oldBytes = 0;
+  vm.gc.nextMajor = GC_FIRST_MAJOR;
+
+  vm.gc.gray = NULL;
+  vm.gc.grayCount = 0;
+  vm.gc.grayAllocated = 0;
+  vm.gc.remembered = NULL;
+  vm.gc.rememberedCount = 0;
+  vm.gc.rememberedAllocated = 0;
+  vm.gc.promoted = NULL;
+  vm.gc.promotedCount = 0;
+  vm.gc.promotedAllocated = 0;
+  vm.gc.sweepList = NULL;
+}
+
+void initGC()
+{
+  vm.gc.nurserySize = GC_NURSERY_SIZE;
+  vm.gc.stepBytes = GC_STEP_BYTES;
+  vm.gc.stepWork = GC_STEP_WORK;
+
+  resetHeap();
+
+  vm.gc.minorCollections = 0;
+  vm.gc.majorCycles = 0;
+  vm.gc.majorSteps = 0;
+  vm.gc.promotedBytes = 0;
+#ifdef MEMORY_STATS
+  memset(vm.gc.pauses, 0, sizeof(vm.gc.pauses));
+  vm.gc.longestPause = 0;
+  vm.gc.totalPause = 0;
+#endif
+}
+
+static size_t objectSize(Obj *object)
+{
+  switch (object->type)
+  {
+  case OBJ_STRING:
+    return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+  case OBJ_ROPE:
+    return sizeof(ObjRope);
+  case OBJ_FUNCTION:
+    return sizeof(ObjFunction) + ((ObjFunction *)object)->captureCount * sizeof(Capture);
+  case OBJ_CLOSURE:
+    return sizeof(ObjClosure) + ((ObjClosure *)object)->captureCount * sizeof(Value);
+  case OBJ_UPVALUE:
+    return sizeof(ObjUpvalue);
+  case OBJ_DICT:
+    return sizeof(ObjDict); // Its parts are counted by growOldBytes().
+  case OBJ_NATIVE:
+    return sizeof(ObjNative);
+  }
+
+  return 0; // Unreachable.
+}
+
+static bool isYoung(Obj *object)
+{
+  return (uintptr_t)object >= (uintptr_t)vm.gc.nursery && (uintptr_t)object < (uintptr_t)vm.gc.nurseryTop;
+}
+
+static void pushObject(Obj ***list, int *count, int *allocated, Obj *object)
+{
+  if (*allocated < *count + 1)
+  {
+    int oldAllocated = *allocated;
+    *allocated = GROW_NUM_OF_ALLOCATED(oldAllocated);
+    *list = GROW_ARRAY(*list, Obj *, oldAllocated, *allocated);
+  }
+
+  (*list)[(*count)++] = object;
+}
+
+// Strings have no children, so they are black as soon as they are marked. Young
+// objects aren't marked at all, the cycle only finishes once the nursery is empty.
+static Obj *markObject(Obj *object)
+{
+  if (object == NULL || isYoung(object) || object->isMarked)
+    return object;
+
+  object->isMarked = true;
+
+  if (object->type != OBJ_STRING)
+    pushObject(&vm.gc.gray, &vm.gc.grayCount, &vm.gc.grayAllocated, object);
+
+  return object;
+}
+
+static Obj *allocateOld(size_t size)
+{
+  Obj *object = (Obj *)reallocateFor(MEMORY_OBJECTS, NULL, 0, size);
+  vm.gc.oldBytes += size;
+
+  if (vm.gc.phase == GC_IDLE && vm.gc.oldBytes >= vm.gc.nextMajor)
+    vm.gc.pending = true;
+
+  return object;
+}
+
+// Puts an object that just came into the old generation on vm.objects. During
+// marking it is marked, and its children are marked once it is off the gray stack.
+// During a sweep it is out of the sweep's way, vm.objects is not what is swept.
+static void adoptOld(Obj *object)
+{
+  object->isMarked = false;
+  object->isRemembered = false;
+  object->next = vm.objects;
+  vm.objects = object;
+
+  if (vm.gc.phase == GC_MARK)
+    markObject(object);
+}
+
+static void freeOld(Obj *object)
+{
+  if (object->type == OBJ_DICT)
+    freeDictParts((ObjDict *)object);
+
+  size_t size = objectSize(object);
+  vm.gc.oldBytes -= size;
+  reallocateFor(MEMORY_OBJECTS, object, size, 0);
+}
+
+Obj *allocateObject(size_t size, ObjType type)
+{
+  vm.gc.debt += size;
+  if (vm.gc.debt >= vm.gc.stepBytes)
+    vm.gc.pending = true;
+
+  if (vm.gc.nursery == NULL)
+  {
+    vm.gc.nursery = GROW_ARRAY_FOR(MEMORY_OBJECTS, NULL, char, 0, vm.gc.nurserySize);
+    vm.gc.nurseryTop = vm.gc.nursery;
+    vm.gc.nurseryEnd = vm.gc.nursery + vm.gc.nurserySize;
+  }
+
+#ifdef DEBUG_STRESS_GC
+  vm.gc.isNurseryFull = true;
+  vm.gc.pending = true;
+#endif
+
+  size_t nurseryBytes = NURSERY_ALIGN(size);
+
+  if (size <= NURSERY_MAX_OBJECT && nurseryBytes <= (size_t)(vm.gc.nurseryEnd - vm.gc.nurseryTop))
+  {
+    Obj *object = (Obj *)vm.gc.nurseryTop;
+    vm.gc.nurseryTop += nurseryBytes;
+
+    object->type = type;
+    object->isMarked = false;
+    object->isRemembered = false;
+    object->next = NULL;
+    return object;
+  }
+
+  // Until the next safe point empties the nursery, the overflow goes to the old generation.
+  if (size <= NURSERY_MAX_OBJECT)
+  {
+    vm.gc.isNurseryFull = true;
+    vm.gc.pending = true;
+  }
+
+  Obj *object = allocateOld(size);
+  object->type = type;
+  adoptOld(object);
+
+  return object;
+}
+
+Obj *allocateOldObject(size_t size, ObjType type)
+{
+  vm.gc.debt += size;
+  if (vm.gc.debt >= vm.gc.stepBytes)
+    vm.gc.pending = true;
+
+#ifdef DEBUG_STRESS_GC
+  vm.gc.pending = true;
+#endif
+
+  Obj *object = allocateOld(size);
+  object->type = type;
+  adoptOld(object);
+
+  return object;
+}
+
+void growOldBytes(ptrdiff_t bytes)
+{
+  vm.gc.oldBytes += bytes;
+
+  if (bytes > 0)
+  {
+    vm.gc.debt += bytes;
+    if (vm.gc.debt >= vm.gc.stepBytes)
+      vm.gc.pending = true;
+  }
+
+  if (vm.gc.phase == GC_IDLE && vm.gc.oldBytes >= vm.gc.nextMajor)
+    vm.gc.pending = true;
+}
+
+void discardObject(Obj *object)
+{
+  // Anything but the newest nursery object is left to the collector.
+  if (isYoung(object) && (char *)object + NURSERY_ALIGN(objectSize(object)) == vm.gc.nurseryTop)
+    vm.gc.nurseryTop = (char *)object;
+}
+
+void writeBarrier(Obj *owner, Obj *value)
+{
+  if (value == NULL || isYoung(owner))
+    return;
+
+  // The next minor collection has to find the young object through owner.
+  if (isYoung(value))
+  {
+    if (!owner->isRemembered)
+    {
+      owner->isRemembered = true;
+      pushObject(&vm.gc.remembered, &vm.gc.rememberedCount, &vm.gc.rememberedAllocated, owner);
+    }
+    return;
+  }
+
+  // A marked object may already be black, and must not point at a white one.
+  if (vm.gc.phase == GC_MARK && owner->isMarked)
+    markObject(value);
+}
+
+// Calls visit on every object reference the VM holds, and stores what it returns
+// back, so the same walk can mark or move.
+static void visitRoots(Obj *(*visit)(Obj *object))
+{
+  for (Value *slot = vm.stack; slot < vm.stackTop; ++slot)
+  {
+    if (IS_OBJ(*slot))
+      *slot = OBJ_VAL(visit(AS_OBJ(*slot)));
+  }
+
+  for (int i = 0; i < vm.globalCount; ++i)
+  {
+    if (IS_OBJ(vm.globals[i]))
+      vm.globals[i] = OBJ_VAL(visit(AS_OBJ(vm.globals[i])));
+  }
+
+  if (vm.program != NULL)
+  {
+    ValueArray *consts = &vm.program->consts;
+
+    for (int i = 0; i < consts->actuallyInUse; ++i)
+    {
+      if (IS_OBJ(consts->values[i]))
+        consts->values[i] = OBJ_VAL(visit(AS_OBJ(consts->values[i])));
+    }
+  }
+
+  // Open upvalues are listed through their nextOpen fields, each link is rewritten
+  // after the object holding it has been visited.
+  for (ObjUpvalue **upvalue = &vm.openUpvalues; *upvalue != NULL; upvalue = &(*upvalue)->nextOpen)
+    *upvalue = (ObjUpvalue *)visit(&(*upvalue)->obj);
+
+  // Global names are kept for later compilations, the string table (below) is weak.
+  // A moved key hashes the same, so it stays in its entry.
+  for (int i = 0; i < vm.globalNames.numOfAllocated; ++i)
+  {
+    Entry *entry = &vm.globalNames.entries[i];
+
+    if (entry->key != NULL)
+      entry->key = (ObjString *)visit(&entry->key->obj);
+  }
+}
+
+static void visitChildren(Obj *object, Obj *(*visit)(Obj *object))
+{
+  switch (object->type)
+  {
+  case OBJ_STRING:
+  case OBJ_NATIVE:
+    break;
+  case OBJ_ROPE:
+  {
+    ObjRope *rope = (ObjRope *)object;
+    rope->left = visit(rope->left);
+    rope->right = visit(rope->right);
+    rope->flat = (ObjString *)visit((Obj *)rope->flat);
+    break;
+  }
+  case OBJ_FUNCTION:
+  {
+    ObjFunction *function = (ObjFunction *)object;
+    function->name = (ObjString *)visit((Obj *)function->name);
+    break;
+  }
+  case OBJ_CLOSURE:
+  {
+    ObjClosure *closure = (ObjClosure *)object;
+    closure->function = (ObjFunction *)visit(&closure->function->obj);
+
+    for (int i = 0; i < closure->captureCount; ++i)
+    {
+      if (IS_OBJ(closure->captures[i]))
+        closure->captures[i] = OBJ_VAL(visit(AS_OBJ(closure->captures[i])));
+    }
+    break;
+  }
+  case OBJ_UPVALUE:
+  {
+    // An open one's variable is on the stack, and vm.openUpvalues is a root.
+    ObjUpvalue *upvalue = (ObjUpvalue *)object;
+    if (upvalue->slot < 0 && IS_OBJ(upvalue->closed))
+      upvalue->closed = OBJ_VAL(visit(AS_OBJ(upvalue->closed)));
+    break;
+  }
+  case OBJ_DICT:
+  {
+    // A string key that moves keeps its hash, so its entry stays where it is.
+    ObjDict *dict = (ObjDict *)object;
+
+    for (int i = 0; !dict->isNumeric && i < dict->arrayCount; ++i)
+    {
+      if (IS_OBJ(dict->array.values[i]))
+        dict->array.values[i] = OBJ_VAL(visit(AS_OBJ(dict->array.values[i])));
+    }
+
+    for (int i = 0; i < dict->capacity; ++i)
+    {
+      if (dict->control[i] < 0)
+        continue;
+
+      DictEntry *entry = &dict->entries[i];
+      if (IS_OBJ(entry->key))
+        entry->key = OBJ_VAL(visit(AS_OBJ(entry->key)));
+      if (IS_OBJ(entry->value))
+        entry->value = OBJ_VAL(visit(AS_OBJ(entry->value)));
+    }
+    break;
+  }
+  }
+}
+
+// Copies a young object into the old generation, once, leaving the address of the
+// copy behind in its next field for the other references to it.
+static Obj *promote(Obj *object)
+{
+  if (object == NULL || !isYoung(object))
+    return object;
+
+  if (object->next != NULL)
+    return object->next;
+
+  size_t size = objectSize(object);
+  Obj *copy = allocateOld(size);
+  memcpy(copy, object, size);
+  object->next = copy;
+  adoptOld(copy);
+
+  vm.gc.promotedBytes += size;
+
+  if (copy->type != OBJ_STRING)
+    pushObject(&vm.gc.promoted, &vm.gc.promotedCount, &vm.gc.promotedAllocated, copy);
+
+  return copy;
+}
+
+static void minorCollection()
+{
+  vm.gc.isNurseryFull = false;
+
+  visitRoots(promote);
+
+  for (int i = 0; i < vm.gc.rememberedCount; ++i)
+  {
+    vm.gc.remembered[i]->isRemembered = false;
+    visitChildren(vm.gc.remembered[i], promote);
+  }
+  vm.gc.rememberedCount = 0;
+
+  while (vm.gc.promotedCount > 0)
+    visitChildren(vm.gc.promoted[--vm.gc.promotedCount], promote);
+
+  // Every string is in the string table, which doesn't keep them alive. The entries
+  // of promoted strings move to the copy, the others go.
+  for (char *cursor = vm.gc.nursery; cursor < vm.gc.nurseryTop;)
+  {
+    Obj *object = (Obj *)cursor;
+    cursor += NURSERY_ALIGN(objectSize(object));
+
+    if (object->type != OBJ_STRING)
+      continue;
+
+    if (object->next != NULL)
+      tableReplaceKey(&vm.strings, (ObjString *)object, (ObjString *)object->next);
+    else
+      tableDelete(&vm.strings, (ObjString *)object);
+  }
+
+  vm.gc.nurseryTop = vm.gc.nursery;
+  ++vm.gc.minorCollections;
+
+  // Empty, so a new size can take effect. The next allocation makes the nursery again.
+  if ((size_t)(vm.gc.nurseryEnd - vm.gc.nursery) != vm.gc.nurserySize)
+  {
+    FREE_ARRAY_FOR(MEMORY_OBJECTS, char, vm.gc.nursery, vm.gc.nurseryEnd - vm.gc.nursery);
+    vm.gc.nursery = NULL;
+    vm.gc.nurseryTop = NULL;
+    vm.gc.nurseryEnd = NULL;
+  }
+}
+
+static void startMajorCycle()
+{
+  vm.gc.phase = GC_MARK;
+  visitRoots(markObject);
+}
+
+// Not incremental: roots may have changed without a barrier, so they are marked
+// again, along with what the nursery promotes. The pause grows with the roots and
+// whatever the barrier grayed since the last step, not with the heap.
+static void finishMarking()
+{
+  minorCollection();
+  visitRoots(markObject);
+
+  while (vm.gc.grayCount > 0)
+    visitChildren(vm.gc.gray[--vm.gc.grayCount], markObject);
+
+  tableRemoveUnmarked(&vm.strings);
+
+  // Objects that come into the old generation from here on go on a fresh list.
+  vm.gc.sweepList = vm.objects;
+  vm.objects = NULL;
+  vm.gc.phase = GC_SWEEP;
+}
+
+static void majorStep()
+{
+  int work = vm.gc.stepWork;
+
+  ++vm.gc.majorSteps;
+
+  if (vm.gc.phase == GC_MARK)
+  {
+    if (vm.gc.grayCount == 0)
+    {
+      finishMarking();
+      return;
+    }
+
+    while (work-- > 0 && vm.gc.grayCount > 0)
+      visitChildren(vm.gc.gray[--vm.gc.grayCount], markObject);
+    return;
+  }
+
+  while (work-- > 0 && vm.gc.sweepList != NULL)
+  {
+    Obj *object = vm.gc.sweepList;
+    vm.gc.sweepList = object->next;
+
+    if (object->isMarked)
+    {
+      object->isMarked = false;
+      object->next = vm.objects;
+      vm.objects = object;
+    }
+    else
+      freeOld(object);
+  }
+
+  if (vm.gc.sweepList == NULL)
+  {
+    vm.gc.phase = GC_IDLE;
+    vm.gc.nextMajor = vm.gc.oldBytes * GC_GROWTH > GC_FIRST_MAJOR ? vm.gc.oldBytes * GC_GROWTH : GC_FIRST_MAJOR;
+    ++vm.gc.majorCycles;
+  }
+}
+
+#ifdef MEMORY_STATS
+static double now()
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void recordPause(double seconds)
+{
+  double microseconds = seconds * 1e6;
+  int bucket = 0;
+
+  while (bucket + 1 < GC_PAUSE_BUCKETS && microseconds >= (double)(1u << (bucket + 1)))
+    ++bucket;
+
+  ++vm.gc.pauses[bucket];
+  vm.gc.totalPause += seconds;
+  if (seconds > vm.gc.longestPause)
+    vm.gc.longestPause = seconds;
+}
+#endif
+
+void collectGarbage()
+{
+  Allocator *previous = useAllocator(vm.allocator);
+#ifdef MEMORY_STATS
+  double start = now();
+#endif
+
+  bool isStepDue = vm.gc.debt >= vm.gc.stepBytes;
+  bool didWork = false;
+
+#ifdef DEBUG_STRESS_GC
+  isStepDue = true;
+  if (vm.gc.phase == GC_IDLE)
+    vm.gc.nextMajor = 0;
+#endif
+
+  vm.gc.pending = false;
+
+  if (vm.gc.isNurseryFull)
+  {
+    minorCollection();
+    didWork = true;
+  }
+
+  if (vm.gc.phase == GC_IDLE && vm.gc.oldBytes >= vm.gc.nextMajor)
+  {
+    startMajorCycle();
+    didWork = true;
+  }
+  else if (vm.gc.phase != GC_IDLE && isStepDue)
+  {
+    majorStep();
+    didWork = true;
+  }
+
+  if (isStepDue)
+    vm.gc.debt = 0;
+
+#ifdef MEMORY_STATS
+  if (didWork)
+    recordPause(now() - start);
+#else
+  (void)didWork;
+#endif
+
+  useAllocator(previous);
+}
+
+void freeGC()
+{
+  Obj *lists[] = {vm.objects, vm.gc.sweepList};
+
+  for (int i = 0; i < 2; ++i)
+  {
+    Obj *object = lists[i];
+
+    while (object != NULL)
+    {
+      Obj *next = object->next;
+      freeOld(object);
+      object = next;
+    }
+  }
+
+  vm.objects = NULL;
+
+  // Young objects own nothing beyond their place in the nursery.
+  FREE_ARRAY_FOR(MEMORY_OBJECTS, char, vm.gc.nursery, vm.gc.nurseryEnd - vm.gc.nursery);
+  FREE_ARRAY(Obj *, vm.gc.gray, vm.gc.grayAllocated);
+  FREE_ARRAY(Obj *, vm.gc.remembered, vm.gc.rememberedAllocated);
+  FREE_ARRAY(Obj *, vm.gc.promoted, vm.gc.promotedAllocated);
+
+  resetHeap();
+}
+
+#ifdef MEMORY_STATS
+void printGCStats(FILE *file, bool json)
+{
+  uint64_t pauses = 0;
+  for (int i = 0; i < GC_PAUSE_BUCKETS; ++i)
+    pauses += vm.gc.pauses[i];
+
+  if (json)
+  {
+    fprintf(file, "\"gc\": {\"minor\": %llu, \"major\": %llu, \"steps\": %llu, \"promoted\": %llu, ",
+            (unsigned long long)vm.gc.minorCollections, (unsigned long long)vm.gc.majorCycles,
+            (unsigned long long)vm.gc.majorSteps, (unsigned long long)vm.gc.promotedBytes);
+    fprintf(file, "\"pauses\": %llu, \"total_ms\": %.3f, \"longest_ms\": %.3f, \"histogram_us\": {",
+            (unsigned long long)pauses, vm.gc.totalPause * 1e3, vm.gc.longestPause * 1e3);
+
+    bool isFirst = true;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; ++i)
+    {
+      if (vm.gc.pauses[i] == 0)
+        continue;
+
+      fprintf(file, "%s\"%u\": %llu", isFirst ? "" : ", ", i == 0 ? 0 : 1u << i, (unsigned long long)vm.gc.pauses[i]);
+      isFirst = false;
+    }
+    fprintf(file, "}}");
+    return;
+  }
+
+  fprintf(file, "gc         %llu minor, %llu major in %llu steps, %llu bytes promoted\n",
+          (unsigned long long)vm.gc.minorCollections, (unsigned long long)vm.gc.majorCycles,
+          (unsigned long long)vm.gc.majorSteps, (unsigned long long)vm.gc.promotedBytes);
+  fprintf(file, "gc pauses  %llu, %.3f ms in total, longest %.3f ms\n", (unsigned long long)pauses,
+          vm.gc.totalPause * 1e3, vm.gc.longestPause * 1e3);
+
+  for (int i = 0; i < GC_PAUSE_BUCKETS; ++i)
+  {
+    if (vm.gc.pauses[i] == 0)
+      continue;
+
+    if (i == 0)
+      fprintf(file, "  %8s < %8u us %12llu\n", "", 2u, (unsigned long long)vm.gc.pauses[i]);
+    else
+      fprintf(file, "  %8u - %8u us %12llu\n", 1u << i, 2u << i, (unsigned long long)vm.gc.pauses[i]);
+  }
+}
+#endif
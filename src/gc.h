@@ -0,0 +1,107 @@
+#ifndef GC_H
+#define GC_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "common.h"
+#include "object.h"
+
+// Objects start out in the nursery, a block they are bump-allocated from. When it
+// fills up a minor collection copies the ones still reachable into the old
+// generation and empties it. The old generation is collected incrementally: a
+// major cycle marks it (tri-color, gray objects wait on a stack) and then sweeps
+// it a few objects per step, interleaved with the program. A write barrier keeps
+// both sound when an old object is made to point at another object.
+//
+// Collections only run at safe points in run(), where every live object is
+// reachable from the stack, the globals, the open upvalues or the running program's
+// constants, so C code in between is free to hold object pointers in locals.
+
+// Defaults for the settings in GC. rv takes others from RV_GC_NURSERY_SIZE,
+// RV_GC_STEP_BYTES and RV_GC_STEP_WORK when they are set.
+#define GC_NURSERY_SIZE (256 * 1024)
+#define GC_STEP_BYTES (32 * 1024)
+#define GC_STEP_WORK 2048
+// The old generation size that starts the first major cycle. Later ones start once
+// it has grown to GC_GROWTH times what the last cycle left alive.
+#define GC_FIRST_MAJOR (1024 * 1024)
+#define GC_GROWTH 2
+
+typedef enum
+{
+  GC_IDLE,  // No major cycle running.
+  GC_MARK,  // Marking the old generation from the roots.
+  GC_SWEEP, // Freeing what wasn't marked.
+} GCPhase;
+
+// Pauses of 2^i to 2^(i+1) microseconds land in bucket i, shorter ones in bucket 0.
+#define GC_PAUSE_BUCKETS 24
+
+typedef struct
+{
+  // Settings, read when they are needed, so they can be changed after initCVM().
+  size_t nurserySize; // Takes effect when the nursery is next emptied.
+  size_t stepBytes;   // Allocated between two steps of a major cycle.
+  int stepWork;       // Objects marked or swept per step, which bounds its pause.
+
+  char *nursery;
+  char *nurseryTop;
+  char *nurseryEnd;
+
+  bool pending;        // Checked at every safe point, set when there is work to do.
+  bool isNurseryFull;  // Set when an object didn't fit and went straight to the old generation.
+  size_t debt;         // Bytes allocated since the last step.
+
+  GCPhase phase;
+  size_t oldBytes;     // Live in the old generation, as far as the collector knows.
+  size_t nextMajor;    // oldBytes that starts the next major cycle.
+
+  Obj **gray;          // Marked objects whose children still need marking.
+  int grayCount;
+  int grayAllocated;
+
+  Obj **remembered;    // Old objects that point at young ones.
+  int rememberedCount;
+  int rememberedAllocated;
+
+  Obj **promoted;      // Copied by the current minor collection, children not yet copied.
+  int promotedCount;
+  int promotedAllocated;
+
+  Obj *sweepList;      // What the current sweep has yet to visit.
+
+  uint64_t minorCollections;
+  uint64_t majorCycles;
+  uint64_t majorSteps;
+  uint64_t promotedBytes;
+#ifdef MEMORY_STATS
+  uint64_t pauses[GC_PAUSE_BUCKETS];
+  double longestPause; // In seconds, like totalPause.
+  double totalPause;
+#endif
+} GC;
+
+void initGC();
+// Frees every object and the collector's own memory, but keeps the statistics.
+// Call with the VM's allocator current.
+void freeGC();
+// Returns an uninitialized object of size bytes, with only its header filled in.
+Obj *allocateObject(size_t size, ObjType type);
+// Like allocateObject(), but straight into the old generation, for objects that own
+// memory of their own: freeing a young object is only ever emptying the nursery.
+Obj *allocateOldObject(size_t size, ObjType type);
+// Counts memory an old object owns toward the old generation, bytes < 0 when it
+// gives some back, so that it brings on major cycles like objects do.
+void growOldBytes(ptrdiff_t bytes);
+// Gives back the object allocated last, if nothing can have seen it yet.
+void discardObject(Obj *object);
+// Call after storing value in a field of owner.
+void writeBarrier(Obj *owner, Obj *value);
+// The safe point: runs whatever work is pending. Call only when vm.gc.pending is set.
+void collectGarbage();
+#ifdef MEMORY_STATS
+// Likewise the "gc" member.
+void printGCStats(FILE *file, bool json);
+#endif
+
+#endif
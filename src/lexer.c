@@ -3,20 +3,66 @@
 #include "common.h"
 #include "lexer.h"
 
+#ifdef SIMD_LEXER
+#ifdef __AVX2__
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#endif
+
 typedef struct
 {
     const char *start;
     const char *current;
+    const char *end;
     int line;
+
+    // Set for streamed sources only.
+    RefillSource refill;
+    void *refillContext;
+    bool tokenSinceRefill;
 } Lexer;
 
 Lexer lexer;
 
-void initLexer(const char *src)
+void initLexer(const char *src, const char *end)
 {
     lexer.start = src;
     lexer.current = src;
+    lexer.end = end;
     lexer.line = 1;
+    lexer.refill = NULL;
+    lexer.refillContext = NULL;
+    lexer.tokenSinceRefill = false;
+}
+
+void initStreamLexer(RefillSource refill, void *context)
+{
+    static const char empty[] = "";
+
+    initLexer(empty, empty);
+    lexer.refill = refill;
+    lexer.refillContext = context;
+}
+
+// Fetches more of a streamed source. Everything from lexer.start on is carried over
+// into the new piece, so the token being scanned stays in one piece.
+static bool refill()
+{
+    const char *start;
+    const char *end;
+
+    if (lexer.refill == NULL ||
+        !lexer.refill(lexer.refillContext, (size_t)(lexer.end - lexer.start), lexer.tokenSinceRefill, &start, &end))
+        return false;
+
+    lexer.current = start + (lexer.current - lexer.start);
+    lexer.start = start;
+    lexer.end = end;
+    lexer.tokenSinceRefill = false;
+
+    return true;
 }
 
 static bool isAlpha(char c)
@@ -31,7 +77,7 @@ static bool isDigit(char c)
 
 static bool isDone()
 {
-    return *lexer.current == '\0';
+    return lexer.current == lexer.end && !refill();
 }
 
 static char advance()
@@ -42,13 +88,18 @@ static char advance()
 
 static char getCurrent()
 {
+    if (isDone())
+        return '\0';
     return *lexer.current;
 }
 
 static char getNext()
 {
-    if (isDone())
-        return '\0';
+    while (lexer.end - lexer.current < 2)
+    {
+        if (!refill())
+            return '\0';
+    }
     return lexer.current[1];
 }
 
@@ -64,8 +115,210 @@ static bool match(char expected)
     return true;
 }
 
+#ifdef SIMD_LEXER
+
+#ifdef __AVX2__
+typedef __m256i Block;
+#define BLOCK_SIZE 32
+#define BLOCK_BITS 0xffffffffu
+#define LOAD_BLOCK(p) _mm256_load_si256((const __m256i *)(p))
+#define SPLAT(c) _mm256_set1_epi8((char)(c))
+#define EQUAL_BYTES(a, b) _mm256_cmpeq_epi8(a, b)
+#define LESS_BYTES(a, b) _mm256_cmpgt_epi8(b, a)
+#define OR_BYTES(a, b) _mm256_or_si256(a, b)
+#define SUB_BYTES(a, b) _mm256_sub_epi8(a, b)
+#define BYTE_MASK(v) ((uint32_t)_mm256_movemask_epi8(v))
+#else
+typedef __m128i Block;
+#define BLOCK_SIZE 16
+#define BLOCK_BITS 0xffffu
+#define LOAD_BLOCK(p) _mm_load_si128((const __m128i *)(p))
+#define SPLAT(c) _mm_set1_epi8((char)(c))
+#define EQUAL_BYTES(a, b) _mm_cmpeq_epi8(a, b)
+#define LESS_BYTES(a, b) _mm_cmplt_epi8(a, b)
+#define OR_BYTES(a, b) _mm_or_si128(a, b)
+#define SUB_BYTES(a, b) _mm_sub_epi8(a, b)
+#define BYTE_MASK(v) ((uint32_t)_mm_movemask_epi8(v))
+#endif
+
+// Bytes b with low <= b < low + count. SSE2 only compares signed bytes, so the range is
+// moved down to start at -128 first.
+static inline Block inRange(Block block, char low, int count)
+{
+    return LESS_BYTES(SUB_BYTES(block, SPLAT(low - 128)), SPLAT(count - 128));
+}
+
+static inline uint32_t newlines(Block block)
+{
+    return BYTE_MASK(EQUAL_BYTES(block, SPLAT('\n')));
+}
+
+// Newlines are sparse, so clearing one bit per step beats popcount without -mpopcnt.
+static inline int countBits(uint32_t bits)
+{
+    int count = 0;
+
+    for (; bits != 0; bits &= bits - 1)
+        ++count;
+
+    return count;
+}
+
+static inline uint32_t notSpaces(Block block)
+{
+    Block spaces = OR_BYTES(OR_BYTES(EQUAL_BYTES(block, SPLAT(' ')), EQUAL_BYTES(block, SPLAT('\t'))),
+                            OR_BYTES(EQUAL_BYTES(block, SPLAT('\r')), EQUAL_BYTES(block, SPLAT('\n'))));
+    return ~BYTE_MASK(spaces) & BLOCK_BITS;
+}
+
+static inline uint32_t notDigits(Block block)
+{
+    return ~BYTE_MASK(inRange(block, '0', 10)) & BLOCK_BITS;
+}
+
+static inline uint32_t notIdentifierChars(Block block)
+{
+    // Setting bit 5 folds upper case onto lower case without bringing anything else into a-z.
+    Block letters = inRange(OR_BYTES(block, SPLAT(0x20)), 'a', 26);
+    Block others = OR_BYTES(EQUAL_BYTES(block, SPLAT('_')), EQUAL_BYTES(block, SPLAT('$')));
+    return ~BYTE_MASK(OR_BYTES(OR_BYTES(letters, others), inRange(block, '0', 10))) & BLOCK_BITS;
+}
+
+static inline uint32_t quotes(Block block)
+{
+    return BYTE_MASK(EQUAL_BYTES(block, SPLAT('\'')));
+}
+
+static inline uint32_t lineEnds(Block block)
+{
+    return newlines(block);
+}
+
+// Returns the first char at or after p that stop() flags, or lexer.end, adding the
+// newlines passed over to *line when it is given. Loads are aligned, so a block that
+// starts before lexer.end never reaches into the page after it.
+static inline const char *scanUntil(const char *p, uint32_t (*stop)(Block), int *line)
+{
+    size_t offset = (uintptr_t)p & (BLOCK_SIZE - 1);
+    const char *block = p - offset;
+
+    for (; block < lexer.end; block += BLOCK_SIZE, offset = 0)
+    {
+        Block bytes = LOAD_BLOCK(block);
+        uint32_t found = stop(bytes) >> offset << offset;
+
+        if (lexer.end - block < BLOCK_SIZE)
+            found |= (BLOCK_BITS << (lexer.end - block)) & BLOCK_BITS;
+
+        if (found != 0)
+        {
+            int end = countTrailingZeros(found);
+
+            if (line != NULL)
+                *line += countBits((newlines(bytes) & ((1u << end) - 1)) >> offset);
+
+            return block + end;
+        }
+
+        if (line != NULL)
+            *line += countBits(newlines(bytes) >> offset);
+    }
+
+    return lexer.end;
+}
+
+// Most runs between tokens are a char or two long, shorter than the setup of a block
+// scan, so the first SCALAR_RUN chars are always looked at one by one.
+#define SCALAR_RUN 8
+
+#endif
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// The run helpers below stop at lexer.end. Their callers refill a streamed source
+// and carry on from there.
+
+static const char *skipSpaces(const char *p, int *line)
+{
+    for (int i = 0; p < lexer.end && isSpace(*p); ++i)
+    {
+#ifdef SIMD_LEXER
+        if (i == SCALAR_RUN)
+            return scanUntil(p, notSpaces, line);
+#endif
+        if (*p == '\n')
+            ++*line;
+        ++p;
+    }
+
+    return p;
+}
+
+static const char *skipIdentifierChars(const char *p)
+{
+    for (int i = 0; p < lexer.end && (isAlpha(*p) || isDigit(*p)); ++i)
+    {
+#ifdef SIMD_LEXER
+        if (i == SCALAR_RUN)
+            return scanUntil(p, notIdentifierChars, NULL);
+#endif
+        ++p;
+    }
+
+    return p;
+}
+
+static const char *skipDigits(const char *p)
+{
+    for (int i = 0; p < lexer.end && isDigit(*p); ++i)
+    {
+#ifdef SIMD_LEXER
+        if (i == SCALAR_RUN)
+            return scanUntil(p, notDigits, NULL);
+#endif
+        ++p;
+    }
+
+    return p;
+}
+
+static const char *findQuote(const char *p, int *line)
+{
+    for (int i = 0; p < lexer.end && *p != '\''; ++i)
+    {
+#ifdef SIMD_LEXER
+        if (i == SCALAR_RUN)
+            return scanUntil(p, quotes, line);
+#endif
+        if (*p == '\n')
+            ++*line;
+        ++p;
+    }
+
+    return p;
+}
+
+static const char *findLineEnd(const char *p)
+{
+    for (int i = 0; p < lexer.end && *p != '\n'; ++i)
+    {
+#ifdef SIMD_LEXER
+        if (i == SCALAR_RUN)
+            return scanUntil(p, lineEnds, NULL);
+#endif
+        ++p;
+    }
+
+    return p;
+}
+
 static Token makeToken(TokenType type)
 {
+    lexer.tokenSinceRefill = true;
+
     Token token;
     token.type = type;
     token.start = lexer.start;
@@ -77,6 +330,8 @@ static Token makeToken(TokenType type)
 
 static Token errorToken(const char *msg)
 {
+    lexer.tokenSinceRefill = true;
+
     Token token;
     token.type = TOKEN_ERROR;
     token.start = msg;
@@ -90,32 +345,25 @@ static void skipWS()
 {
     while (true)
     {
-        char c = getCurrent();
+        lexer.current = skipSpaces(lexer.current, &lexer.line);
+        lexer.start = lexer.current; // nothing before the next token has to survive a refill
 
-        switch (c)
+        if (lexer.current == lexer.end)
         {
-        case ' ':
-        case '\r':
-        case '\t':
-            advance();
-            break;
-        case '\n':
-            ++lexer.line;
-            advance();
-            break;
-        case '-':
-            if (getNext() == '-')
-            {
-                while (getCurrent() != '\n' && !isDone()) // a comment ends at the end of the line
-                    advance();
-            }
-            else
+            if (!refill())
                 return;
-            break;
-
-        default:
-            return;
         }
+        else if (getCurrent() == '-' && getNext() == '-')
+        {
+            // A comment ends at the end of the line.
+            do
+            {
+                lexer.current = findLineEnd(lexer.current);
+                lexer.start = lexer.current;
+            } while (lexer.current == lexer.end && refill());
+        }
+        else
+            return;
     }
 }
 
@@ -135,8 +383,22 @@ static TokenType identifierType()
         return checkKeyword(1, 2, "nd", TOKEN_AND);
     case 'c':
         return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+    case 'd':
+        return checkKeyword(1, 1, "o", TOKEN_DO);
     case 'e':
-        return checkKeyword(1, 3, "lse", TOKEN_ELSE);
+        if (lexer.current - lexer.start > 1)
+        {
+            switch (lexer.start[1])
+            {
+            case 'l':
+                if (lexer.current - lexer.start > 2 && lexer.start[2] == 'i')
+                    return checkKeyword(3, 1, "f", TOKEN_ELIF);
+                return checkKeyword(2, 2, "se", TOKEN_ELSE);
+            case 'n':
+                return checkKeyword(2, 1, "d", TOKEN_END);
+            }
+        }
+        break;
     case 'f':
         if (lexer.current - lexer.start > 1)
         {
@@ -154,21 +416,35 @@ static TokenType identifierType()
     case 'i':
         return checkKeyword(1, 1, "f", TOKEN_IF);
     case 'n':
-        return checkKeyword(1, 2, "one", TOKEN_NONE);
+        return checkKeyword(1, 3, "one", TOKEN_NONE);
     case 'o':
         return checkKeyword(1, 1, "r", TOKEN_OR);
     case 'p':
+        if (lexer.current - lexer.start == 7)
+            return checkKeyword(1, 6, "rintln", TOKEN_PRINTLN);
         return checkKeyword(1, 4, "rint", TOKEN_PRINT);
     case 'r':
         return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
     case 's':
-        return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+        if (lexer.current - lexer.start > 1)
+        {
+            switch (lexer.start[1])
+            {
+            case 'c':
+                return checkKeyword(2, 4, "oped", TOKEN_SCOPED);
+            case 'u':
+                return checkKeyword(2, 3, "per", TOKEN_SUPER);
+            }
+        }
+        break;
     case 't':
         if (lexer.current - lexer.start > 1)
         {
             switch (lexer.start[1])
             {
             case 'h':
+                if (lexer.current - lexer.start > 2 && lexer.start[2] == 'e')
+                    return checkKeyword(3, 1, "n", TOKEN_THEN);
                 return checkKeyword(2, 2, "is", TOKEN_THIS);
             case 'r':
                 return checkKeyword(2, 2, "ue", TOKEN_TRUE);
@@ -186,24 +462,27 @@ static TokenType identifierType()
 
 static Token identifier()
 {
-    while (isAlpha(getCurrent()) || isDigit(getCurrent()))
-        advance();
+    do
+        lexer.current = skipIdentifierChars(lexer.current);
+    while (lexer.current == lexer.end && refill());
 
     return makeToken(identifierType());
 }
 
 static Token number()
 {
-    while (isDigit(getCurrent()))
-        advance();
+    do
+        lexer.current = skipDigits(lexer.current);
+    while (lexer.current == lexer.end && refill());
 
     // looking for a float
     if (getCurrent() == '.' && isDigit(getNext()))
     {
         advance();
 
-        while (isDigit(getCurrent()))
-            advance();
+        do
+            lexer.current = skipDigits(lexer.current);
+        while (lexer.current == lexer.end && refill());
     }
 
     return makeToken(TOKEN_NUMBER);
@@ -211,12 +490,9 @@ static Token number()
 
 static Token string()
 {
-    while (getCurrent() != '\'' && !isDone())
-    {
-        if (getCurrent() == '\n')
-            ++lexer.line;
-        advance();
-    }
+    do
+        lexer.current = findQuote(lexer.current, &lexer.line);
+    while (lexer.current == lexer.end && refill());
 
     if (isDone())
         return errorToken("Strings must begin and end with single quotes");
@@ -252,8 +528,14 @@ Token scanToken()
         return makeToken(TOKEN_LBRACE);
     case '}':
         return makeToken(TOKEN_RBRACE);
+    case '[':
+        return makeToken(TOKEN_LBRACKET);
+    case ']':
+        return makeToken(TOKEN_RBRACKET);
     case ';':
         return makeToken(TOKEN_SEMICOLON);
+    case ':':
+        return makeToken(TOKEN_COLON);
     case ',':
         return makeToken(TOKEN_COMMA);
     case '.':
@@ -263,16 +545,30 @@ Token scanToken()
     case '+':
         return makeToken(TOKEN_PLUS);
     case '/':
-        return makeToken(TOKEN_SLASH);
+        return makeToken(match('/') ? TOKEN_DOUBLE_SLASH : TOKEN_SLASH);
     case '*':
-        return makeToken(TOKEN_ASTERISK);
+        return makeToken(match('*') ? TOKEN_DOUBLE_ASTERISK : TOKEN_ASTERISK);
+    case '@':
+        return makeToken(TOKEN_AT);
+    case '%':
+        return makeToken(TOKEN_PERCENT);
+    case '&':
+        return makeToken(TOKEN_AMPERSAND);
+    case '|':
+        return makeToken(TOKEN_PIPE);
+    case '~':
+        return makeToken(TOKEN_TILDE);
     case '!':
         return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
     case '=':
         return makeToken(match('=') ? TOKEN_DOUBLE_EQUAL : TOKEN_EQUAL);
     case '<':
+        if (match('<'))
+            return makeToken(TOKEN_LESS_LESS);
         return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
     case '>':
+        if (match('>'))
+            return makeToken(TOKEN_GREATER_GREATER);
         return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
     case '\'':
         return string();
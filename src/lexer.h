@@ -1,6 +1,8 @@
 #ifndef LEXER_H
 #define LEXER_H
 
+#include "common.h"
+
 typedef enum
 {
     // Single-character tokens.
@@ -8,15 +10,25 @@ typedef enum
     TOKEN_RPAREN,
     TOKEN_LBRACE,
     TOKEN_RBRACE,
+    TOKEN_LBRACKET,
+    TOKEN_RBRACKET,
     TOKEN_COMMA,
     TOKEN_DOT,
     TOKEN_MINUS,
     TOKEN_PLUS,
     TOKEN_SEMICOLON,
+    TOKEN_COLON,
     TOKEN_SLASH,
     TOKEN_ASTERISK,
+    TOKEN_AT,
+    TOKEN_PERCENT,
+    TOKEN_AMPERSAND,
+    TOKEN_PIPE,
+    TOKEN_TILDE,
 
     // One or two character tokens.
+    TOKEN_DOUBLE_SLASH,
+    TOKEN_DOUBLE_ASTERISK,
     TOKEN_BANG,
     TOKEN_BANG_EQUAL,
     TOKEN_EQUAL,
@@ -25,6 +37,8 @@ typedef enum
     TOKEN_GREATER_EQUAL,
     TOKEN_LESS,
     TOKEN_LESS_EQUAL,
+    TOKEN_LESS_LESS,
+    TOKEN_GREATER_GREATER,
 
     // Literals.
     TOKEN_IDENTIFIER,
@@ -34,7 +48,10 @@ typedef enum
     // Keywords.
     TOKEN_AND,
     TOKEN_CLASS,
+    TOKEN_DO,
+    TOKEN_ELIF,
     TOKEN_ELSE,
+    TOKEN_END,
     TOKEN_FALSE,
     TOKEN_FOR,
     TOKEN_FUN,
@@ -42,8 +59,11 @@ typedef enum
     TOKEN_NONE,
     TOKEN_OR,
     TOKEN_PRINT,
+    TOKEN_PRINTLN,
     TOKEN_RETURN,
+    TOKEN_SCOPED,
     TOKEN_SUPER,
+    TOKEN_THEN,
     TOKEN_THIS,
     TOKEN_TRUE,
     TOKEN_VAR,
@@ -61,7 +81,15 @@ typedef struct
     int line;
 } Token;
 
-void initLexer(const char *src);
+// Hands the lexer more of a source that arrives in pieces (stdin, a pipe). The new
+// piece from *start to *end must begin with the last `kept` bytes of the old one.
+// The last token returned has to stay readable: it is in the old piece when
+// tokenSinceRefill is set and in the piece before that otherwise. Returns false at
+// the end of input; a piece with nothing new is fine if the next call fails.
+typedef bool (*RefillSource)(void *context, size_t kept, bool tokenSinceRefill, const char **start, const char **end);
+
+void initLexer(const char *src, const char *end);
+void initStreamLexer(RefillSource refill, void *context);
 Token scanToken();
 
 #endif
@@ -1,15 +1,27 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "common.h"
+#include "bytecode.h"
+#include "compiler.h"
 #include "program.h"
 #include "debug.h"
 #include "cvm.h"
+#include "source.h"
 
+// Every line is compiled onto the end of one program and run from where it starts,
+// so the functions a line defines outlive it.
 static void repl()
 {
   char line[1024];
+  Program program;
+  initProgram(&program);
 
   time_t t = time(NULL);
   struct tm tm = *localtime(&t);
@@ -26,75 +38,294 @@ static void repl()
       break;
     }
 
-    interpret(line);
+    int start = program.actuallyInUse;
+    int constCount = program.consts.actuallyInUse;
+
+    if (!compile(line, strlen(line), &program))
+    {
+      truncateProgram(&program, start);
+      program.consts.actuallyInUse = constCount;
+      continue;
+    }
+
+    interpretProgramFrom(&program, start);
   }
+
+  freeProgram(&program);
 }
 
-static char *readFile(const char *path)
+static int openSource(const char *path)
 {
-  FILE *file = fopen(path, "rb");
+  int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
 
-  if (file == NULL)
+  if (fd < 0)
   {
     fprintf(stderr, "Cannot open file \"%s\".\n", path);
     exit(74);
   }
 
-  fseek(file, 0L, SEEK_END);
-  size_t fileSize = ftell(file); // Return the current position of STREAM.
-  rewind(file);
+  return fd;
+}
 
-  char *buffer = (char *)malloc(fileSize + 1);
+// Compiles straight from a mapping of the file, or from a stream when it is a pipe
+// or a terminal. Either way the source is never copied whole.
+static bool compileSource(int fd, Program *program)
+{
+  SourceFile source;
 
-  if (buffer == NULL)
+  if (mapSource(fd, &source))
   {
-    fprintf(stderr, "Wow! There isn't enough memory to read \"%s\".\n", path);
-    exit(74);
+    bool compiled = compile(source.start, source.length, program);
+    unmapSource(&source);
+    return compiled;
   }
 
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+  SourceStream stream;
+  initSourceStream(&stream, fd);
 
-  if (bytesRead < fileSize)
-  {
-    fprintf(stderr, "Couldn't read file \"%s\".\n", path);
-    exit(74);
-  }
+  bool compiled = compileStream(refillSourceStream, &stream, program);
 
-  buffer[bytesRead] = '\0';
+  freeSourceStream(&stream);
+  return compiled;
+}
+
+static void runBytecode(const char *path)
+{
+  Program program;
+
+  if (!loadBytecode(path, &program))
+    exit(65);
+
+  InterpretResult result = interpretProgram(&program);
 
-  fclose(file);
-  return buffer;
+  freeProgram(&program);
+
+  if (result == INTERPRET_RUNTIME_ERROR)
+    exit(70);
 }
 
 static void runFile(const char *path)
 {
-  char *src = readFile(path);
+  struct stat info;
 
-  InterpretResult result = interpret(src);
+  // Peeking at a pipe for the .rvc header would swallow the start of the source.
+  if (stat(path, &info) == 0 && S_ISREG(info.st_mode) && isBytecodeFile(path))
+  {
+    runBytecode(path);
+    return;
+  }
 
-  free(src);
+  int fd = openSource(path);
+  Program program;
+  initProgram(&program);
+
+  bool compiled = compileSource(fd, &program);
+
+  if (fd != STDIN_FILENO)
+    close(fd);
 
-  if (result == INTERPRET_COMPILE_ERROR)
+  if (!compiled)
+  {
+    freeProgram(&program);
     exit(65);
+  }
+
+  InterpretResult result = interpretProgram(&program);
+
+  freeProgram(&program);
+
   if (result == INTERPRET_RUNTIME_ERROR)
     exit(70);
 }
 
+// Writes the compiled program to output, or next to path with a .rvc extension.
+// Leaves an existing file alone if it was compiled from the same source.
+static void compileFile(const char *path, const char *output)
+{
+  char defaultOutput[4096];
+
+  if (output == NULL)
+  {
+    size_t length = strlen(path);
+    bool hasExtension = length > 3 && strcmp(path + length - 3, ".rv") == 0;
+
+    if (snprintf(defaultOutput, sizeof(defaultOutput), "%s%s", path, hasExtension ? "c" : ".rvc") >= (int)sizeof(defaultOutput))
+    {
+      fprintf(stderr, "Path \"%s\" is too long.\n", path);
+      exit(64);
+    }
+
+    output = defaultOutput;
+  }
+
+  int fd = openSource(path);
+  SourceFile source;
+  SourceStream stream;
+  uint64_t sourceHash;
+  uint64_t existingHash;
+  bool compiled;
+
+  Program program;
+  initProgram(&program);
+
+  if (mapSource(fd, &source))
+  {
+    sourceHash = hashSource(source.start, source.length);
+
+    if (readBytecodeSourceHash(output, &existingHash) && existingHash == sourceHash)
+    {
+      unmapSource(&source);
+      close(fd);
+      return;
+    }
+
+    compiled = compile(source.start, source.length, &program);
+    unmapSource(&source);
+  }
+  else
+  {
+    // A stream is only hashed as it is compiled, so it is always written out.
+    initSourceStream(&stream, fd);
+    compiled = compileStream(refillSourceStream, &stream, &program);
+    sourceHash = stream.hash;
+    freeSourceStream(&stream);
+  }
+
+  if (fd != STDIN_FILENO)
+    close(fd);
+
+  if (!compiled)
+  {
+    freeProgram(&program);
+    exit(65);
+  }
+
+  bool written = writeBytecode(&program, sourceHash, output);
+  freeProgram(&program);
+
+  if (!written)
+    exit(74);
+}
+
+static Pool pool;
+
+// The allocator for the VM's objects, from RV_ALLOCATOR: malloc, the default, or pool
+// for size-class free lists.
+static Allocator *chooseAllocator()
+{
+  const char *name = getenv("RV_ALLOCATOR");
+
+  if (name == NULL || strcmp(name, "malloc") == 0)
+    return &mallocAllocator;
+
+  if (strcmp(name, "pool") == 0)
+  {
+    initPool(&pool);
+    return &pool.allocator;
+  }
+
+  fprintf(stderr, "RV_ALLOCATOR must be malloc or pool.\n");
+  exit(64);
+}
+
+// A collector setting from the environment variable name, or value when it is unset.
+// Exits unless it is a whole number from 1 to INT_MAX.
+static size_t gcSetting(const char *name, size_t value)
+{
+  const char *text = getenv(name);
+
+  if (text == NULL)
+    return value;
+
+  char *end;
+  errno = 0;
+  unsigned long long setting = strtoull(text, &end, 10);
+
+  if (text[0] < '0' || text[0] > '9' || *end != '\0' || errno != 0 || setting == 0 || setting > INT_MAX)
+  {
+    fprintf(stderr, "%s must be a whole number from 1 to %d.\n", name, INT_MAX);
+    exit(64);
+  }
+
+  return (size_t)setting;
+}
+
+#ifdef COUNT_INSTRUCTIONS
+static void printInstructionCount()
+{
+  fprintf(stderr, "instructions: %llu\n", (unsigned long long)vm.instructionCount);
+}
+#endif
+
+#ifdef MEMORY_STATS
+static bool statsAsJson;
+
+static void printStats()
+{
+  if (statsAsJson)
+  {
+    fprintf(stderr, "{");
+    printMemoryStats(stderr, true);
+    fprintf(stderr, ", ");
+    printGCStats(stderr, true);
+    fprintf(stderr, ", ");
+    printQuickeningStats(stderr, true);
+    fprintf(stderr, "}\n");
+    return;
+  }
+
+  printMemoryStats(stderr, false);
+  printGCStats(stderr, false);
+  printQuickeningStats(stderr, false);
+}
+#endif
+
 int main(int argc, const char *argv[])
 {
-  initCVM();
+  // --stats prints a memory, collector and quickening summary to stderr at exit,
+  // --stats=json the same as one JSON object.
+  if (argc > 1 && (strcmp(argv[1], "--stats") == 0 || strcmp(argv[1], "--stats=json") == 0))
+  {
+#ifdef MEMORY_STATS
+    statsAsJson = strcmp(argv[1], "--stats=json") == 0;
+    atexit(printStats);
+#else
+    fprintf(stderr, "This rv was built without MEMORY_STATS, so --stats is unavailable.\n");
+    exit(64);
+#endif
+    ++argv;
+    --argc;
+  }
+
+  Allocator *allocator = chooseAllocator();
+  initCVM(allocator);
+
+  // The pause a minor collection or a major step takes, and how often steps come,
+  // can be tuned without a rebuild. gc.h has the defaults.
+  vm.gc.nurserySize = gcSetting("RV_GC_NURSERY_SIZE", vm.gc.nurserySize);
+  vm.gc.stepBytes = gcSetting("RV_GC_STEP_BYTES", vm.gc.stepBytes);
+  vm.gc.stepWork = (int)gcSetting("RV_GC_STEP_WORK", (size_t)vm.gc.stepWork);
+
+#ifdef COUNT_INSTRUCTIONS
+  atexit(printInstructionCount);
+#endif
 
   Program program;
 
   initProgram(&program);
 
-  if (argc == 1)
+  // Piped input is a whole program, not lines typed at the prompt.
+  if (argc == 1 && isatty(STDIN_FILENO))
     repl();
-  else if (argc == 2)
+  else if (argc == 1)
+    runFile("-");
+  else if (argc == 2 && strcmp(argv[1], "-c") != 0)
     runFile(argv[1]);
+  else if ((argc == 3 || argc == 4) && strcmp(argv[1], "-c") == 0)
+    compileFile(argv[2], argc == 4 ? argv[3] : NULL);
   else
   {
-    fprintf(stderr, "Usage: rv <file>\n");
+    fprintf(stderr, "Usage: rv [--stats[=json]] [<file> | - | -c <file> [<output.rvc>]]\n");
     exit(64);
   }
 
@@ -102,5 +333,8 @@ int main(int argc, const char *argv[])
 
   freeCVM();
 
+  if (allocator->release != NULL)
+    allocator->release(allocator);
+
   return 0;
 }
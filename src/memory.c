@@ -1,16 +1,409 @@
 #include <stdlib.h>
+#include <string.h>
 #include "common.h"
 #include "memory.h"
 
-void* reallocate(void *previous, size_t oldSize, size_t newSize) 
+// Blocks are carved up on this boundary, enough for any Value.
+#define ALIGNMENT 16
+#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+#define ARENA_FIRST_BLOCK (16 * 1024)
+#define ARENA_MAX_BLOCK (1024 * 1024)
+// Allocations above this get a block of their own.
+#define ARENA_LARGE (8 * 1024)
+
+#define POOL_SLAB (64 * 1024)
+
+static void *mallocReallocate(Allocator *allocator, void *previous, size_t oldSize, size_t newSize)
 {
+  (void)allocator;
+  (void)oldSize;
+
   if (newSize == 0)
   {
     free(previous);
     return NULL;
   }
+
+  return realloc(previous, newSize);
+}
+
+Allocator mallocAllocator = {mallocReallocate, NULL};
+Allocator *currentAllocator = &mallocAllocator;
+
+void* reallocate(void *previous, size_t oldSize, size_t newSize)
+{
+  return currentAllocator->reallocate(currentAllocator, previous, oldSize, newSize);
+}
+
+#ifdef MEMORY_STATS
+
+typedef struct
+{
+  size_t live;
+  size_t peak;
+  uint64_t allocations;
+  uint64_t copiedBytes; // Moved by growing or shrinking allocations that did not stay put.
+} MemoryStats;
+
+static const char *categoryNames[MEMORY_CATEGORIES] = {"code", "lines", "constants", "stack", "objects", "other"};
+
+// One entry per category, then the total.
+static MemoryStats memoryStats[MEMORY_CATEGORIES + 1];
+
+static void countIn(MemoryStats *stats, size_t oldSize, size_t newSize)
+{
+  stats->live += newSize - oldSize;
+  if (stats->live > stats->peak)
+    stats->peak = stats->live;
+  if (oldSize == 0 && newSize != 0)
+    ++stats->allocations;
+}
+
+static void countMemory(MemoryCategory category, size_t oldSize, size_t newSize)
+{
+  countIn(&memoryStats[category], oldSize, newSize);
+  countIn(&memoryStats[MEMORY_CATEGORIES], oldSize, newSize);
+}
+
+void *reallocateFor(MemoryCategory category, void *previous, size_t oldSize, size_t newSize)
+{
+  void *result = reallocate(previous, oldSize, newSize);
+
+  if (newSize != 0 && result == NULL)
+    return NULL;
+
+  countMemory(category, previous == NULL ? 0 : oldSize, newSize);
+
+  if (previous != NULL && result != NULL && result != previous)
+  {
+    size_t copied = oldSize < newSize ? oldSize : newSize;
+    memoryStats[category].copiedBytes += copied;
+    memoryStats[MEMORY_CATEGORIES].copiedBytes += copied;
+  }
+
+  return result;
+}
+
+void printMemoryStats(FILE *file, bool json)
+{
+  if (json)
+  {
+    fprintf(file, "\"memory\": {");
+    for (int i = 0; i <= MEMORY_CATEGORIES; ++i)
+    {
+      MemoryStats *stats = &memoryStats[i];
+      fprintf(file, "%s\"%s\": {\"live\": %zu, \"peak\": %zu, \"allocations\": %llu, \"copied\": %llu}",
+              i == 0 ? "" : ", ", i == MEMORY_CATEGORIES ? "total" : categoryNames[i], stats->live, stats->peak,
+              (unsigned long long)stats->allocations, (unsigned long long)stats->copiedBytes);
+    }
+    fprintf(file, "}");
+    return;
+  }
+
+  fprintf(file, "%-10s %12s %12s %12s %12s\n", "memory", "live", "peak", "allocations", "copied");
+  for (int i = 0; i <= MEMORY_CATEGORIES; ++i)
+  {
+    MemoryStats *stats = &memoryStats[i];
+    fprintf(file, "%-10s %12zu %12zu %12llu %12llu\n", i == MEMORY_CATEGORIES ? "total" : categoryNames[i],
+            stats->live, stats->peak, (unsigned long long)stats->allocations, (unsigned long long)stats->copiedBytes);
+  }
+}
+
+#endif
+
+struct ArenaBlock
+{
+  ArenaBlock *previous;
+  ArenaBlock *next;
+};
+
+#define BLOCK_HEADER ALIGN(sizeof(ArenaBlock))
+#define BLOCK_DATA(block) ((char *)(block) + BLOCK_HEADER)
+#define DATA_BLOCK(data) ((ArenaBlock *)((char *)(data) - BLOCK_HEADER))
+
+static ArenaBlock *newArenaBlock(Arena *arena, size_t size)
+{
+  ArenaBlock *block = (ArenaBlock *)malloc(BLOCK_HEADER + size);
+
+  if (block == NULL)
+    return NULL;
+
+  block->previous = NULL;
+  block->next = arena->blocks;
+  if (arena->blocks != NULL)
+    arena->blocks->previous = block;
+  arena->blocks = block;
+
+  return block;
+}
+
+static void freeArenaBlock(Arena *arena, ArenaBlock *block)
+{
+  if (block->previous != NULL)
+    block->previous->next = block->next;
+  else
+    arena->blocks = block->next;
+
+  if (block->next != NULL)
+    block->next->previous = block->previous;
+
+  free(block);
+}
+
+// realloc() may move the block, so its neighbours are pointed at the new address.
+static void *resizeLargeBlock(Arena *arena, void *data, size_t newSize)
+{
+  ArenaBlock *block = (ArenaBlock *)realloc(DATA_BLOCK(data), BLOCK_HEADER + newSize);
+
+  if (block == NULL)
+    return NULL;
+
+  if (block->previous != NULL)
+    block->previous->next = block;
+  else
+    arena->blocks = block;
+
+  if (block->next != NULL)
+    block->next->previous = block;
+
+  return BLOCK_DATA(block);
+}
+
+static void *allocateSmall(Arena *arena, size_t size)
+{
+  size = ALIGN(size);
+
+  if (arena->top == NULL || (size_t)(arena->limit - arena->top) < size)
+  {
+    size_t blockSize = arena->nextBlockSize;
+
+    if (arena->nextBlockSize < ARENA_MAX_BLOCK)
+      arena->nextBlockSize *= 2;
+
+    ArenaBlock *block = newArenaBlock(arena, blockSize);
+
+    if (block == NULL)
+      return NULL;
+
+    arena->top = BLOCK_DATA(block);
+    arena->limit = arena->top + blockSize;
+  }
+
+  arena->last = arena->top;
+  arena->top += size;
+
+  return arena->last;
+}
+
+static void *arenaReallocate(Allocator *allocator, void *previous, size_t oldSize, size_t newSize)
+{
+  Arena *arena = (Arena *)allocator;
+  bool wasLarge = previous != NULL && oldSize > ARENA_LARGE;
+
+  if (wasLarge && newSize > ARENA_LARGE)
+    return resizeLargeBlock(arena, previous, newSize);
+
+  if (newSize == 0)
+  {
+    if (wasLarge)
+      freeArenaBlock(arena, DATA_BLOCK(previous));
+    else if (previous != NULL && previous == arena->last)
+    {
+      arena->top = arena->last;
+      arena->last = NULL;
+    }
+
+    return NULL;
+  }
+
+  if (previous != NULL && !wasLarge && newSize <= ARENA_LARGE)
+  {
+    if (newSize <= oldSize)
+      return previous;
+
+    // The latest allocation grows into the free space behind it.
+    if (previous == arena->last && (size_t)(arena->limit - arena->last) >= ALIGN(newSize))
+    {
+      arena->top = arena->last + ALIGN(newSize);
+      return previous;
+    }
+  }
+
+  void *result;
+
+  if (newSize > ARENA_LARGE)
+  {
+    ArenaBlock *block = newArenaBlock(arena, newSize);
+    result = block != NULL ? BLOCK_DATA(block) : NULL;
+  }
   else
+    result = allocateSmall(arena, newSize);
+
+  if (result == NULL)
+    return NULL;
+
+  if (previous != NULL)
+  {
+    memcpy(result, previous, oldSize < newSize ? oldSize : newSize);
+
+    if (wasLarge)
+      freeArenaBlock(arena, DATA_BLOCK(previous));
+  }
+
+  return result;
+}
+
+static void releaseArena(Allocator *allocator)
+{
+  Arena *arena = (Arena *)allocator;
+
+  while (arena->blocks != NULL)
   {
-	  return realloc(previous, newSize);
+    ArenaBlock *next = arena->blocks->next;
+    free(arena->blocks);
+    arena->blocks = next;
   }
-}                                                                 
+
+  arena->top = NULL;
+  arena->limit = NULL;
+  arena->last = NULL;
+  arena->nextBlockSize = ARENA_FIRST_BLOCK;
+}
+
+void initArena(Arena *arena)
+{
+  arena->allocator.reallocate = arenaReallocate;
+  arena->allocator.release = releaseArena;
+  arena->blocks = NULL;
+  arena->top = NULL;
+  arena->limit = NULL;
+  arena->last = NULL;
+  arena->nextBlockSize = ARENA_FIRST_BLOCK;
+}
+
+void freeArena(Arena *arena)
+{
+  releaseArena(&arena->allocator);
+}
+
+struct PoolSlab
+{
+  PoolSlab *next;
+};
+
+typedef struct FreeCell
+{
+  struct FreeCell *next;
+} FreeCell;
+
+// 16 bytes and under is class 0, 17 to 32 class 1, and so on.
+static int sizeClass(size_t size)
+{
+  if (size <= 16)
+    return 0;
+
+  return 32 - countLeadingZeros((uint32_t)(size - 1)) - 4;
+}
+
+static void *takeCell(Pool *pool, int sizeClass)
+{
+  if (pool->freeCells[sizeClass] == NULL)
+  {
+    size_t cellSize = (size_t)16 << sizeClass;
+    PoolSlab *slab = (PoolSlab *)malloc(POOL_SLAB);
+
+    if (slab == NULL)
+      return NULL;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    // Thread the new cells onto the free list back to front, so they are handed
+    // out in address order.
+    char *first = (char *)slab + ALIGN(sizeof(PoolSlab));
+    size_t count = (POOL_SLAB - ALIGN(sizeof(PoolSlab))) / cellSize;
+
+    for (size_t i = count; i-- > 0;)
+    {
+      FreeCell *cell = (FreeCell *)(first + i * cellSize);
+      cell->next = (FreeCell *)pool->freeCells[sizeClass];
+      pool->freeCells[sizeClass] = cell;
+    }
+  }
+
+  FreeCell *cell = (FreeCell *)pool->freeCells[sizeClass];
+  pool->freeCells[sizeClass] = cell->next;
+
+  return cell;
+}
+
+static void giveCell(Pool *pool, void *pointer, int sizeClass)
+{
+  FreeCell *cell = (FreeCell *)pointer;
+  cell->next = (FreeCell *)pool->freeCells[sizeClass];
+  pool->freeCells[sizeClass] = cell;
+}
+
+static void *poolReallocate(Allocator *allocator, void *previous, size_t oldSize, size_t newSize)
+{
+  Pool *pool = (Pool *)allocator;
+  bool wasPooled = previous != NULL && oldSize <= POOL_MAX_CELL;
+  bool isPooled = newSize != 0 && newSize <= POOL_MAX_CELL;
+
+  if (!wasPooled && !isPooled)
+    return mallocReallocate(allocator, previous, oldSize, newSize);
+
+  if (wasPooled && isPooled && sizeClass(oldSize) == sizeClass(newSize))
+    return previous;
+
+  void *result = NULL;
+
+  if (isPooled)
+    result = takeCell(pool, sizeClass(newSize));
+  else if (newSize != 0)
+    result = malloc(newSize);
+
+  if (newSize != 0 && result == NULL)
+    return NULL;
+
+  if (previous != NULL && result != NULL)
+    memcpy(result, previous, oldSize < newSize ? oldSize : newSize);
+
+  if (wasPooled)
+    giveCell(pool, previous, sizeClass(oldSize));
+  else
+    free(previous);
+
+  return result;
+}
+
+static void releasePool(Allocator *allocator)
+{
+  Pool *pool = (Pool *)allocator;
+
+  while (pool->slabs != NULL)
+  {
+    PoolSlab *next = pool->slabs->next;
+    free(pool->slabs);
+    pool->slabs = next;
+  }
+
+  for (int i = 0; i < POOL_SIZE_CLASSES; ++i)
+    pool->freeCells[i] = NULL;
+}
+
+void initPool(Pool *pool)
+{
+  pool->allocator.reallocate = poolReallocate;
+  pool->allocator.release = releasePool;
+  pool->slabs = NULL;
+
+  for (int i = 0; i < POOL_SIZE_CLASSES; ++i)
+    pool->freeCells[i] = NULL;
+}
+
+void freePool(Pool *pool)
+{
+  releasePool(&pool->allocator);
+}
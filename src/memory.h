@@ -1,15 +1,102 @@
 #ifndef MEMORY_H                    
 #define MEMORY_H                    
 
+#include "common.h"
+
 #define GROW_NUM_OF_ALLOCATED(numOfAllocated) ((numOfAllocated) < 8 ? 8 : (numOfAllocated) * 2)
 
-#define GROW_ARRAY(previous, type, oldCount, count) \
-    (type*)reallocate(previous, sizeof(type) * (oldCount), sizeof(type) * (count))
+// What an allocation is for, for the MEMORY_STATS report.
+typedef enum
+{
+    MEMORY_CODE,
+    MEMORY_LINES,
+    MEMORY_CONSTANTS,
+    MEMORY_STACK,
+    MEMORY_OBJECTS,
+    MEMORY_OTHER,
+    MEMORY_CATEGORIES
+} MemoryCategory;
+
+#define GROW_ARRAY(previous, type, oldCount, count) GROW_ARRAY_FOR(MEMORY_OTHER, previous, type, oldCount, count)
+
+#define GROW_ARRAY_FOR(category, previous, type, oldCount, count) \
+    (type*)reallocateFor(category, previous, sizeof(type) * (oldCount), sizeof(type) * (count))
 
-#define FREE_ARRAY(type, pointer, oldCount) reallocate(pointer, sizeof(type) * (oldCount), 0)           
+#define FREE_ARRAY(type, pointer, oldCount) FREE_ARRAY_FOR(MEMORY_OTHER, type, pointer, oldCount)
+
+#define FREE_ARRAY_FOR(category, type, pointer, oldCount) reallocateFor(category, pointer, sizeof(type) * (oldCount), 0)
 
 void *reallocate(void *previous, size_t oldSize, size_t newSize);
 
+#ifdef MEMORY_STATS
+#include <stdio.h>
+
+void *reallocateFor(MemoryCategory category, void *previous, size_t oldSize, size_t newSize);
+// A table, or with json the "memory" member of the object `rv --stats=json` prints.
+void printMemoryStats(FILE *file, bool json);
+#else
+#define reallocateFor(category, previous, oldSize, newSize) reallocate(previous, oldSize, newSize)
+#endif
+
+// reallocate() hands every request to the current allocator. release, when set,
+// frees all of the allocator's own blocks in one go.
+typedef struct Allocator Allocator;
+
+struct Allocator
+{
+    void *(*reallocate)(Allocator *allocator, void *previous, size_t oldSize, size_t newSize);
+    void (*release)(Allocator *allocator);
+};
+
+// Plain realloc() and free(), the default.
+extern Allocator mallocAllocator;
+extern Allocator *currentAllocator;
+
+// Makes allocator the current one and returns the one it replaces.
+static inline Allocator *useAllocator(Allocator *allocator)
+{
+    Allocator *previous = currentAllocator;
+    currentAllocator = allocator;
+    return previous;
+}
+
+// Bump allocation out of big blocks, for data that dies all at once (a compiled
+// Program). Only the latest allocation can grow or shrink in place; large ones get
+// a block of their own so growing them never copies more than realloc() would.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct
+{
+    Allocator allocator;
+    ArenaBlock *blocks;
+    char *top;
+    char *limit;
+    char *last;
+    size_t nextBlockSize;
+} Arena;
+
+void initArena(Arena *arena);
+void freeArena(Arena *arena);
+
+// Free lists of fixed-size cells carved out of slabs, one list per power-of-two
+// size class, for small objects that come and go at runtime. Bigger requests fall
+// through to realloc() and are not freed by freePool(). rv uses one for the VM with
+// RV_ALLOCATOR=pool.
+#define POOL_SIZE_CLASSES 5
+#define POOL_MAX_CELL (16 << (POOL_SIZE_CLASSES - 1))
+
+typedef struct PoolSlab PoolSlab;
+
+typedef struct
+{
+    Allocator allocator;
+    PoolSlab *slabs;
+    void *freeCells[POOL_SIZE_CLASSES];
+} Pool;
+
+void initPool(Pool *pool);
+void freePool(Pool *pool);
+
 /*
 oldSize		newSize						operation
 -----------------------------------------------------------------
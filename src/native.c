@@ -0,0 +1,117 @@
+#include <string.h>
+#include "cvm.h"
+#include "dict.h"
+#include "native.h"
+#include "numeric.h"
+#include "object.h"
+
+// Sets *list to args[index] when it is a list of numbers, unboxing it if need be.
+static bool numbersArg(const char *name, Value *args, int index, ObjDict **list)
+{
+  if (IS_DICT(args[index]) && dictUnbox(AS_DICT(args[index])))
+  {
+    *list = AS_DICT(args[index]);
+    return true;
+  }
+
+  runtimeError("%s() takes a list of numbers", name);
+  return false;
+}
+
+static bool lenNative(Value *args, Value *result)
+{
+  if (!IS_DICT(args[0]))
+  {
+    runtimeError("len() takes a dictionary");
+    return false;
+  }
+
+  *result = INT_VAL(AS_DICT(args[0])->arrayCount);
+  return true;
+}
+
+static bool sumNative(Value *args, Value *result)
+{
+  ObjDict *list;
+
+  if (!numbersArg("sum", args, 0, &list))
+    return false;
+
+  *result = NUMBER_VAL(sumNumbers(list->array.numbers, list->arrayCount));
+  return true;
+}
+
+static bool minNative(Value *args, Value *result)
+{
+  ObjDict *list;
+
+  if (!numbersArg("min", args, 0, &list))
+    return false;
+
+  *result = list->arrayCount > 0 ? NUMBER_VAL(minNumbers(list->array.numbers, list->arrayCount)) : NONE_VAL;
+  return true;
+}
+
+static bool maxNative(Value *args, Value *result)
+{
+  ObjDict *list;
+
+  if (!numbersArg("max", args, 0, &list))
+    return false;
+
+  *result = list->arrayCount > 0 ? NUMBER_VAL(maxNumbers(list->array.numbers, list->arrayCount)) : NONE_VAL;
+  return true;
+}
+
+static bool dotNative(Value *args, Value *result)
+{
+  ObjDict *a;
+  ObjDict *b;
+
+  if (!numbersArg("dot", args, 0, &a) || !numbersArg("dot", args, 1, &b))
+    return false;
+
+  if (a->arrayCount != b->arrayCount)
+  {
+    runtimeError("dot() takes lists of the same length, not %d and %d", a->arrayCount, b->arrayCount);
+    return false;
+  }
+
+  *result = NUMBER_VAL(dotNumbers(a->array.numbers, b->array.numbers, a->arrayCount));
+  return true;
+}
+
+static bool scaleNative(Value *args, Value *result)
+{
+  ObjDict *list;
+
+  if (!numbersArg("scale", args, 0, &list))
+    return false;
+
+  if (!IS_NUMBER(args[1]))
+  {
+    runtimeError("scale() takes a number to scale by");
+    return false;
+  }
+
+  ObjDict *scaled = newNumberList(list->arrayCount);
+  scaleNumbers(scaled->array.numbers, list->array.numbers, list->arrayCount, AS_NUMBER(args[1]));
+  *result = OBJ_VAL(scaled);
+  return true;
+}
+
+static void defineNative(const char *name, NativeFn function, int arity)
+{
+  int slot = globalSlot(copyString(name, (int)strlen(name)));
+  vm.globals[slot] = OBJ_VAL(newNative(name, function, arity));
+}
+
+void defineNatives()
+{
+  defineNative("len", lenNative, 1);
+  defineNative("sum", sumNative, 1);
+  defineNative("min", minNative, 1);
+  defineNative("max", maxNative, 1);
+  defineNative("dot", dotNative, 2);
+  defineNative("scale", scaleNative, 2);
+}
@@ -0,0 +1,16 @@
+#ifndef NATIVE_H
+#define NATIVE_H
+
+// Sets the globals every program starts with to the functions written in C:
+//
+//     len(d)        one past the last of the keys 0, 1, 2... of d
+//     sum(list)     the sum of a list of numbers
+//     min(list)     the smallest number in a list, none when it is empty
+//     max(list)     likewise, the largest
+//     dot(a, b)     the sum of a[i] * b[i], for lists of the same length
+//     scale(list, k) a new list of every number times k
+//
+// A list is the keys 0, 1, 2... of a dictionary, the others aren't looked at.
+void defineNatives();
+
+#endif
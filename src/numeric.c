@@ -0,0 +1,294 @@
+#include "numeric.h"
+
+#ifdef SIMD_LIST
+#ifdef __AVX__
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#endif
+
+// NUMERIC_LANES doubles, one AVX vector, two SSE2 ones or plain doubles. Min and max
+// take a < b ? a : b and a > b ? a : b lane by lane, which is what the instructions
+// do with a NaN too, so every version agrees on it.
+
+#if defined(SIMD_LIST) && defined(__AVX__)
+
+typedef __m256d Quad;
+
+static inline Quad loadQuad(const double *p)
+{
+  return _mm256_loadu_pd(p);
+}
+
+static inline void storeQuad(double *p, Quad a)
+{
+  _mm256_storeu_pd(p, a);
+}
+
+static inline Quad splatQuad(double x)
+{
+  return _mm256_set1_pd(x);
+}
+
+static inline Quad addQuad(Quad a, Quad b)
+{
+  return _mm256_add_pd(a, b);
+}
+
+static inline Quad mulQuad(Quad a, Quad b)
+{
+  return _mm256_mul_pd(a, b);
+}
+
+static inline Quad minQuad(Quad a, Quad b)
+{
+  return _mm256_min_pd(a, b);
+}
+
+static inline Quad maxQuad(Quad a, Quad b)
+{
+  return _mm256_max_pd(a, b);
+}
+
+#elif defined(SIMD_LIST)
+
+typedef struct
+{
+  __m128d low;
+  __m128d high;
+} Quad;
+
+static inline Quad loadQuad(const double *p)
+{
+  return (Quad){_mm_loadu_pd(p), _mm_loadu_pd(p + 2)};
+}
+
+static inline void storeQuad(double *p, Quad a)
+{
+  _mm_storeu_pd(p, a.low);
+  _mm_storeu_pd(p + 2, a.high);
+}
+
+static inline Quad splatQuad(double x)
+{
+  return (Quad){_mm_set1_pd(x), _mm_set1_pd(x)};
+}
+
+static inline Quad addQuad(Quad a, Quad b)
+{
+  return (Quad){_mm_add_pd(a.low, b.low), _mm_add_pd(a.high, b.high)};
+}
+
+static inline Quad mulQuad(Quad a, Quad b)
+{
+  return (Quad){_mm_mul_pd(a.low, b.low), _mm_mul_pd(a.high, b.high)};
+}
+
+static inline Quad minQuad(Quad a, Quad b)
+{
+  return (Quad){_mm_min_pd(a.low, b.low), _mm_min_pd(a.high, b.high)};
+}
+
+static inline Quad maxQuad(Quad a, Quad b)
+{
+  return (Quad){_mm_max_pd(a.low, b.low), _mm_max_pd(a.high, b.high)};
+}
+
+#else
+
+typedef struct
+{
+  double lanes[NUMERIC_LANES];
+} Quad;
+
+static inline Quad loadQuad(const double *p)
+{
+  return (Quad){{p[0], p[1], p[2], p[3]}};
+}
+
+static inline void storeQuad(double *p, Quad a)
+{
+  for (int i = 0; i < NUMERIC_LANES; ++i)
+    p[i] = a.lanes[i];
+}
+
+static inline Quad splatQuad(double x)
+{
+  return (Quad){{x, x, x, x}};
+}
+
+static inline Quad addQuad(Quad a, Quad b)
+{
+  for (int i = 0; i < NUMERIC_LANES; ++i)
+    a.lanes[i] += b.lanes[i];
+  return a;
+}
+
+static inline Quad mulQuad(Quad a, Quad b)
+{
+  for (int i = 0; i < NUMERIC_LANES; ++i)
+    a.lanes[i] *= b.lanes[i];
+  return a;
+}
+
+static inline Quad minQuad(Quad a, Quad b)
+{
+  for (int i = 0; i < NUMERIC_LANES; ++i)
+    a.lanes[i] = a.lanes[i] < b.lanes[i] ? a.lanes[i] : b.lanes[i];
+  return a;
+}
+
+static inline Quad maxQuad(Quad a, Quad b)
+{
+  for (int i = 0; i < NUMERIC_LANES; ++i)
+    a.lanes[i] = a.lanes[i] > b.lanes[i] ? a.lanes[i] : b.lanes[i];
+  return a;
+}
+
+#endif
+
+static inline double minOf(double a, double b)
+{
+  return a < b ? a : b;
+}
+
+static inline double maxOf(double a, double b)
+{
+  return a > b ? a : b;
+}
+
+// Lanes 0 and 2 together, then 1 and 3, which is how a vector is halved.
+static double sumLanes(Quad a)
+{
+  double lanes[NUMERIC_LANES];
+  storeQuad(lanes, a);
+  return (lanes[0] + lanes[2]) + (lanes[1] + lanes[3]);
+}
+
+static double minLanes(Quad a)
+{
+  double lanes[NUMERIC_LANES];
+  storeQuad(lanes, a);
+  return minOf(minOf(lanes[0], lanes[2]), minOf(lanes[1], lanes[3]));
+}
+
+static double maxLanes(Quad a)
+{
+  double lanes[NUMERIC_LANES];
+  storeQuad(lanes, a);
+  return maxOf(maxOf(lanes[0], lanes[2]), maxOf(lanes[1], lanes[3]));
+}
+
+// The reductions run four quads at a time, each into a result of its own, so that
+// an add doesn't wait for the one before it to finish. Kept in variables rather
+// than an array, which the compiler would leave in memory.
+#define NUMERIC_STEP (4 * NUMERIC_LANES)
+
+double sumNumbers(const double *numbers, int count)
+{
+  Quad sums0 = splatQuad(0), sums1 = sums0, sums2 = sums0, sums3 = sums0;
+  int i = 0;
+
+  for (; i + NUMERIC_STEP <= count; i += NUMERIC_STEP)
+  {
+    sums0 = addQuad(sums0, loadQuad(numbers + i));
+    sums1 = addQuad(sums1, loadQuad(numbers + i + NUMERIC_LANES));
+    sums2 = addQuad(sums2, loadQuad(numbers + i + 2 * NUMERIC_LANES));
+    sums3 = addQuad(sums3, loadQuad(numbers + i + 3 * NUMERIC_LANES));
+  }
+
+  for (; i + NUMERIC_LANES <= count; i += NUMERIC_LANES)
+    sums0 = addQuad(sums0, loadQuad(numbers + i));
+
+  double sum = sumLanes(addQuad(addQuad(sums0, sums2), addQuad(sums1, sums3)));
+
+  for (; i < count; ++i)
+    sum += numbers[i];
+
+  return sum;
+}
+
+double minNumbers(const double *numbers, int count)
+{
+  Quad mins0 = splatQuad(numbers[0]), mins1 = mins0, mins2 = mins0, mins3 = mins0;
+  int i = 0;
+
+  for (; i + NUMERIC_STEP <= count; i += NUMERIC_STEP)
+  {
+    mins0 = minQuad(loadQuad(numbers + i), mins0);
+    mins1 = minQuad(loadQuad(numbers + i + NUMERIC_LANES), mins1);
+    mins2 = minQuad(loadQuad(numbers + i + 2 * NUMERIC_LANES), mins2);
+    mins3 = minQuad(loadQuad(numbers + i + 3 * NUMERIC_LANES), mins3);
+  }
+
+  for (; i + NUMERIC_LANES <= count; i += NUMERIC_LANES)
+    mins0 = minQuad(loadQuad(numbers + i), mins0);
+
+  double min = minLanes(minQuad(minQuad(mins0, mins2), minQuad(mins1, mins3)));
+
+  for (; i < count; ++i)
+    min = minOf(numbers[i], min);
+
+  return min;
+}
+
+double maxNumbers(const double *numbers, int count)
+{
+  Quad maxes0 = splatQuad(numbers[0]), maxes1 = maxes0, maxes2 = maxes0, maxes3 = maxes0;
+  int i = 0;
+
+  for (; i + NUMERIC_STEP <= count; i += NUMERIC_STEP)
+  {
+    maxes0 = maxQuad(loadQuad(numbers + i), maxes0);
+    maxes1 = maxQuad(loadQuad(numbers + i + NUMERIC_LANES), maxes1);
+    maxes2 = maxQuad(loadQuad(numbers + i + 2 * NUMERIC_LANES), maxes2);
+    maxes3 = maxQuad(loadQuad(numbers + i + 3 * NUMERIC_LANES), maxes3);
+  }
+
+  for (; i + NUMERIC_LANES <= count; i += NUMERIC_LANES)
+    maxes0 = maxQuad(loadQuad(numbers + i), maxes0);
+
+  double max = maxLanes(maxQuad(maxQuad(maxes0, maxes2), maxQuad(maxes1, maxes3)));
+
+  for (; i < count; ++i)
+    max = maxOf(numbers[i], max);
+
+  return max;
+}
+
+double dotNumbers(const double *a, const double *b, int count)
+{
+  Quad sums0 = splatQuad(0), sums1 = sums0, sums2 = sums0, sums3 = sums0;
+  int i = 0;
+
+  for (; i + NUMERIC_STEP <= count; i += NUMERIC_STEP)
+  {
+    sums0 = addQuad(sums0, mulQuad(loadQuad(a + i), loadQuad(b + i)));
+    sums1 = addQuad(sums1, mulQuad(loadQuad(a + i + NUMERIC_LANES), loadQuad(b + i + NUMERIC_LANES)));
+    sums2 = addQuad(sums2, mulQuad(loadQuad(a + i + 2 * NUMERIC_LANES), loadQuad(b + i + 2 * NUMERIC_LANES)));
+    sums3 = addQuad(sums3, mulQuad(loadQuad(a + i + 3 * NUMERIC_LANES), loadQuad(b + i + 3 * NUMERIC_LANES)));
+  }
+
+  for (; i + NUMERIC_LANES <= count; i += NUMERIC_LANES)
+    sums0 = addQuad(sums0, mulQuad(loadQuad(a + i), loadQuad(b + i)));
+
+  double sum = sumLanes(addQuad(addQuad(sums0, sums2), addQuad(sums1, sums3)));
+
+  for (; i < count; ++i)
+    sum += a[i] * b[i];
+
+  return sum;
+}
+
+void scaleNumbers(double *result, const double *numbers, int count, double factor)
+{
+  Quad factors = splatQuad(factor);
+  int i = 0;
+
+  for (; i + NUMERIC_LANES <= count; i += NUMERIC_LANES)
+    storeQuad(result + i, mulQuad(loadQuad(numbers + i), factors));
+
+  for (; i < count; ++i)
+    result[i] = numbers[i] * factor;
+}
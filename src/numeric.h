@@ -0,0 +1,20 @@
+#ifndef NUMERIC_H
+#define NUMERIC_H
+
+#include "common.h"
+
+// Loops over the unboxed array part of a dictionary. The reductions keep running
+// results in vectors of NUMERIC_LANES and combine them in the same order whether or
+// not SIMD_LIST is on, so a build gives the same sums as any other.
+
+#define NUMERIC_LANES 4
+
+double sumNumbers(const double *numbers, int count);
+// count must be at least 1. A NaN is skipped unless it is the first number.
+double minNumbers(const double *numbers, int count);
+double maxNumbers(const double *numbers, int count);
+double dotNumbers(const double *a, const double *b, int count);
+// result may be numbers.
+void scaleNumbers(double *result, const double *numbers, int count, double factor);
+
+#endif
@@ -0,0 +1,371 @@
+#include <stdio.h>
+#include <string.h>
+#include "cvm.h"
+#include "dict.h"
+#include "gc.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+
+#define FNV_OFFSET_32 2166136261u
+#define FNV_PRIME_32 16777619u
+
+// FNV-1a, computed once when a string is made and kept in it.
+uint32_t hashString(const char *chars, int length)
+{
+  uint32_t hash = FNV_OFFSET_32;
+
+  for (int i = 0; i < length; ++i)
+  {
+    hash ^= (uint8_t)chars[i];
+    hash *= FNV_PRIME_32;
+  }
+
+  return hash;
+}
+
+static ObjString *allocateString(int length)
+{
+  ObjString *string = (ObjString *)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+  string->length = length;
+  string->chars[length] = '\0';
+
+  return string;
+}
+
+ObjString *copyString(const char *chars, int length)
+{
+  uint32_t hash = hashString(chars, length);
+  ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+
+  if (interned != NULL)
+    return interned;
+
+  // Objects belong to the VM, which frees them with its own allocator. The compiler
+  // makes string constants while the program's allocator may be the current one.
+  Allocator *previous = useAllocator(vm.allocator);
+
+  ObjString *string = allocateString(length);
+  string->hash = hash;
+  memcpy(string->chars, chars, length);
+
+  tableSet(&vm.strings, string, NONE_VAL);
+
+  useAllocator(previous);
+
+  return string;
+}
+
+// What one operand of a concatenation contributes.
+typedef struct
+{
+  const char *chars; // NULL for a rope that hasn't been flattened.
+  int length;
+  Obj *object;       // NULL for a number, which only exists as chars.
+} Text;
+
+static Text textOf(Value value, char *buffer)
+{
+  Text text;
+
+  if (IS_NUMBER(value))
+  {
+    text.chars = buffer;
+    text.length = IS_INT(value) ? formatInteger(AS_INT(value), buffer) : formatNumber(AS_FLOAT(value), buffer);
+    text.object = NULL;
+    return text;
+  }
+
+  if (IS_ROPE(value) && AS_ROPE(value)->flat != NULL)
+    value = OBJ_VAL(AS_ROPE(value)->flat);
+
+  if (IS_STRING(value))
+  {
+    text.chars = AS_CSTRING(value);
+    text.length = AS_STRING(value)->length;
+  }
+  else
+  {
+    text.chars = NULL;
+    text.length = AS_ROPE(value)->length;
+  }
+
+  text.object = AS_OBJ(value);
+  return text;
+}
+
+static Obj *textObject(Text text)
+{
+  return text.object != NULL ? text.object : &copyString(text.chars, text.length)->obj;
+}
+
+Value concatenate(Value a, Value b)
+{
+  char leftNumber[NUMBER_MAX_LENGTH];
+  char rightNumber[NUMBER_MAX_LENGTH];
+  Text left = textOf(a, leftNumber);
+  Text right = textOf(b, rightNumber);
+  int length = left.length + right.length;
+
+  // Ropes are always longer than this, so both sides have their characters.
+  if (length <= ROPE_THRESHOLD)
+  {
+    char chars[ROPE_THRESHOLD];
+    memcpy(chars, left.chars, left.length);
+    memcpy(chars + left.length, right.chars, right.length);
+    return OBJ_VAL(copyString(chars, length));
+  }
+
+  // Numbers become strings first, the rope only points at objects.
+  Obj *leftObject = textObject(left);
+  Obj *rightObject = textObject(right);
+
+  Allocator *previous = useAllocator(vm.allocator);
+
+  ObjRope *rope = (ObjRope *)allocateObject(sizeof(ObjRope), OBJ_ROPE);
+  rope->length = length;
+  rope->left = leftObject;
+  rope->right = rightObject;
+  rope->flat = NULL;
+
+  // The rope itself went to the old generation if the nursery was full.
+  writeBarrier(&rope->obj, leftObject);
+  writeBarrier(&rope->obj, rightObject);
+
+  useAllocator(previous);
+
+  return OBJ_VAL(rope);
+}
+
+// Copies the rope's characters into the rope->length bytes before end, right to
+// left. Only left children wait on the stack, so the left-leaning ropes built by
+// appending in a loop need a single slot however long they get.
+static void gatherRope(ObjRope *rope, char *end)
+{
+  Obj **pending = NULL;
+  int numOfAllocated = 0;
+  int actuallyInUse = 0;
+  Obj *node = &rope->obj;
+
+  while (true)
+  {
+    while (node->type == OBJ_ROPE && ((ObjRope *)node)->flat == NULL)
+    {
+      if (numOfAllocated < actuallyInUse + 1)
+      {
+        int oldNumOfAllocated = numOfAllocated;
+        numOfAllocated = GROW_NUM_OF_ALLOCATED(oldNumOfAllocated);
+        pending = GROW_ARRAY(pending, Obj *, oldNumOfAllocated, numOfAllocated);
+      }
+
+      pending[actuallyInUse++] = ((ObjRope *)node)->left;
+      node = ((ObjRope *)node)->right;
+    }
+
+    ObjString *string = node->type == OBJ_STRING ? (ObjString *)node : ((ObjRope *)node)->flat;
+    end -= string->length;
+    memcpy(end, string->chars, string->length);
+
+    if (actuallyInUse == 0)
+      break;
+
+    node = pending[--actuallyInUse];
+  }
+
+  FREE_ARRAY(Obj *, pending, numOfAllocated);
+}
+
+ObjString *flattenRope(ObjRope *rope)
+{
+  if (rope->flat != NULL)
+    return rope->flat;
+
+  Allocator *previous = useAllocator(vm.allocator);
+
+  ObjString *string = allocateString(rope->length);
+  gatherRope(rope, string->chars + rope->length);
+  string->hash = hashString(string->chars, string->length);
+
+  ObjString *interned = tableFindString(&vm.strings, string->chars, string->length, string->hash);
+
+  if (interned != NULL)
+  {
+    discardObject(&string->obj);
+    string = interned;
+  }
+  else
+    tableSet(&vm.strings, string, NONE_VAL);
+
+  // The pieces are no longer needed to produce the characters.
+  rope->flat = string;
+  rope->left = NULL;
+  rope->right = NULL;
+  writeBarrier(&rope->obj, &string->obj);
+
+  useAllocator(previous);
+
+  return string;
+}
+
+ObjFunction *newFunction(ObjString *name, int captureCount)
+{
+  Allocator *previous = useAllocator(vm.allocator);
+
+  ObjFunction *function =
+      (ObjFunction *)allocateObject(sizeof(ObjFunction) + captureCount * sizeof(Capture), OBJ_FUNCTION);
+  function->arity = 0;
+  function->entry = 0;
+  function->maxStackDepth = 0;
+  function->name = name;
+  function->captureCount = captureCount;
+
+  if (name != NULL)
+    writeBarrier(&function->obj, &name->obj);
+
+  useAllocator(previous);
+
+  return function;
+}
+
+ObjClosure *newClosure(ObjFunction *function)
+{
+  Allocator *previous = useAllocator(vm.allocator);
+
+  ObjClosure *closure =
+      (ObjClosure *)allocateObject(sizeof(ObjClosure) + function->captureCount * sizeof(Value), OBJ_CLOSURE);
+  closure->function = function;
+  closure->captureCount = function->captureCount;
+  writeBarrier(&closure->obj, &function->obj);
+
+  useAllocator(previous);
+
+  return closure;
+}
+
+ObjUpvalue *newUpvalue(int slot)
+{
+  Allocator *previous = useAllocator(vm.allocator);
+
+  ObjUpvalue *upvalue = (ObjUpvalue *)allocateObject(sizeof(ObjUpvalue), OBJ_UPVALUE);
+  upvalue->slot = slot;
+  upvalue->closed = NONE_VAL;
+  upvalue->nextOpen = NULL;
+
+  useAllocator(previous);
+
+  return upvalue;
+}
+
+ObjNative *newNative(const char *name, NativeFn function, int arity)
+{
+  Allocator *previous = useAllocator(vm.allocator);
+
+  ObjNative *native = (ObjNative *)allocateObject(sizeof(ObjNative), OBJ_NATIVE);
+  native->function = function;
+  native->arity = arity;
+  native->name = name;
+
+  useAllocator(previous);
+
+  return native;
+}
+
+static void printFunction(ObjFunction *function)
+{
+  if (function->name == NULL)
+    printf("<fun>");
+  else
+    printf("<fun %s>", function->name->chars);
+}
+
+// A dictionary may hold itself, so nesting is cut off this deep.
+#define DICT_PRINT_DEPTH 8
+
+// Keys 0, 1, 2... print as plain values, other keys as key: value, or as
+// [key]: value when the key isn't a string.
+static void printDict(ObjDict *dict)
+{
+  static int depth = 0;
+
+  if (depth == DICT_PRINT_DEPTH)
+  {
+    printf("{...}");
+    return;
+  }
+
+  ++depth;
+  printf("{");
+
+  const char *separator = "";
+  bool isDense = true;
+
+  for (int i = 0; i < dict->arrayCount; ++i)
+  {
+    Value value = dictArrayValue(dict, i);
+
+    if (IS_NONE(value))
+    {
+      isDense = false;
+      continue;
+    }
+
+    printf("%s", separator);
+    if (!isDense)
+      printf("[%d]: ", i);
+    printValue(value);
+    separator = ", ";
+  }
+
+  for (int i = 0; i < dict->capacity; ++i)
+  {
+    if (dict->control[i] < 0)
+      continue;
+
+    printf("%s", separator);
+    if (IS_STRING(dict->entries[i].key))
+      printValue(dict->entries[i].key);
+    else
+    {
+      printf("[");
+      printValue(dict->entries[i].key);
+      printf("]");
+    }
+    printf(": ");
+    printValue(dict->entries[i].value);
+    separator = ", ";
+  }
+
+  printf("}");
+  --depth;
+}
+
+void printObject(Value value)
+{
+  switch (OBJ_TYPE(value))
+  {
+  case OBJ_STRING:
+    fwrite(AS_CSTRING(value), 1, AS_STRING(value)->length, stdout);
+    break;
+  case OBJ_ROPE:
+  {
+    ObjString *string = flattenRope(AS_ROPE(value));
+    fwrite(string->chars, 1, string->length, stdout);
+    break;
+  }
+  case OBJ_FUNCTION:
+    printFunction(AS_FUNCTION(value));
+    break;
+  case OBJ_CLOSURE:
+    printFunction(AS_CLOSURE(value)->function);
+    break;
+  case OBJ_UPVALUE:
+    printf("<upvalue>"); // Never a value a program can get hold of.
+    break;
+  case OBJ_DICT:
+    printDict(AS_DICT(value));
+    break;
+  case OBJ_NATIVE:
+    printf("<fun %s>", AS_NATIVE(value)->name);
+    break;
+  }
+}
@@ -0,0 +1,211 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include "common.h"
+#include "value.h"
+
+#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+
+#define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+#define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_UPVALUE(value) isObjType(value, OBJ_UPVALUE)
+#define IS_DICT(value) isObjType(value, OBJ_DICT)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+
+#define AS_STRING(value) ((ObjString *)AS_OBJ(value))
+#define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+#define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
+#define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
+#define AS_UPVALUE(value) ((ObjUpvalue *)AS_OBJ(value))
+#define AS_DICT(value) ((ObjDict *)AS_OBJ(value))
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
+
+// Concatenations at most this long are copied right away, a rope node would be
+// about as big as the string.
+#define ROPE_THRESHOLD 64
+
+typedef enum
+{
+  OBJ_STRING,
+  OBJ_ROPE,
+  OBJ_FUNCTION,
+  OBJ_CLOSURE,
+  OBJ_UPVALUE,
+  OBJ_DICT,
+  OBJ_NATIVE,
+} ObjType;
+
+// Every heap object starts with an Obj. Old objects are threaded onto vm.objects
+// (see gc.h), young ones live in the nursery.
+struct Obj
+{
+  ObjType type;
+  bool isMarked;     // Reached by the current major cycle.
+  bool isRemembered; // Old, and in the remembered set for pointing at young objects.
+  struct Obj *next;  // The next old object. For a young object, its copy once promoted.
+};
+
+// Strings are interned: there is only ever one ObjString for a given sequence of
+// characters, so two strings are equal exactly when they are the same object. The
+// characters follow the header in the same allocation and are NUL-terminated.
+struct ObjString
+{
+  Obj obj;
+  int length;
+  uint32_t hash;
+  char chars[];
+};
+
+// The result of a concatenation too long to copy eagerly. Appending to a rope in a
+// loop allocates one node per step instead of copying everything built so far;
+// the characters are only gathered, once, when something needs them.
+typedef struct
+{
+  Obj obj;
+  int length;
+  Obj *left;       // A string or a rope, NULL once flattened.
+  Obj *right;      // Likewise.
+  ObjString *flat; // The interned result, NULL until flattened.
+} ObjRope;
+
+// How a closure gets one of the variables it captures, when it is made.
+typedef enum
+{
+  CAPTURE_VALUE,     // Copies the local in slot index, which is never assigned after its declaration.
+  CAPTURE_REFERENCE, // Shares the local in slot index through an ObjUpvalue.
+  CAPTURE_ENCLOSING, // Copies capture index of the running closure, whichever kind it is.
+} CaptureKind;
+
+typedef struct
+{
+  uint8_t kind; // A CaptureKind.
+  uint8_t index;
+} Capture;
+
+// A function's body is part of the code of the program that defines it, which jumps
+// over it. Calling one only needs to know where the body starts and how much stack
+// it takes, so a function is a constant and making one costs nothing at runtime.
+// One that captures variables of the functions around it is made into an ObjClosure
+// each time its definition runs instead.
+typedef struct
+{
+  Obj obj;
+  int arity;
+  int entry;         // Offset of the body in the program's code.
+  int maxStackDepth; // The most values the body has on the stack, counted from its callee's slot.
+  ObjString *name;   // NULL for an anonymous fun.
+  int captureCount;
+  Capture captures[];
+} ObjFunction;
+
+// A function with the variables it captured. A variable that is never assigned once
+// declared is simply copied in, so most closures are a single allocation. One that
+// is assigned must stay shared, and is captured as an ObjUpvalue instead.
+typedef struct
+{
+  Obj obj;
+  ObjFunction *function;
+  int captureCount;
+  Value captures[];
+} ObjClosure;
+
+// A captured variable that is assigned. While the scope that declared it runs the
+// variable stays in its stack slot, which the upvalue refers to, so code that
+// doesn't outlive the scope never sees the heap. When the scope ends the value
+// moves into the upvalue, for the closures that escaped it.
+typedef struct ObjUpvalue
+{
+  Obj obj;
+  int slot;                    // Index of the variable in vm.stack while open, -1 once closed.
+  Value closed;                // The variable once closed.
+  struct ObjUpvalue *nextOpen; // The open upvalue of the slot below, see vm.openUpvalues.
+} ObjUpvalue;
+
+// Sets *result from args[0] and the arguments after it. Returns false after
+// reporting a runtime error.
+typedef bool (*NativeFn)(Value *args, Value *result);
+
+// A function written in C, called like any other.
+typedef struct
+{
+  Obj obj;
+  NativeFn function;
+  int arity;
+  const char *name;
+} ObjNative;
+
+typedef struct
+{
+  Value key;
+  Value value;
+} DictEntry;
+
+// A dictionary. Keys 0, 1, 2... go in the array part and are found by indexing
+// it, every other key goes in the hash part, a Swiss table (see dict.c). Keys are
+// numbers, strings and booleans, which hash the same wherever the collector moves
+// them. A key that is missing reads as none.
+//
+// While every value in the array part is a number, the array part is a double[]
+// (a list of numbers is by far the most common dictionary), from the first value
+// that isn't it is a Value[]. An integer goes in as a double and reads back as one,
+// unless it is too large for a double to hold exactly, which boxes the array part.
+// Likewise integer keys are stored as doubles.
+//
+// The parts are allocated apart from the object, which is why dictionaries skip
+// the nursery: an old object that dies is freed one by one, so the parts can go
+// with it.
+typedef struct
+{
+  Obj obj;
+  // Keys 0 to arrayCount - 1. Boxed, there is none where one was removed but the last.
+  union
+  {
+    double *numbers; // While isNumeric.
+    Value *values;
+  } array;
+  bool isNumeric;
+  int arrayCount;
+  int arrayAllocated;
+  int8_t *control;    // A control byte for each slot of the hash part.
+  DictEntry *entries;
+  int capacity;       // Slots in the hash part, a power of two number of groups, or 0.
+  int count;          // Keys in the hash part.
+  int growthLeft;     // Empty slots that can still be filled before the hash part grows.
+} ObjDict;
+
+uint32_t hashString(const char *chars, int length);
+// Returns the interned string with these characters, creating it if there is none.
+ObjString *copyString(const char *chars, int length);
+// a @ b, where both are strings, ropes or numbers (see canConcatenate). Returns a
+// string, or a rope when the result is longer than ROPE_THRESHOLD.
+Value concatenate(Value a, Value b);
+// Returns the interned string with the rope's characters.
+ObjString *flattenRope(ObjRope *rope);
+// The captures are left for the caller to fill in.
+ObjFunction *newFunction(ObjString *name, int captureCount);
+// Likewise, the caller fills in the captures before anything can see the closure.
+ObjClosure *newClosure(ObjFunction *function);
+ObjUpvalue *newUpvalue(int slot);
+ObjNative *newNative(const char *name, NativeFn function, int arity);
+void printObject(Value value);
+
+static inline bool isObjType(Value value, ObjType type)
+{
+  return IS_OBJ(value) && AS_OBJ(value)->type == type;
+}
+
+static inline bool canConcatenate(Value value)
+{
+  return IS_NUMBER(value) || IS_STRING(value) || IS_ROPE(value);
+}
+
+// A rope stands for the string it flattens to.
+static inline Value flattenValue(Value value)
+{
+  return IS_ROPE(value) ? OBJ_VAL(flattenRope(AS_ROPE(value))) : value;
+}
+
+#endif
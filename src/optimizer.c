@@ -0,0 +1,237 @@
+#include "common.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+typedef struct
+{
+    OperationCode first;
+    OperationCode second;
+    OperationCode fused;
+} Superinstruction;
+
+// Adjacent pairs that are replaced by a single instruction. Add the pairs that show up
+// most in profiles here; the fused opcode takes the operands of first, then of second.
+static const Superinstruction superinstructions[] = {
+    {OP_EQUAL, OP_NOT, OP_NOT_EQUAL},
+    {OP_LESS, OP_NOT, OP_GREATER_EQUAL},
+    {OP_GREATER, OP_NOT, OP_LESS_EQUAL},
+    {OP_CONST, OP_EQUAL, OP_EQUAL_CONST},
+    {OP_CONST, OP_GREATER, OP_GREATER_CONST},
+    {OP_CONST, OP_LESS, OP_LESS_CONST},
+    {OP_CONST, OP_ADD, OP_ADD_CONST},
+    {OP_CONST, OP_SUBTRACT, OP_SUBTRACT_CONST},
+    {OP_CONST, OP_MULTIPLY, OP_MULTIPLY_CONST},
+    {OP_CONST, OP_DIVIDE, OP_DIVIDE_CONST},
+    {OP_EQUAL, OP_JUMP_IF_FALSE, OP_JUMP_IF_NOT_EQUAL},
+    {OP_NOT_EQUAL, OP_JUMP_IF_FALSE, OP_JUMP_IF_EQUAL},
+    {OP_GREATER, OP_JUMP_IF_FALSE, OP_JUMP_IF_NOT_GREATER},
+    {OP_LESS, OP_JUMP_IF_FALSE, OP_JUMP_IF_NOT_LESS},
+    {OP_LESS_EQUAL, OP_JUMP_IF_FALSE, OP_JUMP_IF_GREATER},
+    {OP_GREATER_EQUAL, OP_JUMP_IF_FALSE, OP_JUMP_IF_LESS},
+    {OP_NOT, OP_JUMP_IF_FALSE, OP_JUMP_IF_TRUE},
+    {OP_EQUAL_CONST, OP_JUMP_IF_FALSE, OP_JUMP_IF_NOT_EQUAL_CONST},
+    {OP_GREATER_CONST, OP_JUMP_IF_FALSE, OP_JUMP_IF_NOT_GREATER_CONST},
+    {OP_LESS_CONST, OP_JUMP_IF_FALSE, OP_JUMP_IF_NOT_LESS_CONST},
+    {OP_EQUAL_R, OP_JUMP_IF_FALSE, OP_JUMP_IF_NOT_EQUAL_R},
+    {OP_GREATER_R, OP_JUMP_IF_FALSE, OP_JUMP_IF_NOT_GREATER_R},
+    {OP_LESS_R, OP_JUMP_IF_FALSE, OP_JUMP_IF_NOT_LESS_R},
+};
+
+static bool findSuperinstruction(uint8_t first, uint8_t second, uint8_t *fused)
+{
+    for (size_t i = 0; i < sizeof(superinstructions) / sizeof(superinstructions[0]); ++i)
+    {
+        if (superinstructions[i].first == first && superinstructions[i].second == second)
+        {
+            *fused = (uint8_t)superinstructions[i].fused;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool isJump(uint8_t operationCode)
+{
+    switch (operationCode)
+    {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_FORPREP:
+    case OP_FORLOOP:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_NOT_EQUAL_CONST:
+    case OP_JUMP_IF_NOT_GREATER_CONST:
+    case OP_JUMP_IF_NOT_LESS_CONST:
+    case OP_JUMP_IF_NOT_EQUAL_R:
+    case OP_JUMP_IF_NOT_GREATER_R:
+    case OP_JUMP_IF_NOT_LESS_R:
+    case OP_JUMP_IF_NOT_GREATER_INT_CONST:
+    case OP_JUMP_IF_NOT_GREATER_FLOAT_CONST:
+    case OP_JUMP_IF_NOT_LESS_INT_CONST:
+    case OP_JUMP_IF_NOT_LESS_FLOAT_CONST:
+    case OP_JUMP_IF_NOT_GREATER_MIXED_CONST:
+    case OP_JUMP_IF_NOT_LESS_MIXED_CONST:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Every jump ends with its 16-bit offset, counted from the next instruction.
+static int jumpTarget(uint8_t *code, int offset)
+{
+    int next = offset + instructionLength(code[offset]);
+    int jump = code[next - 2] | (code[next - 1] << 8);
+    return code[offset] == OP_LOOP || code[offset] == OP_FORLOOP ? next - jump : next + jump;
+}
+
+static void setJumpTarget(uint8_t *code, int offset, int target)
+{
+    int next = offset + instructionLength(code[offset]);
+    int jump = code[offset] == OP_LOOP || code[offset] == OP_FORLOOP ? next - target : target - next;
+    code[next - 2] = (uint8_t)(jump & 0xff);
+    code[next - 1] = (uint8_t)((jump >> 8) & 0xff);
+}
+
+// Rewrites the code in place. Fusing only ever removes bytes, so the write offset
+// never overtakes the read offset. Every surviving byte keeps its line, the line
+// table is rebuilt alongside since the offsets of the runs move.
+//
+// An instruction that is jumped to, or that starts a function's body, can't become
+// the second half of a fused one. Jumps and functions are aimed at their targets'
+// new offsets once everything has moved.
+void optimizeProgram(Program *program)
+{
+    Allocator *previous = useAllocator(program->allocator);
+    uint8_t *code = program->code;
+    int count = program->actuallyInUse;
+    LineCursor cursor;
+    initLineCursor(&cursor, &program->lines);
+
+    LineTable lines;
+    initLineTable(&lines);
+
+    // Only allocated when there are jumps or functions: whether each old offset is a
+    // target, the new offset of each old one, and the new offset and old target of
+    // each jump.
+    bool *isTarget = NULL;
+    int *newOffsets = NULL;
+    int *jumps = NULL;
+    int jumpCount = 0;
+    bool hasFunctions = false;
+
+    for (int i = 0; i < program->consts.actuallyInUse && !hasFunctions; ++i)
+        hasFunctions = IS_FUNCTION(program->consts.values[i]);
+
+    for (int read = 0; read < count; read += instructionLength(code[read]))
+    {
+        if (isJump(code[read]))
+            ++jumpCount;
+    }
+
+    if (jumpCount > 0 || hasFunctions)
+    {
+        isTarget = GROW_ARRAY(NULL, bool, 0, count + 1);
+        for (int i = 0; i <= count; ++i)
+            isTarget[i] = false;
+
+        for (int read = 0; read < count; read += instructionLength(code[read]))
+        {
+            if (isJump(code[read]))
+                isTarget[jumpTarget(code, read)] = true;
+        }
+
+        for (int i = 0; i < program->consts.actuallyInUse; ++i)
+        {
+            if (IS_FUNCTION(program->consts.values[i]))
+                isTarget[AS_FUNCTION(program->consts.values[i])->entry] = true;
+        }
+
+        newOffsets = GROW_ARRAY(NULL, int, 0, count + 1);
+        jumps = GROW_ARRAY(NULL, int, 0, jumpCount * 2);
+    }
+
+    int write = 0;
+    int last = -1; // Offset of the last instruction written, the candidate first half.
+    int jumpsInUse = 0;
+
+    for (int read = 0; read < count;)
+    {
+        int length = instructionLength(code[read]);
+        uint8_t fused;
+
+        if (last >= 0 && (isTarget == NULL || !isTarget[read]) && findSuperinstruction(code[last], code[read], &fused))
+        {
+            // Drop the second opcode and append its operands to the fused instruction.
+            if (newOffsets != NULL)
+                newOffsets[read] = last;
+
+            // A fused jump is aimed again like any other, from where it now starts.
+            if (isJump(code[read]))
+            {
+                jumps[jumpsInUse++] = last;
+                jumps[jumpsInUse++] = jumpTarget(code, read);
+            }
+
+            code[last] = fused;
+            ++read;
+            --length;
+        }
+        else
+        {
+            if (newOffsets != NULL)
+                newOffsets[read] = write;
+
+            if (isJump(code[read]))
+            {
+                jumps[jumpsInUse++] = write;
+                jumps[jumpsInUse++] = jumpTarget(code, read);
+            }
+
+            last = write;
+        }
+
+        for (int i = 0; i < length; ++i, ++read, ++write)
+        {
+            code[write] = code[read];
+            writeLineTable(&lines, write, getCursorLine(&cursor, read));
+        }
+    }
+
+    if (isTarget != NULL)
+    {
+        newOffsets[count] = write;
+
+        for (int i = 0; i < jumpsInUse; i += 2)
+            setJumpTarget(code, jumps[i], newOffsets[jumps[i + 1]]);
+
+        for (int i = 0; i < program->consts.actuallyInUse; ++i)
+        {
+            if (IS_FUNCTION(program->consts.values[i]))
+            {
+                ObjFunction *function = AS_FUNCTION(program->consts.values[i]);
+                function->entry = newOffsets[function->entry];
+            }
+        }
+
+        FREE_ARRAY(int, jumps, jumpCount * 2);
+        FREE_ARRAY(int, newOffsets, count + 1);
+        FREE_ARRAY(bool, isTarget, count + 1);
+    }
+
+    program->actuallyInUse = write;
+
+    freeLineTable(&program->lines);
+    program->lines = lines;
+
+    useAllocator(previous);
+}
@@ -0,0 +1,8 @@
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include "program.h"
+
+void optimizeProgram(Program *program);
+
+#endif
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 
+#include "bytecode.h"
 #include "program.h"
 #include "memory.h"
 
@@ -8,37 +9,372 @@ void initProgram(Program *program)
   program->actuallyInUse = 0;
   program->numOfAllocated = 0;
   program->code = NULL;
-  program->lines = NULL;
+  initLineTable(&program->lines);
   initValueArray(&program->consts);
+  program->maxStackDepth = 0;
+  program->mapping = NULL;
+  program->mappingSize = 0;
+  initArena(&program->arena);
+  program->allocator = &program->arena.allocator;
 }
 
 void freeProgram(Program *program)
 {
-  FREE_ARRAY(uint8_t, program->code, program->numOfAllocated);
-  FREE_ARRAY(int, program->lines, program->numOfAllocated);
-  freeValueArray(&program->consts);
+  if (program->mapping != NULL)
+    unmapBytecode(program);
+  else
+  {
+    // In the program's arena these only matter to the memory stats; freeArena()
+    // then drops everything at once.
+    Allocator *previous = useAllocator(program->allocator);
+    FREE_ARRAY_FOR(MEMORY_CODE, uint8_t, program->code, program->numOfAllocated);
+    freeLineTable(&program->lines);
+    freeValueArray(&program->consts);
+    useAllocator(previous);
+
+    freeArena(&program->arena);
+  }
+
   initProgram(program);
 }
 
 void writeProgram(Program *program, uint8_t byte, int line)
 {
+  Allocator *previous = useAllocator(program->allocator);
+
   if (program->numOfAllocated < program->actuallyInUse + 1)
   {
     int oldNumOfAllocated = program->numOfAllocated;
 
     program->numOfAllocated = GROW_NUM_OF_ALLOCATED(oldNumOfAllocated);
 
-    program->code = GROW_ARRAY(program->code, uint8_t, oldNumOfAllocated, program->numOfAllocated);
-    program->lines = GROW_ARRAY(program->lines, int, oldNumOfAllocated, program->numOfAllocated);
+    program->code = GROW_ARRAY_FOR(MEMORY_CODE, program->code, uint8_t, oldNumOfAllocated, program->numOfAllocated);
   }
 
   program->code[program->actuallyInUse] = byte;
-  program->lines[program->actuallyInUse] = line;
+  writeLineTable(&program->lines, program->actuallyInUse, line);
   ++program->actuallyInUse;
+
+  useAllocator(previous);
+}
+
+// Drops the code from count onward, along with the lines that only it used.
+void truncateProgram(Program *program, int count)
+{
+  truncateLineTable(&program->lines, count);
+  program->actuallyInUse = count;
 }
 
 int addConst(Program *program, Value value)
 {
+  Allocator *previous = useAllocator(program->allocator);
   writeValueArray(&program->consts, value);
+  useAllocator(previous);
+
   return program->consts.actuallyInUse - 1;
 }
+
+// Size in bytes of an instruction, opcode included.
+int instructionLength(uint8_t operationCode)
+{
+  switch (operationCode)
+  {
+  case OP_CONST:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_EQUAL_CONST:
+  case OP_GREATER_CONST:
+  case OP_LESS_CONST:
+  case OP_ADD_CONST:
+  case OP_SUBTRACT_CONST:
+  case OP_MULTIPLY_CONST:
+  case OP_DIVIDE_CONST:
+  case OP_ADD_INT_CONST:
+  case OP_ADD_FLOAT_CONST:
+  case OP_SUBTRACT_INT_CONST:
+  case OP_SUBTRACT_FLOAT_CONST:
+  case OP_MULTIPLY_INT_CONST:
+  case OP_MULTIPLY_FLOAT_CONST:
+  case OP_ADD_MIXED_CONST:
+  case OP_SUBTRACT_MIXED_CONST:
+  case OP_MULTIPLY_MIXED_CONST:
+    return 2;
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_DICT:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_GREATER:
+  case OP_JUMP_IF_LESS:
+  case OP_JUMP_IF_TRUE:
+    return 3;
+  case OP_CONST_LONG:
+  case OP_CLOSURE:
+  case OP_EQUAL_R:
+  case OP_GREATER_R:
+  case OP_LESS_R:
+  case OP_ADD_R:
+  case OP_SUBTRACT_R:
+  case OP_MULTIPLY_R:
+  case OP_DIVIDE_R:
+  case OP_JUMP_IF_NOT_EQUAL_CONST:
+  case OP_JUMP_IF_NOT_GREATER_CONST:
+  case OP_JUMP_IF_NOT_LESS_CONST:
+  case OP_ADD_INT_R:
+  case OP_ADD_FLOAT_R:
+  case OP_SUBTRACT_INT_R:
+  case OP_SUBTRACT_FLOAT_R:
+  case OP_MULTIPLY_INT_R:
+  case OP_MULTIPLY_FLOAT_R:
+  case OP_JUMP_IF_NOT_GREATER_INT_CONST:
+  case OP_JUMP_IF_NOT_GREATER_FLOAT_CONST:
+  case OP_JUMP_IF_NOT_LESS_INT_CONST:
+  case OP_JUMP_IF_NOT_LESS_FLOAT_CONST:
+  case OP_ADD_MIXED_R:
+  case OP_SUBTRACT_MIXED_R:
+  case OP_MULTIPLY_MIXED_R:
+  case OP_JUMP_IF_NOT_GREATER_MIXED_CONST:
+  case OP_JUMP_IF_NOT_LESS_MIXED_CONST:
+    return 4;
+  case OP_FORPREP:
+  case OP_FORLOOP:
+    return 5;
+  case OP_JUMP_IF_NOT_EQUAL_R:
+  case OP_JUMP_IF_NOT_GREATER_R:
+  case OP_JUMP_IF_NOT_LESS_R:
+    return 6;
+  default:
+    return 1;
+  }
+}
+
+static void writeEncoded(LineTable *table, uint8_t byte)
+{
+  if (table->numOfAllocated < table->actuallyInUse + 1)
+  {
+    int oldNumOfAllocated = table->numOfAllocated;
+
+    table->numOfAllocated = GROW_NUM_OF_ALLOCATED(oldNumOfAllocated);
+    table->encoded = GROW_ARRAY_FOR(MEMORY_LINES, table->encoded, uint8_t, oldNumOfAllocated, table->numOfAllocated);
+  }
+
+  table->encoded[table->actuallyInUse] = byte;
+  ++table->actuallyInUse;
+}
+
+static void writeVarint(LineTable *table, uint32_t value)
+{
+  while (value >= 0x80)
+  {
+    writeEncoded(table, (uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+
+  writeEncoded(table, (uint8_t)value);
+}
+
+static uint32_t readVarint(uint8_t *encoded, int *position)
+{
+  uint32_t value = 0;
+  int shift = 0;
+  uint8_t byte;
+
+  do
+  {
+    byte = encoded[(*position)++];
+    value |= (uint32_t)(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+
+  return value;
+}
+
+// Applies the run encoded at *position to start.
+static void readRun(LineTable *table, int *position, LineStart *start)
+{
+  start->offset += (int)readVarint(table->encoded, position);
+
+  uint32_t zigzag = readVarint(table->encoded, position);
+  start->line += (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+}
+
+// Index of the last checkpoint at or before offset, -1 if offset precedes them all.
+static int findCheckpoint(LineTable *table, int offset)
+{
+  int low = 0;
+  int high = table->checkpointsInUse - 1;
+
+  while (low <= high)
+  {
+    int middle = low + (high - low) / 2;
+
+    if (table->checkpoints[middle].start.offset <= offset)
+      low = middle + 1;
+    else
+      high = middle - 1;
+  }
+
+  return high;
+}
+
+// Binary search over the checkpoints, then at most LINES_PER_CHECKPOINT runs decoded.
+int getLine(Program *program, int offset)
+{
+  LineTable *table = &program->lines;
+  int checkpoint = findCheckpoint(table, offset);
+
+  if (checkpoint < 0)
+    return 0;
+
+  LineStart start = table->checkpoints[checkpoint].start;
+  int position = table->checkpoints[checkpoint].position;
+
+  while (position < table->actuallyInUse)
+  {
+    LineStart next = start;
+    int nextPosition = position;
+    readRun(table, &nextPosition, &next);
+
+    if (next.offset > offset)
+      break;
+
+    start = next;
+    position = nextPosition;
+  }
+
+  return start.line;
+}
+
+void initLineTable(LineTable *table)
+{
+  table->numOfAllocated = 0;
+  table->actuallyInUse = 0;
+  table->encoded = NULL;
+  table->checkpointsAllocated = 0;
+  table->checkpointsInUse = 0;
+  table->checkpoints = NULL;
+  table->runs = 0;
+  table->last.offset = 0;
+  table->last.line = 0;
+}
+
+// Offsets must be written in increasing order.
+void writeLineTable(LineTable *table, int offset, int line)
+{
+  if (table->runs > 0 && table->last.line == line)
+    return;
+
+  int32_t lineDelta = line - table->last.line;
+
+  writeVarint(table, (uint32_t)(offset - table->last.offset));
+  writeVarint(table, ((uint32_t)lineDelta << 1) ^ (uint32_t)(lineDelta >> 31));
+
+  table->last.offset = offset;
+  table->last.line = line;
+
+  if (table->runs % LINES_PER_CHECKPOINT == 0)
+  {
+    if (table->checkpointsAllocated < table->checkpointsInUse + 1)
+    {
+      int oldAllocated = table->checkpointsAllocated;
+
+      table->checkpointsAllocated = GROW_NUM_OF_ALLOCATED(oldAllocated);
+      table->checkpoints =
+          GROW_ARRAY_FOR(MEMORY_LINES, table->checkpoints, LineCheckpoint, oldAllocated, table->checkpointsAllocated);
+    }
+
+    table->checkpoints[table->checkpointsInUse].start = table->last;
+    table->checkpoints[table->checkpointsInUse].position = table->actuallyInUse;
+    ++table->checkpointsInUse;
+  }
+
+  ++table->runs;
+}
+
+// Forgets the runs that start at count or later.
+void truncateLineTable(LineTable *table, int count)
+{
+  if (table->runs == 0 || table->last.offset < count)
+    return;
+
+  int checkpoint = findCheckpoint(table, count - 1);
+
+  if (checkpoint < 0)
+  {
+    table->actuallyInUse = 0;
+    table->checkpointsInUse = 0;
+    table->runs = 0;
+    table->last.offset = 0;
+    table->last.line = 0;
+    return;
+  }
+
+  LineStart start = table->checkpoints[checkpoint].start;
+  int position = table->checkpoints[checkpoint].position;
+  int runs = checkpoint * LINES_PER_CHECKPOINT + 1;
+
+  while (position < table->actuallyInUse)
+  {
+    LineStart next = start;
+    int nextPosition = position;
+    readRun(table, &nextPosition, &next);
+
+    if (next.offset >= count)
+      break;
+
+    start = next;
+    position = nextPosition;
+    ++runs;
+  }
+
+  table->actuallyInUse = position;
+  table->checkpointsInUse = checkpoint + 1;
+  table->runs = runs;
+  table->last = start;
+}
+
+void initLineCursor(LineCursor *cursor, LineTable *table)
+{
+  cursor->table = table;
+  cursor->position = 0;
+  cursor->current.offset = 0;
+  cursor->current.line = 0;
+
+  if (table->runs > 0)
+    readRun(table, &cursor->position, &cursor->current);
+}
+
+// Offsets passed to successive calls must not decrease.
+int getCursorLine(LineCursor *cursor, int offset)
+{
+  while (cursor->position < cursor->table->actuallyInUse)
+  {
+    LineStart next = cursor->current;
+    int nextPosition = cursor->position;
+    readRun(cursor->table, &nextPosition, &next);
+
+    if (next.offset > offset)
+      break;
+
+    cursor->current = next;
+    cursor->position = nextPosition;
+  }
+
+  return cursor->current.line;
+}
+
+void freeLineTable(LineTable *table)
+{
+  FREE_ARRAY_FOR(MEMORY_LINES, uint8_t, table->encoded, table->numOfAllocated);
+  FREE_ARRAY_FOR(MEMORY_LINES, LineCheckpoint, table->checkpoints, table->checkpointsAllocated);
+  initLineTable(table);
+}
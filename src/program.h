@@ -2,11 +2,13 @@
 #define PROGRAM_H
 
 #include "common.h"
+#include "memory.h"
 #include "value.h"
 
 typedef enum
 {
   OP_CONST,
+  OP_CONST_LONG, // 24-bit little-endian constant index.
   OP_NONE,
   OP_TRUE,
   OP_FALSE,
@@ -17,23 +19,209 @@ typedef enum
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_DIVIDE,
+  OP_FLOOR_DIVIDE,
+  OP_MODULO,
+  OP_POWER,
+  OP_BIT_AND,
+  OP_BIT_OR,
+  OP_BIT_XOR,
+  OP_SHIFT_LEFT,
+  OP_SHIFT_RIGHT,
+  OP_CONCAT,
   OP_NOT,
   OP_NEGATE,
-  OP_RETURN,
+  OP_BIT_NOT,
+  OP_POP,
+  OP_GET_GLOBAL,    // 16-bit little-endian slot in vm.globals.
+  OP_SET_GLOBAL,    // Likewise. Pops the value.
+  OP_GET_LOCAL,     // Stack slot, counted from the bottom of the frame.
+  OP_SET_LOCAL,     // Likewise. Pops the value.
+  OP_JUMP,          // 16-bit little-endian offset forward from the next instruction.
+  OP_JUMP_IF_FALSE, // Likewise. Pops the condition.
+  OP_LOOP,          // 16-bit little-endian offset back from the next instruction.
+  OP_PRINT,
+  OP_PRINTLN,
+  OP_CALL,          // Argument count. The callee is below its arguments, the result takes its slot.
+  OP_TAIL_CALL,     // Likewise, but the callee takes over the calling frame. An OP_RETURN follows for native callees.
+  OP_RETURN,        // Pops the result for the caller. Returning from the top level ends the program.
+  OP_CLOSURE,       // 24-bit little-endian index of a function constant, made into a closure.
+  OP_GET_UPVALUE,   // Index in the running closure's captures.
+  OP_SET_UPVALUE,   // Likewise. Pops the value.
+  OP_CLOSE_UPVALUE, // Pops the local on top of the stack, which an upvalue may refer to.
+  OP_DICT,          // Pushes a new dictionary. Array part and hash part sizes to start with, a byte each.
+  OP_DICT_SET,      // Pops a key and a value, in that order from the bottom, into the dictionary below them.
+  OP_GET_INDEX,     // Pops a dictionary and a key, pushes the key's value.
+  OP_SET_INDEX,     // Pops a dictionary, a key and a value, and sets the key.
+  OP_FORPREP,       // Loop variable slot, limit and step above it, a ForComparison, and a forward jump like OP_JUMP's.
+  OP_FORLOOP,       // Likewise, but adds the step and jumps back like OP_LOOP while the loop goes on.
+
+  // Three-address forms, only emitted and executed when REGISTER_VM is defined:
+  // OP_ADD_R dst, a, b where a and b are RK operands (see below).
+  OP_EQUAL_R,
+  OP_GREATER_R,
+  OP_LESS_R,
+  OP_ADD_R,
+  OP_SUBTRACT_R,
+  OP_MULTIPLY_R,
+  OP_DIVIDE_R,
+
+  // Superinstructions, only produced by optimizeProgram(). The operands of a fused
+  // instruction are those of its two parts, in order.
+  OP_NOT_EQUAL,
+  OP_GREATER_EQUAL,
+  OP_LESS_EQUAL,
+  OP_EQUAL_CONST,
+  OP_GREATER_CONST,
+  OP_LESS_CONST,
+  OP_ADD_CONST,
+  OP_SUBTRACT_CONST,
+  OP_MULTIPLY_CONST,
+  OP_DIVIDE_CONST,
+
+  // A comparison fused with the OP_JUMP_IF_FALSE after it, which jumps when the
+  // comparison is false: OP_LESS then OP_JUMP_IF_FALSE is OP_JUMP_IF_NOT_LESS.
+  OP_JUMP_IF_NOT_EQUAL,
+  OP_JUMP_IF_EQUAL,
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_GREATER,
+  OP_JUMP_IF_LESS,
+  OP_JUMP_IF_TRUE,
+  OP_JUMP_IF_NOT_EQUAL_CONST,
+  OP_JUMP_IF_NOT_GREATER_CONST,
+  OP_JUMP_IF_NOT_LESS_CONST,
+  OP_JUMP_IF_NOT_EQUAL_R,
+  OP_JUMP_IF_NOT_GREATER_R,
+  OP_JUMP_IF_NOT_LESS_R,
+
+  // Quickened forms, which run() rewrites the instruction above them into once it
+  // has seen two integers or two doubles (see QUICKENING in common.h). When that
+  // stops being so they become the _MIXED form, which runs like the instruction
+  // above but is never quickened again. Their operands are those of the instruction
+  // they stand in for. The compiler never emits them, so neither do .rvc files.
+  OP_ADD_INT,
+  OP_ADD_FLOAT,
+  OP_SUBTRACT_INT,
+  OP_SUBTRACT_FLOAT,
+  OP_MULTIPLY_INT,
+  OP_MULTIPLY_FLOAT,
+  OP_ADD_INT_CONST,
+  OP_ADD_FLOAT_CONST,
+  OP_SUBTRACT_INT_CONST,
+  OP_SUBTRACT_FLOAT_CONST,
+  OP_MULTIPLY_INT_CONST,
+  OP_MULTIPLY_FLOAT_CONST,
+  OP_ADD_INT_R,
+  OP_ADD_FLOAT_R,
+  OP_SUBTRACT_INT_R,
+  OP_SUBTRACT_FLOAT_R,
+  OP_MULTIPLY_INT_R,
+  OP_MULTIPLY_FLOAT_R,
+  OP_JUMP_IF_NOT_GREATER_INT_CONST,
+  OP_JUMP_IF_NOT_GREATER_FLOAT_CONST,
+  OP_JUMP_IF_NOT_LESS_INT_CONST,
+  OP_JUMP_IF_NOT_LESS_FLOAT_CONST,
+  OP_ADD_MIXED,
+  OP_SUBTRACT_MIXED,
+  OP_MULTIPLY_MIXED,
+  OP_ADD_MIXED_CONST,
+  OP_SUBTRACT_MIXED_CONST,
+  OP_MULTIPLY_MIXED_CONST,
+  OP_ADD_MIXED_R,
+  OP_SUBTRACT_MIXED_R,
+  OP_MULTIPLY_MIXED_R,
+  OP_JUMP_IF_NOT_GREATER_MIXED_CONST,
+  OP_JUMP_IF_NOT_LESS_MIXED_CONST,
 } OperationCode;
 
+// How OP_FORPREP and OP_FORLOOP compare the loop variable with the limit.
+typedef enum
+{
+  FOR_LESS,
+  FOR_LESS_EQUAL,
+  FOR_GREATER,
+  FOR_GREATER_EQUAL,
+} ForComparison;
+
+// An RK operand names a frame register, or a constant when RK_CONST is set.
+#define RK_CONST 0x80
+#define RK_MAX 0x7f
+
+#define CONST_LONG_MAX 0xffffff
+#define GLOBAL_MAX 0xffff
+#define LOCAL_MAX 0xff
+#define CAPTURE_MAX 0xff
+#define JUMP_MAX 0xffff
+
+#define IS_RK_CONST(operand) ((operand) & RK_CONST)
+#define RK_INDEX(operand) ((operand) & RK_MAX)
+
+// The line of every byte from offset up to the offset of the next LineStart.
+typedef struct
+{
+  int offset;
+  int line;
+} LineStart;
+
+// Absolute state after run number index * LINES_PER_CHECKPOINT, and where the
+// encoding of the following run begins.
+typedef struct
+{
+  LineStart start;
+  int position;
+} LineCheckpoint;
+
+#define LINES_PER_CHECKPOINT 32
+
+// One entry per change of line rather than one int per byte of code. Each run is
+// stored as a varint offset delta and a zigzag varint line delta (two bytes in the
+// usual case), with a checkpoint every LINES_PER_CHECKPOINT runs to binary search.
+typedef struct
+{
+  int numOfAllocated;
+  int actuallyInUse;
+  uint8_t *encoded;
+  int checkpointsAllocated;
+  int checkpointsInUse;
+  LineCheckpoint *checkpoints;
+  int runs;
+  LineStart last;
+} LineTable;
+
+// Decodes a LineTable front to back for passes that walk the code in order.
+typedef struct
+{
+  LineTable *table;
+  int position;
+  LineStart current;
+} LineCursor;
+
 typedef struct
 {
   int actuallyInUse;
   int numOfAllocated;
   uint8_t *code; // machine independent unsigned char
-  int *lines;
+  LineTable lines;
   ValueArray consts;
+  int maxStackDepth; // The most values the code ever has on the stack at once.
+  void *mapping; // Set when the arrays above live in a loaded .rvc file.
+  size_t mappingSize;
+  Arena arena;
+  Allocator *allocator; // Where the arrays above grow. The program's own arena unless replaced after initProgram.
 } Program;
 
 void initProgram(Program *program);
 void freeProgram(Program *program);
 void writeProgram(Program *program, uint8_t byte, int line);
+void truncateProgram(Program *program, int count);
 int addConst(Program *program, Value value);
+int getLine(Program *program, int offset);
+void initLineTable(LineTable *table);
+void writeLineTable(LineTable *table, int offset, int line);
+void truncateLineTable(LineTable *table, int count);
+void initLineCursor(LineCursor *cursor, LineTable *table);
+int getCursorLine(LineCursor *cursor, int offset);
+void freeLineTable(LineTable *table);
+int instructionLength(uint8_t operationCode);
 
 #endif
@@ -0,0 +1,155 @@
+// madvise() is not POSIX, glibc declares it under _DEFAULT_SOURCE.
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bytecode.h"
+#include "memory.h"
+#include "source.h"
+
+// How much a stream reads at a time, on top of what the lexer keeps.
+#define SOURCE_CHUNK (64 * 1024)
+
+bool mapSource(int fd, SourceFile *source)
+{
+  struct stat info;
+
+  if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+    return false;
+
+  source->mapping = NULL;
+  source->mappingSize = 0;
+
+  // mmap() refuses empty files.
+  if (info.st_size == 0)
+  {
+    source->start = "";
+    source->length = 0;
+    return true;
+  }
+
+  void *mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (mapping == MAP_FAILED)
+    return false;
+
+  madvise(mapping, (size_t)info.st_size, MADV_SEQUENTIAL);
+
+  source->start = mapping;
+  source->length = (size_t)info.st_size;
+  source->mapping = mapping;
+  source->mappingSize = (size_t)info.st_size;
+
+  return true;
+}
+
+void unmapSource(SourceFile *source)
+{
+  if (source->mapping != NULL)
+    munmap(source->mapping, source->mappingSize);
+
+  source->mapping = NULL;
+  source->mappingSize = 0;
+}
+
+void initSourceStream(SourceStream *stream, int fd)
+{
+  stream->fd = fd;
+  stream->buffers[0] = NULL;
+  stream->buffers[1] = NULL;
+  stream->numOfAllocated[0] = 0;
+  stream->numOfAllocated[1] = 0;
+  stream->current = 0;
+  stream->actuallyInUse = 0;
+  stream->atEnd = false;
+  stream->hash = hashSource(NULL, 0);
+}
+
+// A RefillSource for the lexer. Moves the kept bytes to the front of a buffer and
+// reads whatever has arrived after them. At the end of the input it hands back the
+// kept bytes alone once, and fails from then on.
+bool refillSourceStream(void *context, size_t kept, bool tokenSinceRefill, const char **start, const char **end)
+{
+  SourceStream *stream = (SourceStream *)context;
+
+  if (stream->atEnd)
+    return false;
+
+  int from = stream->current;
+  const char *keep = kept > 0 ? stream->buffers[from] + stream->actuallyInUse - kept : NULL;
+
+  // Write into whichever buffer does not hold the last token returned: the current
+  // one if a token has been returned since the last refill, the other one if not.
+  int to = tokenSinceRefill ? 1 - from : from;
+  size_t needed = kept + SOURCE_CHUNK;
+
+  if (to == from)
+  {
+    if (kept > 0)
+      memmove(stream->buffers[to], keep, kept);
+
+    if (stream->numOfAllocated[to] < needed)
+    {
+      stream->buffers[to] = GROW_ARRAY(stream->buffers[to], char, stream->numOfAllocated[to], needed);
+      stream->numOfAllocated[to] = needed;
+    }
+  }
+  else
+  {
+    if (stream->numOfAllocated[to] < needed)
+    {
+      FREE_ARRAY(char, stream->buffers[to], stream->numOfAllocated[to]);
+      stream->buffers[to] = GROW_ARRAY(NULL, char, 0, needed);
+      stream->numOfAllocated[to] = needed;
+    }
+
+    if (kept > 0)
+      memcpy(stream->buffers[to], keep, kept);
+  }
+
+  if (stream->buffers[to] == NULL)
+  {
+    fprintf(stderr, "Wow! There isn't enough memory to read the source.\n");
+    exit(74);
+  }
+
+  stream->current = to;
+  stream->actuallyInUse = kept;
+
+  ssize_t bytesRead;
+
+  do
+    bytesRead = read(stream->fd, stream->buffers[to] + kept, stream->numOfAllocated[to] - kept);
+  while (bytesRead < 0 && errno == EINTR);
+
+  if (bytesRead < 0)
+  {
+    fprintf(stderr, "Couldn't read the source: %s.\n", strerror(errno));
+    exit(74);
+  }
+
+  if (bytesRead == 0)
+    stream->atEnd = true;
+
+  stream->hash = continueSourceHash(stream->hash, stream->buffers[to] + kept, (size_t)bytesRead);
+  stream->actuallyInUse += (size_t)bytesRead;
+
+  *start = stream->buffers[to];
+  *end = stream->buffers[to] + stream->actuallyInUse;
+
+  return true;
+}
+
+void freeSourceStream(SourceStream *stream)
+{
+  for (int i = 0; i < 2; ++i)
+    FREE_ARRAY(char, stream->buffers[i], stream->numOfAllocated[i]);
+
+  initSourceStream(stream, -1);
+}
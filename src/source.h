@@ -0,0 +1,40 @@
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include "common.h"
+
+// Source text handed to the compiler. Regular files are mapped read-only rather
+// than copied; anything else (stdin, pipes) is read through a SourceStream.
+
+typedef struct
+{
+  const char *start;
+  size_t length;
+  void *mapping;
+  size_t mappingSize;
+} SourceFile;
+
+// Reads a stream in chunks, so compilation can start before the input has all
+// arrived. Two buffers take turns: when the lexer needs more, what it keeps moves to
+// the other one, leaving its last token where the parser saw it.
+typedef struct
+{
+  int fd;
+  char *buffers[2];
+  size_t numOfAllocated[2];
+  int current;
+  size_t actuallyInUse;
+  bool atEnd;
+  uint64_t hash;
+} SourceStream;
+
+// Returns false when fd is not a regular file that can be mapped. Read it through a
+// SourceStream then.
+bool mapSource(int fd, SourceFile *source);
+void unmapSource(SourceFile *source);
+
+void initSourceStream(SourceStream *stream, int fd);
+bool refillSourceStream(void *context, size_t kept, bool tokenSinceRefill, const char **start, const char **end);
+void freeSourceStream(SourceStream *stream);
+
+#endif
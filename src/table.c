@@ -0,0 +1,189 @@
+#include <string.h>
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+
+// Grow once three quarters of the slots are taken, tombstones included.
+#define TABLE_MAX_LOAD 0.75
+
+void initTable(Table *table)
+{
+  table->numOfAllocated = 0;
+  table->actuallyInUse = 0;
+  table->entries = NULL;
+}
+
+void freeTable(Table *table)
+{
+  FREE_ARRAY(Entry, table->entries, table->numOfAllocated);
+  initTable(table);
+}
+
+// The number of slots is a power of two, so the hash is masked rather than divided.
+static Entry *findEntry(Entry *entries, int numOfAllocated, ObjString *key)
+{
+  uint32_t mask = (uint32_t)numOfAllocated - 1;
+  Entry *tombstone = NULL;
+
+  for (uint32_t slot = key->hash & mask;; slot = (slot + 1) & mask)
+  {
+    Entry *entry = &entries[slot];
+
+    if (entry->key == key)
+      return entry;
+
+    if (entry->key == NULL)
+    {
+      if (IS_NONE(entry->value))
+        return tombstone != NULL ? tombstone : entry;
+
+      if (tombstone == NULL)
+        tombstone = entry;
+    }
+  }
+}
+
+static void adjustNumOfAllocated(Table *table, int numOfAllocated)
+{
+  Entry *entries = GROW_ARRAY(NULL, Entry, 0, numOfAllocated);
+
+  for (int i = 0; i < numOfAllocated; ++i)
+  {
+    entries[i].key = NULL;
+    entries[i].value = NONE_VAL;
+  }
+
+  // Tombstones are dropped on the way, so the count starts over.
+  table->actuallyInUse = 0;
+
+  for (int i = 0; i < table->numOfAllocated; ++i)
+  {
+    Entry *entry = &table->entries[i];
+
+    if (entry->key == NULL)
+      continue;
+
+    Entry *destination = findEntry(entries, numOfAllocated, entry->key);
+    destination->key = entry->key;
+    destination->value = entry->value;
+    ++table->actuallyInUse;
+  }
+
+  FREE_ARRAY(Entry, table->entries, table->numOfAllocated);
+  table->entries = entries;
+  table->numOfAllocated = numOfAllocated;
+}
+
+bool tableGet(Table *table, ObjString *key, Value *value)
+{
+  if (table->actuallyInUse == 0)
+    return false;
+
+  Entry *entry = findEntry(table->entries, table->numOfAllocated, key);
+
+  if (entry->key == NULL)
+    return false;
+
+  *value = entry->value;
+  return true;
+}
+
+// When it is mostly tombstones, as the string table gets once the collector has
+// deleted a lot of strings, the table is rebuilt at the same size rather than grown.
+static int nextNumOfAllocated(Table *table)
+{
+  int live = 0;
+
+  for (int i = 0; i < table->numOfAllocated; ++i)
+  {
+    if (table->entries[i].key != NULL)
+      ++live;
+  }
+
+  if (live + 1 <= table->numOfAllocated * TABLE_MAX_LOAD / 2)
+    return table->numOfAllocated;
+
+  return GROW_NUM_OF_ALLOCATED(table->numOfAllocated);
+}
+
+bool tableSet(Table *table, ObjString *key, Value value)
+{
+  if (table->actuallyInUse + 1 > table->numOfAllocated * TABLE_MAX_LOAD)
+    adjustNumOfAllocated(table, nextNumOfAllocated(table));
+
+  Entry *entry = findEntry(table->entries, table->numOfAllocated, key);
+  bool isNewKey = entry->key == NULL;
+
+  // Reusing a tombstone doesn't change the count, it was already included.
+  if (isNewKey && IS_NONE(entry->value))
+    ++table->actuallyInUse;
+
+  entry->key = key;
+  entry->value = value;
+
+  return isNewKey;
+}
+
+bool tableDelete(Table *table, ObjString *key)
+{
+  if (table->actuallyInUse == 0)
+    return false;
+
+  Entry *entry = findEntry(table->entries, table->numOfAllocated, key);
+
+  if (entry->key == NULL)
+    return false;
+
+  entry->key = NULL;
+  entry->value = BOOL_VAL(true);
+
+  return true;
+}
+
+void tableReplaceKey(Table *table, ObjString *key, ObjString *replacement)
+{
+  if (table->actuallyInUse == 0)
+    return;
+
+  Entry *entry = findEntry(table->entries, table->numOfAllocated, key);
+
+  if (entry->key == key)
+    entry->key = replacement;
+}
+
+void tableRemoveUnmarked(Table *table)
+{
+  for (int i = 0; i < table->numOfAllocated; ++i)
+  {
+    Entry *entry = &table->entries[i];
+
+    if (entry->key != NULL && !entry->key->obj.isMarked)
+    {
+      entry->key = NULL;
+      entry->value = BOOL_VAL(true);
+    }
+  }
+}
+
+ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash)
+{
+  if (table->actuallyInUse == 0)
+    return NULL;
+
+  uint32_t mask = (uint32_t)table->numOfAllocated - 1;
+
+  for (uint32_t slot = hash & mask;; slot = (slot + 1) & mask)
+  {
+    Entry *entry = &table->entries[slot];
+
+    if (entry->key == NULL)
+    {
+      // Stop at an empty slot, carry on past a tombstone.
+      if (IS_NONE(entry->value))
+        return NULL;
+    }
+    else if (entry->key->hash == hash && entry->key->length == length &&
+             memcmp(entry->key->chars, chars, length) == 0)
+      return entry->key;
+  }
+}
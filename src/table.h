@@ -0,0 +1,35 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include "common.h"
+#include "value.h"
+
+// Open-addressing hash table keyed by interned strings. Keys compare by pointer and
+// probe from the hash the string carries, so a lookup never touches the characters.
+typedef struct
+{
+  ObjString *key; // NULL for an empty slot, or a tombstone when value is true.
+  Value value;
+} Entry;
+
+typedef struct
+{
+  int numOfAllocated;
+  int actuallyInUse; // Live entries and tombstones, both count against the load factor.
+  Entry *entries;
+} Table;
+
+void initTable(Table *table);
+void freeTable(Table *table);
+bool tableGet(Table *table, ObjString *key, Value *value);
+// Returns true when key was not in the table yet.
+bool tableSet(Table *table, ObjString *key, Value value);
+bool tableDelete(Table *table, ObjString *key);
+// Puts replacement, a copy of key with the same hash, in key's entry.
+void tableReplaceKey(Table *table, ObjString *key, ObjString *replacement);
+// Deletes the entries of keys the collector didn't mark.
+void tableRemoveUnmarked(Table *table);
+// Finds a key by its characters, for interning them.
+ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
+
+#endif
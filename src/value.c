@@ -1,5 +1,8 @@
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 
 void initValueArray(ValueArray *array)
@@ -16,7 +19,7 @@ void writeValueArray(ValueArray *array, Value value)
     int oldnumOfAllocated = array->numOfAllocated;
 
     array->numOfAllocated = GROW_NUM_OF_ALLOCATED(oldnumOfAllocated);
-    array->values = GROW_ARRAY(array->values, Value, oldnumOfAllocated, array->numOfAllocated);
+    array->values = GROW_ARRAY_FOR(MEMORY_CONSTANTS, array->values, Value, oldnumOfAllocated, array->numOfAllocated);
   }
 
   array->values[array->actuallyInUse] = value;
@@ -25,12 +28,60 @@ void writeValueArray(ValueArray *array, Value value)
 
 void freeValueArray(ValueArray *array)
 {
-  FREE_ARRAY(Value, array->values, array->numOfAllocated);
+  FREE_ARRAY_FOR(MEMORY_CONSTANTS, Value, array->values, array->numOfAllocated);
   initValueArray(array);
 }
 
+int formatInteger(int64_t integer, char *buffer)
+{
+  uint64_t magnitude = integer < 0 ? -(uint64_t)integer : (uint64_t)integer;
+  char digits[20];
+  int count = 0;
+
+  do
+  {
+    digits[count++] = (char)('0' + magnitude % 10);
+    magnitude /= 10;
+  } while (magnitude != 0);
+
+  int length = 0;
+  if (integer < 0)
+    buffer[length++] = '-';
+  while (count > 0)
+    buffer[length++] = digits[--count];
+
+  return length;
+}
+
+int formatNumber(double number, char *buffer)
+{
+  // A double with no fraction is written like an integer while %g would write it
+  // as plain digits, at most six of them. -0 is left to snprintf() for its sign.
+  if (number > -1e6 && number < 1e6 && number == (double)(int)number && (number != 0 || !signbit(number)))
+    return formatInteger((int)number, buffer);
+
+  return snprintf(buffer, NUMBER_MAX_LENGTH, "%g", number);
+}
+
+static void printNumber(Value value)
+{
+  char buffer[NUMBER_MAX_LENGTH];
+  int length = IS_INT(value) ? formatInteger(AS_INT(value), buffer) : formatNumber(AS_FLOAT(value), buffer);
+  fwrite(buffer, 1, length, stdout);
+}
+
 void printValue(Value value)
 {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value))
+    printf(AS_BOOL(value) ? "true" : "false");
+  else if (IS_NONE(value))
+    printf("none");
+  else if (IS_NUMBER(value))
+    printNumber(value);
+  else if (IS_OBJ(value))
+    printObject(value);
+#else
   switch (value.type)
   {
   case VAL_BOOL:
@@ -40,13 +91,87 @@ void printValue(Value value)
     printf("none");
     break;
   case VAL_NUMBER:
-    printf("%g", AS_NUMBER(value));
+  case VAL_INT:
+    printNumber(value);
+    break;
+  case VAL_OBJ:
+    printObject(value);
     break;
   }
+#endif
+}
+
+int compareIntegerWithDouble(int64_t integer, double number)
+{
+  // 2^63 is a double and INT64_MAX isn't. Every double in [-2^63, 2^63) truncates to
+  // an int64_t exactly, and takes away from its whole part exactly.
+  if (number >= 0x1p63)
+    return -1;
+  if (number < -0x1p63)
+    return 1;
+  if (number != number)
+    return 0;
+
+  int64_t whole = (int64_t)number;
+
+  if (integer != whole)
+    return integer < whole ? -1 : 1;
+
+  double fraction = number - (double)whole;
+
+  return fraction > 0 ? -1 : fraction < 0 ? 1 : 0;
 }
 
 bool areValuesEqual(Value a, Value b)
 {
+  a = flattenValue(a);
+  b = flattenValue(b);
+
+  // An integer equals the double of the same value. Two integers compare as
+  // integers, which doubles can't tell apart past 2^53, and an integer and a double
+  // by their exact values.
+  if (IS_INT(a) && IS_INT(b))
+    return AS_INT(a) == AS_INT(b);
+  if (IS_INT(a) && IS_FLOAT(b))
+    return AS_FLOAT(b) == AS_FLOAT(b) && compareIntegerWithDouble(AS_INT(a), AS_FLOAT(b)) == 0;
+  if (IS_FLOAT(a) && IS_INT(b))
+    return AS_FLOAT(a) == AS_FLOAT(a) && compareIntegerWithDouble(AS_INT(b), AS_FLOAT(a)) == 0;
+
+  // Two doubles, so that NaN != NaN and 0 == -0.
+  if (IS_FLOAT(a) && IS_FLOAT(b))
+    return AS_FLOAT(a) == AS_FLOAT(b);
+
+#ifdef NAN_BOXING
+  // Strings are interned, so equal strings have the same pointer and the same bits.
+  return a == b;
+#else
+  if (a.type != b.type)
+    return false;
+
+  switch (a.type)
+  {
+  case VAL_BOOL:
+    return AS_BOOL(a) == AS_BOOL(b);
+  case VAL_NONE:
+    return true;
+  case VAL_NUMBER:
+  case VAL_INT:
+    return false; // Compared above.
+  case VAL_OBJ:
+    return AS_OBJ(a) == AS_OBJ(b); // Strings are interned, so equal strings are one object.
+  }
+
+  return false; // Unreachable.
+#endif
+}
+
+// Same type and same bits, so unlike areValuesEqual 0 and -0 differ and a NaN is
+// identical to itself. Two constants are interchangeable exactly when this holds.
+bool areValuesIdentical(Value a, Value b)
+{
+#ifdef NAN_BOXING
+  return a == b;
+#else
   if (a.type != b.type)
     return false;
 
@@ -57,6 +182,122 @@ bool areValuesEqual(Value a, Value b)
   case VAL_NONE:
     return true;
   case VAL_NUMBER:
-    return AS_NUMBER(a) == AS_NUMBER(b);
+    return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+  case VAL_INT:
+    return AS_INT(a) == AS_INT(b);
+  case VAL_OBJ:
+    return AS_OBJ(a) == AS_OBJ(b);
+  }
+
+  return false; // Unreachable.
+#endif
+}
+
+static uint32_t hashValue(Value value)
+{
+  uint64_t bits;
+
+#ifdef NAN_BOXING
+  bits = value;
+#else
+  if (IS_FLOAT(value))
+    memcpy(&bits, &value.as.number, sizeof(double));
+  else if (IS_INT(value))
+    bits = (uint64_t)AS_INT(value) ^ ((uint64_t)VAL_INT << 60);
+  else if (IS_OBJ(value))
+    bits = (uint64_t)(uintptr_t)AS_OBJ(value);
+  else
+    bits = ((uint64_t)value.type << 1) | (IS_BOOL(value) && AS_BOOL(value));
+#endif
+
+  // Doubles that differ only in their high bits are common (1, 2, 4...), so mix
+  // every bit into the low ones the index masks with (the murmur3 finalizer).
+  bits ^= bits >> 33;
+  bits *= 0xff51afd7ed558ccdULL;
+  bits ^= bits >> 33;
+  bits *= 0xc4ceb9fe1a85ec53ULL;
+  bits ^= bits >> 33;
+
+  return (uint32_t)bits;
+}
+
+void initValueIndex(ValueIndex *index)
+{
+  index->numOfAllocated = 0;
+  index->actuallyInUse = 0;
+  index->slots = NULL;
+}
+
+void freeValueIndex(ValueIndex *index)
+{
+  FREE_ARRAY(int, index->slots, index->numOfAllocated);
+  initValueIndex(index);
+}
+
+// Slots whose index is past the end of the array, or whose value changed after the
+// array was truncated, simply never match, so the index survives truncation.
+int findValueIndex(ValueIndex *index, ValueArray *array, Value value)
+{
+  if (index->numOfAllocated == 0)
+    return -1;
+
+  uint32_t mask = (uint32_t)index->numOfAllocated - 1;
+
+  for (uint32_t slot = hashValue(value) & mask;; slot = (slot + 1) & mask)
+  {
+    int position = index->slots[slot];
+
+    if (position == -1)
+      return -1;
+
+    if (position < array->actuallyInUse && areValuesIdentical(array->values[position], value))
+      return position;
+  }
+}
+
+static void insertValueIndex(ValueIndex *index, ValueArray *array, int position)
+{
+  uint32_t mask = (uint32_t)index->numOfAllocated - 1;
+  uint32_t slot = hashValue(array->values[position]) & mask;
+
+  while (index->slots[slot] != -1)
+    slot = (slot + 1) & mask;
+
+  index->slots[slot] = position;
+}
+
+void addValueIndex(ValueIndex *index, ValueArray *array, int position)
+{
+  // Keep the load factor at or under one half. Truncation leaves stale slots
+  // behind, and rehashing them would pile every stale slot for a reused position
+  // onto the same probe chain, so rebuild from the live values instead.
+  if ((index->actuallyInUse + 1) * 2 > index->numOfAllocated)
+  {
+    int newNumOfAllocated = 16;
+
+    while (newNumOfAllocated < (position + 1) * 4)
+      newNumOfAllocated *= 2;
+
+    // Most rebuilds only flush stale slots and can keep the same table.
+    if (newNumOfAllocated != index->numOfAllocated)
+    {
+      FREE_ARRAY(int, index->slots, index->numOfAllocated);
+      index->numOfAllocated = newNumOfAllocated;
+      index->slots = GROW_ARRAY(NULL, int, 0, index->numOfAllocated);
+    }
+
+    index->actuallyInUse = 0;
+
+    for (int i = 0; i < index->numOfAllocated; ++i)
+      index->slots[i] = -1;
+
+    for (int i = 0; i < position; ++i)
+    {
+      insertValueIndex(index, array, i);
+      ++index->actuallyInUse;
+    }
   }
+
+  insertValueIndex(index, array, position);
+  ++index->actuallyInUse;
 }
@@ -3,11 +3,76 @@
 
 #include "common.h"
 
+typedef struct Obj Obj;
+typedef struct ObjString ObjString;
+
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// A double is a number unless all of the quiet NaN bits are set. Real NaNs produced by
+// arithmetic only ever set bit 51, so the QNAN pattern below never collides with them.
+#define QNAN ((uint64_t)0x7ffc000000000000)
+// Objects set the sign bit as well and keep their pointer in the low 48 bits.
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+
+#define TAG_NONE 1  // 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE 3  // 11.
+// Integers set this bit above the quiet NaN and keep their 48-bit two's complement
+// in the low bits, where the tags above leave it clear.
+#define TAG_INT ((uint64_t)0x0002000000000000)
+#define INT_PAYLOAD ((uint64_t)0x0000ffffffffffff)
+
+typedef uint64_t Value;
+
+#define INTEGER_MAX ((int64_t)(INT_PAYLOAD >> 1))
+#define INTEGER_MIN (-INTEGER_MAX - 1)
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NONE(value) ((value) == NONE_VAL)
+#define IS_FLOAT(value) (((value) & QNAN) != QNAN)
+#define IS_INT(value) (((value) & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT))
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_FLOAT(value) valueToNumber(value)
+// Shifted up and back down again to copy the payload's sign into the top bits.
+#define AS_INT(value) ((int64_t)((value) << 16) >> 16)
+#define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(value) ((value) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NONE_VAL ((Value)(uint64_t)(QNAN | TAG_NONE))
+#define NUMBER_VAL(value) numberToValue(value)
+#define INT_VAL(value) ((Value)(QNAN | TAG_INT | ((uint64_t)(value) & INT_PAYLOAD)))
+#define OBJ_VAL(object) ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(object)))
+
+// memcpy is the portable way to type-pun, compilers turn it into a plain register move.
+static inline double valueToNumber(Value value)
+{
+  double number;
+  memcpy(&number, &value, sizeof(Value));
+  return number;
+}
+
+static inline Value numberToValue(double number)
+{
+  Value value;
+  memcpy(&value, &number, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum
 {
   VAL_BOOL,
   VAL_NONE,
-  VAL_NUMBER,
+  VAL_NUMBER, // A double.
+  VAL_INT,
+  VAL_OBJ,
 } ValueType;
 
 typedef struct
@@ -16,22 +81,56 @@ typedef struct
   union { // The size of a union is the size of its largest field
     bool boolean;
     double number;
+    int64_t integer;
+    Obj *obj;
   } as;
 } Value;
 
+#define INTEGER_MAX INT64_MAX
+#define INTEGER_MIN INT64_MIN
+
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NONE(value) ((value).type == VAL_NONE)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_FLOAT(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
+#define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_FLOAT(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
+#define AS_OBJ(value) ((value).as.obj)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NONE_VAL ((Value){VAL_NONE, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
+#define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)(object)}})
+
+#endif
+
+// A number is an integer or a double. NUMBER_VAL() makes a double and AS_NUMBER()
+// reads either as one. Integers hold 64 bits, or 48 when values are NaN-boxed, and
+// arithmetic that leaves that range gives a double instead (see arithmetic.h).
+// Functions rather than macros, as each looks at its argument twice.
+#define IS_NUMBER(value) valueIsNumber(value)
+#define AS_NUMBER(value) valueAsNumber(value)
+#define FITS_INTEGER(integer) ((integer) >= INTEGER_MIN && (integer) <= INTEGER_MAX)
+
+static inline bool valueIsNumber(Value value)
+{
+  return IS_INT(value) || IS_FLOAT(value);
+}
+
+static inline double valueAsNumber(Value value)
+{
+  return IS_INT(value) ? (double)AS_INT(value) : AS_FLOAT(value);
+}
 
 // typedef double Value;
 
+// Enough for any number formatNumber() or formatInteger() writes, with room for a NUL.
+#define NUMBER_MAX_LENGTH 32
+
 typedef struct
 {
   int numOfAllocated;
@@ -39,10 +138,30 @@ typedef struct
   Value *values;
 } ValueArray;
 
+// Open-addressing hash index over a ValueArray, for finding a value already in it.
+typedef struct
+{
+  int numOfAllocated;
+  int actuallyInUse;
+  int *slots; // Indices into the ValueArray, -1 for an empty slot.
+} ValueIndex;
+
+// Orders an integer against a double by their exact values, where converting the
+// integer would round it past 2^53: -1, 0 or 1 as integer is below, equal to or
+// above number. A NaN is neither below nor above, so it gives 0 too.
+int compareIntegerWithDouble(int64_t integer, double number);
 bool areValuesEqual(Value a, Value b);
+bool areValuesIdentical(Value a, Value b);
 void initValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value);
 void freeValueArray(ValueArray *array);
 void printValue(Value value);
+// Writes number the way printValue() prints it, returns the length. Not NUL-terminated.
+int formatNumber(double number, char *buffer);
+int formatInteger(int64_t integer, char *buffer);
+void initValueIndex(ValueIndex *index);
+void freeValueIndex(ValueIndex *index);
+int findValueIndex(ValueIndex *index, ValueArray *array, Value value);
+void addValueIndex(ValueIndex *index, ValueArray *array, int position);
 
 #endif